@@ -0,0 +1,328 @@
+/**
+ * AT parser and dispatcher in-process microbenchmark
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "atport.h"
+#include "cmux.h"
+#include "modem.h"
+
+#define ARRAY_SIZE(__a)		(sizeof(__a)/sizeof((__a)[0]))
+
+#define NSEC_PER_SEC		1000000000ULL
+
+enum feed_mode {
+	FEED_BYTE,		/* Byte at a time */
+	FEED_LINE,		/* Line at a time */
+	FEED_FRAME,		/* Multiplexer frame at a time */
+	FEED_BUFFER,		/* Whole stream at once */
+};
+
+struct bench_case {
+	const char *name;
+	enum feed_mode mode;
+	const char *lines[8];	/* Repeated input lines pattern */
+	unsigned dlcis;		/* Lines are framed over channels 1..N */
+};
+
+static const struct bench_case bench_cases[] = {
+	{"byte/short", FEED_BYTE, {"AT+CSQ\r"}},
+	{"line/short", FEED_LINE, {"AT+CSQ\r"}},
+	{"line/mix", FEED_LINE, {"AT+CSQ\r", "AT+COPS?\r", "AT^SYSINFOEX\r",
+				 "ATE1\r", "AT+CGMI=?\r", "AT+UNKNOWN\r"}},
+	{"buffer/mix", FEED_BUFFER, {"AT+CSQ\r", "AT+COPS?\r",
+				     "AT^SYSINFOEX\r", "ATE1\r", "AT+CGMI=?\r",
+				     "AT+UNKNOWN\r"}},
+	{"line/const", FEED_LINE, {"AT+CPIN?\r", "AT+CGMI\r", "AT^ICCID?\r",
+				   "AT^SYSINFOEX\r"}},
+	{"buffer/concat", FEED_BUFFER, {"AT+CSQ;+COPS?;^SYSINFOEX\r",
+					"ATE1S3?\r"}},
+	{"buffer/junk", FEED_BUFFER, {"\r\n~~ line noise ~~\r\n", "AT+CSQ\r",
+				      "#$%^&*()", "at+cops?\r"}},
+	{"buffer/overlong", FEED_BUFFER, {NULL}},	/* Built on the fly */
+	{"cmux/short", FEED_FRAME, {"AT+CSQ\r"}, 1},
+	{"cmux/mix", FEED_FRAME, {"AT+CSQ\r", "AT+COPS?\r", "AT^SYSINFOEX\r",
+				  "ATE1\r", "AT+CGMI=?\r", "AT+UNKNOWN\r"}, 4},
+	{"cmux/buffer", FEED_BUFFER, {"AT+CSQ\r", "AT+COPS?\r", "AT+CPIN?\r",
+				      "AT+CGMI\r"}, 4},
+};
+
+struct sink {
+	size_t bytes;
+};
+
+static int sink_write(const char *buf, size_t len, void *priv)
+{
+	struct sink *sink = priv;
+
+	sink->bytes += len;
+
+	return 0;
+}
+
+static const struct atops sink_atops = {
+	.write = sink_write,
+};
+
+static int sink_chan_open(struct atport *port, void *priv)
+{
+	return 0;
+}
+
+static void sink_chan_close(struct atport *port, void *priv)
+{
+}
+
+static const struct cmux_ops sink_cmux_ops = {
+	.write = sink_write,
+	.chan_open = sink_chan_open,
+	.chan_close = sink_chan_close,
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* Bitwise FCS, so the multiplexer lookup table is checked as well */
+static uint8_t frame_fcs(const uint8_t *buf, size_t len)
+{
+	uint8_t fcs = 0xFF;
+	unsigned i;
+
+	while (len--) {
+		fcs ^= *buf++;
+		for (i = 0; i < 8; ++i)
+			fcs = fcs & 1 ? fcs >> 1 ^ 0xE0 : fcs >> 1;
+	}
+
+	return 0xFF - fcs;
+}
+
+/* Build the initiator frame with a short info, returns the frame length */
+static size_t frame_build(uint8_t *buf, unsigned dlci, uint8_t ctrl,
+			  const char *info, size_t len)
+{
+	buf[0] = 0xF9;
+	buf[1] = dlci << 2 | 0x03;	/* C/R and EA bits */
+	buf[2] = ctrl;
+	buf[3] = len << 1 | 0x01;
+	memcpy(buf + 4, info, len);
+	buf[4 + len] = frame_fcs(buf + 1, ctrl == 0xEF ? 3 : 3 + len);
+	buf[5 + len] = 0xF9;
+
+	return len + 6;
+}
+
+/**
+ * Build an input stream of approximately the requested size by repeating the
+ * case lines, returns the number of commands in the stream. Lines of a
+ * multiplexed case are wrapped into UIH frames of the channels in turn.
+ */
+static size_t stream_build(const struct bench_case *bc, char *buf,
+			   size_t size, size_t *len)
+{
+	static char overlong[0x300 + 5];
+	const char *const *lines = bc->lines;
+	const char *ovl[] = {overlong, NULL};
+	size_t l, off = 0, ncmds = 0;
+	unsigned i;
+
+	if (!lines[0]) {
+		memset(overlong, 'X', sizeof(overlong) - 1);
+		memcpy(overlong, "AT+", 3);
+		overlong[sizeof(overlong) - 2] = '\r';
+		lines = ovl;
+	}
+
+	while (1) {
+		for (i = 0; i < ARRAY_SIZE(bc->lines) && lines[i]; ++i) {
+			l = strlen(lines[i]);
+			if (off + l + (bc->dlcis ? 6 : 0) > size)
+				goto out;
+			if (bc->dlcis)
+				off += frame_build((uint8_t *)buf + off,
+						   ncmds % bc->dlcis + 1, 0xEF,
+						   lines[i], l);
+			else
+				memcpy(buf + off, lines[i], l);
+			off += bc->dlcis ? 0 : l;
+			if (memchr(lines[i], '\r', l))
+				ncmds++;
+		}
+	}
+
+out:
+	*len = off;
+
+	return ncmds;
+}
+
+static int stream_feed(struct atport *port, struct cmux *mux,
+		       enum feed_mode mode, const char *buf, size_t len)
+{
+	const char *p, *e = buf + len;
+	size_t l;
+	int res;
+
+	for (p = buf; p < e; p += l) {
+		if (mode == FEED_BYTE) {
+			l = 1;
+		} else if (mode == FEED_LINE) {
+			const char *s3 = memchr(p, '\r', e - p);
+
+			l = s3 ? s3 + 1 - p : e - p;
+		} else if (mode == FEED_FRAME) {
+			const char *flag = memchr(p + 1, 0xF9, e - p - 1);
+
+			l = flag ? flag + 1 - p : e - p;
+		} else {
+			l = e - p;
+		}
+		res = mux ? cmux_parse(mux, p, l) : atport_parse(port, p, l);
+		if (res < 0)
+			return res;
+	}
+
+	return 0;
+}
+
+static int bench_run(const struct bench_case *bc, char *buf, size_t size,
+		     unsigned nruns)
+{
+	uint64_t t, best = UINT64_MAX;
+	struct atport *port = NULL;
+	struct modem_state *mdm;
+	struct cmux *mux = NULL;
+	uint8_t sabm[6];
+	struct sink sink;
+	size_t len, ncmds;
+	unsigned i;
+
+	ncmds = stream_build(bc, buf, size, &len);
+
+	mdm = modem_alloc(MODEM_MSGS_NUM_DEF);
+	if (!mdm)
+		return -ENOMEM;
+	if (bc->dlcis) {
+		mux = cmux_alloc(&sink_cmux_ops, &sink, modem_atcommands, mdm,
+				 0);
+		for (i = 1; mux && i <= bc->dlcis; ++i)
+			cmux_parse(mux, (char *)sabm,
+				   frame_build(sabm, i, 0x3F, NULL, 0));
+	} else {
+		port = atport_alloc(&sink_atops, &sink, modem_atcommands, mdm);
+		if (port)
+			modem_add_atport(mdm, port);
+	}
+	if (!port && !mux) {
+		modem_free(mdm);
+		return -ENOMEM;
+	}
+
+	/* Take the best run to filter out scheduling noise */
+	for (i = 0; i < nruns; ++i) {
+		sink.bytes = 0;
+		t = now_ns();
+		if (stream_feed(port, mux, bc->mode, buf, len))
+			break;
+		t = now_ns() - t;
+		if (t < best)
+			best = t;
+	}
+
+	if (best != UINT64_MAX)
+		printf("%-16s %10.1f MB/s %12.0f cmd/s %10zu B out\n", bc->name,
+		       len * 1.0e3 / best, ncmds * 1.0e9 / best, sink.bytes);
+	else
+		fprintf(stderr, "%s: parser failure\n", bc->name);
+
+	cmux_free(mux);
+	atport_free(port);
+	modem_free(mdm);
+
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	printf(
+		"AT parser and dispatcher microbenchmark\n"
+		"\n"
+		"Usage:\n"
+		"  %s -h\n"
+		"  %s [-s <size>] [-r <runs>] [<case>]...\n"
+		"\n"
+		"Options:\n"
+		"  -h        Print this message\n"
+		"  -s <size> Input stream size in KiB (default: 1024)\n"
+		"  -r <runs> Number of runs of each case, the best one is reported\n"
+		"            (default: 5)\n"
+		"  <case>    Run only the specified cases, where case is one of:\n"
+		"\n", name, name
+	);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *name = basename(argv[0]);
+	size_t size = 1024 * 1024;
+	unsigned i, j, nruns = 5;
+	char *buf;
+	int opt;
+
+	while (1) {
+		opt = getopt(argc, argv, "+hr:s:");
+		if (opt == -1)
+			break;
+		switch (opt) {
+		case 'h':
+			usage(name);
+			for (i = 0; i < ARRAY_SIZE(bench_cases); ++i)
+				printf("            %s\n", bench_cases[i].name);
+			return EXIT_SUCCESS;
+		case 'r':
+			nruns = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 0) * 1024;
+			break;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+
+	buf = malloc(size);
+	if (!buf) {
+		fprintf(stderr, "unable to allocate input stream buffer\n");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(bench_cases); ++i) {
+		for (j = optind; j < argc; ++j)
+			if (strcmp(argv[j], bench_cases[i].name) == 0)
+				break;
+		if (optind < argc && j == argc)
+			continue;
+		if (bench_run(&bench_cases[i], buf, size, nruns))
+			break;
+	}
+
+	free(buf);
+
+	return EXIT_SUCCESS;
+}
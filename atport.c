@@ -6,16 +6,64 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdarg.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
+#include <time.h>
 
 #include "atport.h"
 
+#define ARRAY_SIZE(__a)		(sizeof(__a)/sizeof((__a)[0]))
+
+enum atcmd_form {		/* Command access forms, see ATCMD_CACHE_xxx */
+	ATCMD_EXEC,		/* AT<cmd> */
+	ATCMD_READ,		/* AT<cmd>? */
+	ATCMD_TEST,		/* AT<cmd>=? */
+	ATCMD_WRITE,		/* AT<cmd>=<param> */
+	__ATCMD_FORM_NUM
+};
+
+static const char * const atcmd_form_names[__ATCMD_FORM_NUM] = {
+	[ATCMD_EXEC] = "exec",
+	[ATCMD_READ] = "read",
+	[ATCMD_TEST] = "test",
+	[ATCMD_WRITE] = "write",
+};
+
+#define ATPORT_LAT_BUCKETS	32	/* Log2 of nanoseconds */
+
+/**
+ * Constant responses are kept framed as a whole command line reply, so a
+ * line of the only such command costs a single copy, and the body part is
+ * used within a concatenated command line.
+ */
+#define ATPORT_RESP_HEAD	"\r\n"		/* See atport_cmd_exec_line() */
+#define ATPORT_RESP_TAIL	"\r\nOK\r\n"	/* See atport_cmd_report_status() */
+#define ATPORT_RESP_HLEN	(sizeof(ATPORT_RESP_HEAD) - 1)
+#define ATPORT_RESP_TLEN	(sizeof(ATPORT_RESP_TAIL) - 1)
+
+struct atport_resp {
+	char *buf;
+	size_t len;		/* Framed response length, 0 - not cached */
+	size_t size;
+};
+
+struct atport_cmdstat {
+	unsigned long calls;
+	unsigned long errors;
+	unsigned long long bytes;	/* Emitted response bytes */
+	unsigned long lat[ATPORT_LAT_BUCKETS];	/* Handler latency hist */
+};
+
 struct atport {
 	struct {		/* State flags */
 		int echo:1;		/* Echo input or not */
 		int echo_junk:1;	/* Echo input junk as well */
+		int busy:1;		/* Command line execution */
+		int pending:1;		/* Command completion is deferred */
+		int mux:1;		/* Multiplexer switch is requested */
 	} f;
 	enum {			/* AT command parser state */
 		AT_PARSER_WAIT_A,
@@ -27,117 +75,672 @@ struct atport {
 	} sym;
 	char cmdbuf[0x200];
 	int cmdlen;
+	struct {		/* Deferred completion command */
+		struct atport_cmdent *ent;
+		enum atcmd_form form;
+		uint64_t ts;		/* Execution start time */
+		size_t pos;		/* Rest of the command line offset */
+	} pend;
+	unsigned mux_n1;	/* Requested multiplexer frame size */
+	struct {		/* Input received during deferred completion */
+		char buf[0x200];
+		size_t len;
+	} inq;
+	struct {		/* Output buffer */
+		char *buf;
+		size_t len;
+		size_t size;
+		int err;		/* Line builder error, see atport_end() */
+	} out;
+	struct {		/* Deferred unsolicited result codes */
+		char buf[0x400];
+		size_t len;
+	} urc;
 	const struct atops *ops;
 	void *ops_priv;
 	const struct atcmd *cmds;
 	void *cmd_priv;
+	struct {		/* Commands index (open addressing hash table) */
+		struct atport_cmdent {
+			const struct atcmd *cmd;
+			void *priv;
+			size_t namelen;
+			struct atport_cmdstat st[__ATCMD_FORM_NUM];
+			struct atport_resp resp[ATCMD_WRITE];
+		} *ents;
+		unsigned mask;
+	} cidx;
+	struct {		/* Parser statistics */
+		unsigned long lines;	/* Executed command lines */
+		unsigned long errors;	/* Lines finished with ERROR */
+		unsigned long unknown;	/* Unknown commands */
+		unsigned long junk;	/* Junk bytes dropped */
+		unsigned long overflows;	/* Command buffer overflows */
+		unsigned long urcs;	/* Emitted URCs */
+		unsigned long urcs_dropped;	/* URCs deferred queue overflows */
+		unsigned long inq_dropped;	/* Input held queue overflows */
+	} st;
 };
 
-static int atport_gen_cmd_e0(struct atport *port)
+/**
+ * Make sure that the output buffer has room for at least len more bytes.
+ */
+static int atport_out_reserve(struct atport *port, size_t len)
+{
+	size_t size = port->out.size ? port->out.size : len;
+	char *buf;
+
+	if (port->out.size - port->out.len >= len)
+		return 0;
+
+	while (size - port->out.len < len)
+		size *= 2;
+	buf = realloc(port->out.buf, size);
+	if (!buf)
+		return -ENOMEM;
+	port->out.buf = buf;
+	port->out.size = size;
+
+	return 0;
+}
+
+/**
+ * Queue data into the output buffer. All the buffered data will be passed to
+ * the write callback at once by atport_flush(), so a whole command response
+ * costs a single write.
+ */
+static int atport_out(struct atport *port, const char *buf, size_t len)
+{
+	int res = atport_out_reserve(port, len);
+
+	if (res)
+		return res;
+
+	memcpy(port->out.buf + port->out.len, buf, len);
+	port->out.len += len;
+
+	return 0;
+}
+
+int atport_flush(struct atport *port)
+{
+	size_t len = port->out.len;
+
+	if (!len)
+		return 0;
+
+	port->out.len = 0;
+
+	return port->ops->write(port->out.buf, len, port->ops_priv);
+}
+
+static int atport_gen_cmd_e0(struct atport *port, void *priv)
 {
 	port->f.echo = 0;
 
 	return 0;
 }
 
-static int atport_gen_cmd_e1(struct atport *port)
+static int atport_gen_cmd_e1(struct atport *port, void *priv)
 {
 	port->f.echo = 1;
 
 	return 0;
 }
 
-static int atport_gen_cmd_s3_read(struct atport *port)
+static int atport_gen_cmd_s3_read(struct atport *port, void *priv)
 {
 	return atport_printf(port, "%03d", port->sym.s3);
 }
 
-static int atport_gen_cmd_stub(struct atport *port)
+static int atport_gen_cmd_stub(struct atport *port, void *priv)
 {
 	return 0;
 }
 
-typedef int (* cmd_a0_t)(void *priv);
-
 static const struct atcmd atport_gen_cmds[] = {
-	{"S3", .exec = (cmd_a0_t)atport_gen_cmd_stub,
-	       .read = (cmd_a0_t)atport_gen_cmd_s3_read},
-	{"E0", .exec = (cmd_a0_t)atport_gen_cmd_e0},
-	{"E1", .exec = (cmd_a0_t)atport_gen_cmd_e1},
-	{"", .exec = (cmd_a0_t)atport_gen_cmd_stub},
+	{"S3", .exec = atport_gen_cmd_stub, .read = atport_gen_cmd_s3_read},
+	{"E0", .exec = atport_gen_cmd_e0},
+	{"E1", .exec = atport_gen_cmd_e1},
+	{"", .exec = atport_gen_cmd_stub},
 	{NULL}
 };
 
-static int atport_cmd_lookup_and_exec(struct atport *port, const char *str,
-				      const struct atcmd *cmds, void *priv)
+/* Case insensitive FNV-1a hash of a command name */
+static unsigned atport_cmd_hash(const char *name, size_t len)
 {
-	size_t cplen = strcspn(str, "=?");	/* Command prefix length */
+	unsigned h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		h ^= toupper((unsigned char)name[i]);
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static void atport_cmd_index_add(struct atport *port,
+				 const struct atcmd *cmds, void *priv)
+{
+	struct atport_cmdent *ent;
 	const struct atcmd *c;
-	int l;
+	unsigned i;
+	size_t l;
 
 	for (c = cmds; c->name; ++c) {
 		l = strlen(c->name);
-		if (l == cplen && strncasecmp(c->name, str, l) == 0)
-			break;
+		i = atport_cmd_hash(c->name, l) & port->cidx.mask;
+		while (port->cidx.ents[i].cmd)
+			i = (i + 1) & port->cidx.mask;
+		ent = &port->cidx.ents[i];
+		ent->cmd = c;
+		ent->priv = priv;
+		ent->namelen = l;
 	}
-	if (!c->name)
+}
+
+/**
+ * Build the commands index once on port allocation. Custom commands are added
+ * first, so they are probed before the generic ones with the same name.
+ */
+static int atport_cmd_index_build(struct atport *port)
+{
+	const struct atcmd *c;
+	unsigned n = 0, sz = 1;
+
+	for (c = port->cmds; c && c->name; ++c)
+		n++;
+	for (c = atport_gen_cmds; c->name; ++c)
+		n++;
+	while (sz < n * 2)	/* Keep load factor below 0.5 */
+		sz <<= 1;
+
+	port->cidx.ents = calloc(sz, sizeof(*port->cidx.ents));
+	if (!port->cidx.ents)
+		return -ENOMEM;
+	port->cidx.mask = sz - 1;
+
+	if (port->cmds)
+		atport_cmd_index_add(port, port->cmds, port->cmd_priv);
+	atport_cmd_index_add(port, atport_gen_cmds, NULL);
+
+	return 0;
+}
+
+static enum atcmd_form atport_cmd_form(const char *str)
+{
+	if (strcmp(str, "=?") == 0)
+		return ATCMD_TEST;
+	else if (strcmp(str, "?") == 0)
+		return ATCMD_READ;
+	else if (str[0] == '\0')
+		return ATCMD_EXEC;
+
+	return ATCMD_WRITE;
+}
+
+static int atport_cmd_handler_call(struct atport *port,
+				   const struct atcmd *c,
+				   enum atcmd_form form, const char *str,
+				   void *priv)
+{
+	switch (form) {
+	case ATCMD_EXEC:
+		return c->exec ? c->exec(port, priv) : -ENOENT;
+	case ATCMD_READ:
+		return c->read ? c->read(port, priv) : -ENOENT;
+	case ATCMD_TEST:
+		return c->test ? c->test(port, priv) : -ENOENT;
+	case ATCMD_WRITE:
+		return c->write ? c->write(port, str + 1, priv) : -ENOENT;
+	default:
 		return -ENOENT;
+	}
+}
 
-	str += cplen;
-	if (strcmp(str, "=?") == 0)		/* AT<cmd>=? */
-		return c->test ? c->test(priv) : -ENOENT;
-	else if (strcmp(str, "?") == 0)		/* AT<cmd>? */
-		return c->read ? c->read(priv) : -ENOENT;
-	else if (str[0] == '\0')		/* AT<cmd> */
-		return c->exec ? c->exec(priv) : -ENOENT;
+static const char *atport_cmd_resp_line(const struct atcmd *c,
+					enum atcmd_form form)
+{
+	switch (form) {
+	case ATCMD_EXEC:
+		return c->exec ? NULL : c->resp.exec;
+	case ATCMD_READ:
+		return c->read ? NULL : c->resp.read;
+	case ATCMD_TEST:
+		return c->test ? NULL : c->resp.test;
+	default:
+		return NULL;
+	}
+}
 
-	/* AT<cmd>=<param> */
-	return c->write ? c->write(str + 1, priv) : -ENOENT;
+/* Keep the response body framed, failure only disables the caching */
+static void atport_resp_save(struct atport_resp *r, const char *body,
+			     size_t len)
+{
+	size_t sz = ATPORT_RESP_HLEN + len + ATPORT_RESP_TLEN;
+	char *buf = r->buf;
+
+	if (sz > r->size) {
+		buf = realloc(r->buf, sz);
+		if (!buf)
+			return;
+		r->buf = buf;
+		r->size = sz;
+	}
+
+	memcpy(buf, ATPORT_RESP_HEAD, ATPORT_RESP_HLEN);
+	memcpy(buf + ATPORT_RESP_HLEN, body, len);
+	memcpy(buf + ATPORT_RESP_HLEN + len, ATPORT_RESP_TAIL,
+	       ATPORT_RESP_TLEN);
+	r->len = sz;
+}
+
+/* Call the command handler or emit its constant or cached response */
+static int atport_cmd_call(struct atport *port, struct atport_cmdent *ent,
+			   enum atcmd_form form, const char *str)
+{
+	const struct atcmd *c = ent->cmd;
+	size_t olen = port->out.len;
+	struct atport_resp *r;
+	const char *line;
+	int res;
+
+	if (form == ATCMD_WRITE)
+		return atport_cmd_handler_call(port, c, form, str, ent->priv);
+
+	r = &ent->resp[form];
+	if (r->len)
+		return atport_out(port, r->buf + ATPORT_RESP_HLEN,
+				  r->len - ATPORT_RESP_HLEN - ATPORT_RESP_TLEN);
+
+	line = atport_cmd_resp_line(c, form);
+	if (line)
+		res = atport_puts(port, line);
+	else
+		res = atport_cmd_handler_call(port, c, form, str,
+					      ent->priv);
+
+	if (!res && (line || c->cache & 1 << form))
+		atport_resp_save(r, port->out.buf + olen, port->out.len - olen);
+
+	return res;
 }
 
-int atport_generic_cmd(struct atport *port, const char *str)
+static uint64_t atport_now_ns(void)
 {
-	return atport_cmd_lookup_and_exec(port, str, atport_gen_cmds, port);
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-static int atport_custom_cmd(struct atport *port, const char *str)
+static void atport_cmd_account(struct atport_cmdstat *st, int res,
+			       size_t bytes, uint64_t lat)
 {
-	return atport_cmd_lookup_and_exec(port, str, port->cmds,
-					  port->cmd_priv);
+	unsigned b = lat ? 63 - __builtin_clzll(lat) : 0;
+
+	st->calls++;
+	if (res)
+		st->errors++;
+	st->bytes += bytes;
+	st->lat[b < ATPORT_LAT_BUCKETS ? b : ATPORT_LAT_BUCKETS - 1]++;
+}
+
+static void atport_cmd_done(struct atport *port, struct atport_cmdent *ent,
+			    enum atcmd_form form, int res, size_t bytes,
+			    uint64_t ts)
+{
+	atport_cmd_account(&ent->st[form], res, bytes, atport_now_ns() - ts);
+	if (port->ops->cmd_exec)
+		port->ops->cmd_exec(ent->cmd, port->ops_priv);
+}
+
+/**
+ * Returns -EINPROGRESS if the handler defers the command completion, the
+ * accounting is deferred as well, see atport_complete().
+ */
+static int atport_cmd_lookup_and_exec(struct atport *port, const char *str)
+{
+	size_t cplen = strcspn(str, "=?");	/* Command prefix length */
+	enum atcmd_form form = atport_cmd_form(str + cplen);
+	struct atport_cmdent *ent;
+	size_t olen;
+	uint64_t ts;
+	unsigned i;
+	int res;
+
+	i = atport_cmd_hash(str, cplen) & port->cidx.mask;
+	for (; port->cidx.ents[i].cmd; i = (i + 1) & port->cidx.mask) {
+		ent = &port->cidx.ents[i];
+		if (ent->namelen != cplen ||
+		    strncasecmp(ent->cmd->name, str, cplen) != 0)
+			continue;
+		olen = port->out.len;
+		ts = atport_now_ns();
+		res = atport_cmd_call(port, ent, form, str + cplen);
+		/* Fallback to a next same named command if unsupported */
+		if (res == -ENOENT)
+			continue;
+		if (res == -EINPROGRESS) {
+			port->pend.ent = ent;
+			port->pend.form = form;
+			port->pend.ts = ts;
+			return res;
+		}
+		atport_cmd_done(port, ent, form, res, port->out.len - olen, ts);
+		return res;
+	}
+
+	port->st.unknown++;
+
+	return -ENOENT;
 }
 
 static int atport_cmd_report_status(struct atport *port, int res)
 {
-	char buf[0x10], *p = buf, *e = buf + sizeof(buf);
+	static const char error[] = "ERROR\r\n";
+
+	/* E3372 prints empty line before each "OK" */
+	if (res == 0)
+		return atport_out(port, ATPORT_RESP_TAIL, ATPORT_RESP_TLEN);
+
+	return atport_out(port, error, sizeof(error) - 1);
+}
+
+/**
+ * Returns length of the first command of a command line. Basic commands are
+ * an (optionally '&' prefixed) letter followed by digits and an optional
+ * "?", "=?" or "=<digits>" suffix, e.g. "E0", "S3?" or "S3=13". Extended
+ * commands (e.g. "+COPS=3,2") last up to a ';' outside of a quoted string.
+ * See V.250 5.3 and 5.4 for details.
+ */
+static size_t atport_cmd_next_len(const char *str)
+{
+	const char *p = str;
+	int quoted = 0;
 
-	if (res == 0) {
-		/* E3372 prints empty line before each "OK" */
-		p += snprintf(p, e - p, "\r\n");
-		p += snprintf(p, e - p, "OK");
-	} else {
-		p += snprintf(p, e - p, "ERROR");
+	if (*p == '&' && isalpha((unsigned char)p[1]))
+		p++;
+	if (isalpha((unsigned char)*p)) {
+		for (p++; isdigit((unsigned char)*p); ++p);
+		if (*p == '?')
+			return p + 1 - str;
+		if (*p != '=')
+			return p - str;
+		if (*++p == '?')
+			return p + 1 - str;
+		for (; isdigit((unsigned char)*p); ++p);
+		return p - str;
 	}
-	p += snprintf(p, e - p, "\r\n");
 
-	return port->ops->write(buf, p - buf, port->ops_priv);
+	for (; *p && (quoted || *p != ';'); ++p)
+		if (*p == '"')
+			quoted = !quoted;
+
+	return p - str;
 }
 
-static int atport_cmd_exec(struct atport *port)
+/* Emit URCs deferred during a command reception or execution */
+static int atport_urc_release(struct atport *port)
+{
+	int res;
+
+	if (!port->urc.len)
+		return 0;
+
+	res = atport_out(port, port->urc.buf, port->urc.len);
+	port->urc.len = 0;
+
+	return res;
+}
+
+/**
+ * Send an unsolicited result code. URC is sent immediately if the port is
+ * idle, otherwise it is deferred until the final result code of the current
+ * command line to not interleave with the command response.
+ */
+int atport_urc(struct atport *port, const char *str)
+{
+	size_t l = strlen(str);
+	int res;
+
+	port->st.urcs++;
+
+	if (port->pstate == AT_PARSER_WAIT_A && !port->f.busy) {
+		res = atport_out(port, "\r\n", 2);
+		if (!res)
+			res = atport_putsn(port, str, l);
+
+		return res ? res : atport_flush(port);
+	}
+
+	if (port->urc.len + l + 4 > sizeof(port->urc.buf)) {
+		port->st.urcs_dropped++;
+		return -ENOBUFS;
+	}
+	memcpy(&port->urc.buf[port->urc.len], "\r\n", 2);
+	memcpy(&port->urc.buf[port->urc.len + 2], str, l);
+	memcpy(&port->urc.buf[port->urc.len + 2 + l], "\r\n", 2);
+	port->urc.len += l + 4;
+
+	return 0;
+}
+
+/**
+ * Execute the command line commands starting from the specified one until
+ * the first failure or a command with the deferred completion. In the last
+ * case the rest of the line position is saved for atport_complete().
+ */
+static int atport_cmd_exec_cmds(struct atport *port, char *p)
+{
+	char c;
+	size_t l;
+	int res;
+
+	do {
+		l = atport_cmd_next_len(p);
+		c = p[l];
+		p[l] = '\0';
+		res = atport_cmd_lookup_and_exec(port, p);
+		p[l] = c;
+		p += l;
+		if (*p == ';')
+			p++;
+		if (res == -EINPROGRESS) {
+			port->pend.pos = p - port->cmdbuf;
+			port->f.pending = 1;
+		}
+		if (res)
+			break;
+	} while (*p);
+
+	return res;
+}
+
+static int atport_cmd_line_finish(struct atport *port, int res)
+{
+	if (res) {
+		port->st.errors++;
+		port->f.mux = 0;	/* Switch only after OK */
+	}
+
+	return atport_cmd_report_status(port, res);
+}
+
+/**
+ * Answer a line of the only command, which response is constant or cached,
+ * with the framed response at once. Returns -ENOENT if the line requires the
+ * regular execution. Only the first same named command is probed, custom
+ * commands come first, so a generic one never shadows a cached response.
+ */
+static int atport_cmd_exec_framed(struct atport *port)
+{
+	const char *str = port->cmdbuf;
+	size_t cplen = strcspn(str, "=?;");
+	struct atport_cmdent *ent;
+	struct atport_resp *r;
+	enum atcmd_form form;
+	uint64_t ts;
+	unsigned i;
+	int res;
+
+	if (str[atport_cmd_next_len(str)] != '\0')
+		return -ENOENT;
+	form = atport_cmd_form(str + cplen);
+	if (form == ATCMD_WRITE)
+		return -ENOENT;
+
+	i = atport_cmd_hash(str, cplen) & port->cidx.mask;
+	for (;; i = (i + 1) & port->cidx.mask) {
+		ent = &port->cidx.ents[i];
+		if (!ent->cmd)
+			return -ENOENT;
+		if (ent->namelen == cplen &&
+		    strncasecmp(ent->cmd->name, str, cplen) == 0)
+			break;
+	}
+	r = &ent->resp[form];
+	if (!r->len)
+		return -ENOENT;
+
+	ts = atport_now_ns();
+	port->st.lines++;
+	res = atport_out(port, r->buf, r->len);
+	atport_cmd_done(port, ent, form, 0,
+			r->len - ATPORT_RESP_HLEN - ATPORT_RESP_TLEN, ts);
+
+	return res;
+}
+
+/**
+ * Execute each command of a (possibly concatenated) command line in order
+ * until the first failure and report a single final result code.
+ */
+static int atport_cmd_exec_line(struct atport *port)
 {
 	int res;
 
+	if (port->cmdlen <= sizeof(port->cmdbuf)) {
+		res = atport_cmd_exec_framed(port);
+		if (res != -ENOENT)
+			return res;
+	}
+
 	res = atport_puts(port, "");
 	if (res < 0)
 		return res;
 
+	port->st.lines++;
 	if (port->cmdlen > sizeof(port->cmdbuf))
-		return atport_cmd_report_status(port, -EINVAL);
+		port->st.overflows++;
 
-	res = atport_custom_cmd(port, port->cmdbuf);
-	if (res == -ENOENT)
-		res = atport_generic_cmd(port, port->cmdbuf);
+	res = port->cmdlen > sizeof(port->cmdbuf) ? -EINVAL :
+	      atport_cmd_exec_cmds(port, port->cmdbuf);
+	if (res == -EINPROGRESS)
+		return 0;
 
-	return atport_cmd_report_status(port, res);
+	return atport_cmd_line_finish(port, res);
+}
+
+static int atport_cmd_exec(struct atport *port)
+{
+	int res;
+
+	port->f.busy = 1;
+	res = atport_cmd_exec_line(port);
+	if (port->f.pending)	/* Keep URCs deferred till the completion */
+		return res;
+	port->f.busy = 0;
+
+	return res ? res : atport_urc_release(port);
+}
+
+/* Hold the input till the deferred command completion */
+static void atport_inq_put(struct atport *port, const char *buf, size_t len)
+{
+	size_t room = sizeof(port->inq.buf) - port->inq.len;
+
+	if (len > room) {
+		port->st.inq_dropped += len - room;
+		len = room;
+	}
+	memcpy(port->inq.buf + port->inq.len, buf, len);
+	port->inq.len += len;
+}
+
+/* Flush the final result code and pass the rest of input to the mux */
+static int atport_mux_switch(struct atport *port, const char *buf,
+			     size_t len)
+{
+	int res = atport_flush(port);
+
+	port->f.mux = 0;
+	if (res < 0)
+		return res;
+
+	return port->ops->mux(port->mux_n1, buf, len, port->ops_priv);
+}
+
+/**
+ * Complete the command, which handler returned -EINPROGRESS, with the final
+ * status. The handler could output the command response before the call.
+ * Then the rest of the command line is executed and the input received
+ * meanwhile is processed.
+ */
+int atport_complete(struct atport *port, int res)
+{
+	char buf[sizeof(port->inq.buf)];
+	size_t len;
+	int ret;
+
+	if (!port->f.pending)
+		return -EINVAL;
+	port->f.pending = 0;
+
+	/* Output buffer was flushed on deferring, so it is the response */
+	atport_cmd_done(port, port->pend.ent, port->pend.form, res,
+			port->out.len, port->pend.ts);
+	if (!res && port->cmdbuf[port->pend.pos])
+		res = atport_cmd_exec_cmds(port, port->cmdbuf + port->pend.pos);
+	if (res == -EINPROGRESS)
+		return atport_flush(port);
+
+	ret = atport_cmd_line_finish(port, res);
+	port->f.busy = 0;
+	if (!ret)
+		ret = atport_urc_release(port);
+	if (ret)
+		return ret;
+
+	len = port->inq.len;
+	memcpy(buf, port->inq.buf, len);
+	port->inq.len = 0;
+
+	if (port->f.mux)
+		return atport_mux_switch(port, buf, len);
+	if (!len)
+		return atport_flush(port);
+
+	return atport_parse(port, buf, len);
+}
+
+/**
+ * Request the line switch to the 27.010 multiplexer, e.g. by the +CMUX
+ * handler. The switch happens after the final result code of the command
+ * line, which is sent as a plain text. Ports without the multiplexer
+ * support (e.g. multiplexer channels themselves) refuse the request.
+ */
+int atport_mux(struct atport *port, unsigned n1)
+{
+	if (!port->ops->mux)
+		return -EOPNOTSUPP;
+
+	port->f.mux = 1;
+	port->mux_n1 = n1;
+
+	return 0;
 }
 
 /**
@@ -152,13 +755,21 @@ int atport_parse(struct atport *port, const char *buf, size_t len)
 	size_t i, n, s;
 	int res;
 
+	if (port->f.pending) {
+		atport_inq_put(port, buf, len);
+		return 0;
+	}
+
 	for (i = 0, s = 0; i < len; ++i) {
 		char c = buf[i];
 
 		if (port->pstate == AT_PARSER_WAIT_A) {
-			if (c == 'A' || c == 'a')
+			if (c == 'A' || c == 'a') {
 				port->pstate = AT_PARSER_WAIT_T;
-			else if (!port->f.echo_junk)
+				continue;
+			}
+			port->st.junk++;
+			if (!port->f.echo_junk)
 				s++;		/* Consume junk symbol */
 		} else if (port->pstate == AT_PARSER_WAIT_T) {
 			if (c == 'T' || c == 't') {
@@ -181,8 +792,7 @@ int atport_parse(struct atport *port, const char *buf, size_t len)
 
 			/* Echo final command part before execution */
 			if (port->f.echo && i > s) {
-				res = port->ops->write(&buf[s], i - s,
-						       port->ops_priv);
+				res = atport_out(port, &buf[s], i - s);
 				if (res < 0)
 					return res;
 			}
@@ -192,45 +802,188 @@ int atport_parse(struct atport *port, const char *buf, size_t len)
 				return res;
 			port->pstate = AT_PARSER_WAIT_A;
 			port->cmdlen = 0;	/* Reset command buffer */
+			if (port->f.pending) {
+				atport_inq_put(port, &buf[i + 1], len - i - 1);
+				return atport_flush(port);
+			}
+			if (port->f.mux)
+				return atport_mux_switch(port, &buf[i + 1],
+							 len - i - 1);
 		}
 	}
 
 	if (port->f.echo && i > s) {
 		/* Echo the processed portion of a not yet completed command */
-		res = port->ops->write(&buf[s], i - s,
-				       port->ops_priv);
+		res = atport_out(port, &buf[s], i - s);
 		if (res < 0)
 			return res;
 	}
 
-	return 0;
+	/* Command reception could be aborted, release URCs in this case */
+	if (port->pstate == AT_PARSER_WAIT_A) {
+		res = atport_urc_release(port);
+		if (res < 0)
+			return res;
+	}
+
+	return atport_flush(port);
 }
 
-int atport_puts(struct atport *port, const char *str)
+int atport_putsn(struct atport *port, const char *str, size_t len)
 {
-	size_t l = strlen(str);
-	int res = port->ops->write(str, l, port->ops_priv);
+	int res = atport_out(port, str, len);
 
-	return res ? res : port->ops->write("\r\n", 2, port->ops_priv);
+	return res ? res : atport_out(port, "\r\n", 2);
+}
+
+int atport_puts(struct atport *port, const char *str)
+{
+	return atport_putsn(port, str, strlen(str));
 }
 
 int atport_printf(struct atport *port, const char *fmt, ...)
 {
-	char buf[0x100];
+	size_t room;
 	va_list ap;
 	int res;
 
+	/* Format directly into the output buffer, retry once if it's short */
+	room = port->out.size - port->out.len;
 	va_start(ap, fmt);
-	res = vsnprintf(buf, sizeof(buf), fmt, ap);
+	res = vsnprintf(port->out.buf + port->out.len, room, fmt, ap);
 	va_end(ap);
-
 	if (res < 0)
 		return -errno;
 
-	res = port->ops->write(buf, res < sizeof(buf) ? res : sizeof(buf),
-			       port->ops_priv);
+	if (res + 2 >= room) {
+		if (atport_out_reserve(port, res + 3))
+			return -ENOMEM;
+		va_start(ap, fmt);
+		res = vsnprintf(port->out.buf + port->out.len, res + 1, fmt,
+				ap);
+		va_end(ap);
+		if (res < 0)
+			return -errno;
+	}
+	port->out.len += res;
+
+	return atport_out(port, "\r\n", 2);
+}
+
+/**
+ * Response line builder. Appends write directly into the output buffer
+ * without any format parsing or length limit. An append failure is kept till
+ * the line end, so a handler could chain appends and check the result of
+ * atport_end() only, which terminates the line.
+ */
+void atport_addn(struct atport *port, const char *str, size_t len)
+{
+	if (atport_out(port, str, len))
+		port->out.err = -ENOMEM;
+}
+
+void atport_add(struct atport *port, const char *str)
+{
+	atport_addn(port, str, strlen(str));
+}
+
+void atport_add_int(struct atport *port, long val)
+{
+	unsigned long v = val < 0 ? -(unsigned long)val : val;
+	char buf[24], *p = buf + sizeof(buf);
+
+	do {
+		*--p = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	if (val < 0)
+		*--p = '-';
+
+	atport_addn(port, p, buf + sizeof(buf) - p);
+}
+
+/* Append a string enclosed in double quotes */
+void atport_add_quoted(struct atport *port, const char *str)
+{
+	size_t len = strlen(str);
+	char *p;
+
+	if (atport_out_reserve(port, len + 2)) {
+		port->out.err = -ENOMEM;
+		return;
+	}
+
+	p = port->out.buf + port->out.len;
+	p[0] = '"';
+	memcpy(p + 1, str, len);
+	p[len + 1] = '"';
+	port->out.len += len + 2;
+}
+
+int atport_end(struct atport *port)
+{
+	int res = port->out.err;
+
+	port->out.err = 0;
+
+	return res ? res : atport_out(port, "\r\n", 2);
+}
+
+/**
+ * Drop the cached responses, e.g. on the modem state change. Constant
+ * responses are cached again on the next call.
+ */
+void atport_invalidate(struct atport *port)
+{
+	unsigned i, f;
 
-	return res ? res : port->ops->write("\r\n", 2, port->ops_priv);
+	for (i = 0; i <= port->cidx.mask; ++i)
+		for (f = 0; f < ARRAY_SIZE(port->cidx.ents[i].resp); ++f)
+			port->cidx.ents[i].resp[f].len = 0;
+}
+
+/**
+ * Dump the port statistics as a single line JSON object. Only commands that
+ * have been called at least once are dumped. Latency histogram element N is
+ * a number of handler calls that took [2^N, 2^(N+1)) nanoseconds.
+ */
+void atport_stats_dump(struct atport *port, FILE *fp)
+{
+	const struct atport_cmdent *ent;
+	const struct atport_cmdstat *st;
+	const char *sep = "";
+	unsigned i, f, b, n;
+
+	fprintf(fp, "{\"lines\":%lu,\"errors\":%lu,\"unknown\":%lu,"
+		"\"junk\":%lu,\"overflows\":%lu,\"urcs\":%lu,"
+		"\"urcs_dropped\":%lu,\"inq_dropped\":%lu,\"commands\":[",
+		port->st.lines, port->st.errors, port->st.unknown,
+		port->st.junk, port->st.overflows, port->st.urcs,
+		port->st.urcs_dropped, port->st.inq_dropped);
+
+	for (i = 0; i <= port->cidx.mask; ++i) {
+		ent = &port->cidx.ents[i];
+		if (!ent->cmd)
+			continue;
+		for (f = 0; f < __ATCMD_FORM_NUM; ++f) {
+			st = &ent->st[f];
+			if (!st->calls)
+				continue;
+			fprintf(fp, "%s{\"name\":\"%s\",\"form\":\"%s\","
+				"\"calls\":%lu,\"errors\":%lu,\"bytes\":%llu,"
+				"\"lat_log2_ns\":[", sep, ent->cmd->name,
+				atcmd_form_names[f], st->calls, st->errors,
+				st->bytes);
+			for (n = ATPORT_LAT_BUCKETS; n > 0 && !st->lat[n - 1];)
+				n--;
+			for (b = 0; b < n; ++b)
+				fprintf(fp, b ? ",%lu" : "%lu", st->lat[b]);
+			fputs("]}", fp);
+			sep = ",";
+		}
+	}
+
+	fputs("]}", fp);
 }
 
 struct atport *atport_alloc(const struct atops *ops, void *ops_priv,
@@ -251,10 +1004,38 @@ struct atport *atport_alloc(const struct atops *ops, void *ops_priv,
 	port->cmds = commands;
 	port->cmd_priv = cmd_priv;
 
+	if (atport_cmd_index_build(port)) {
+		fprintf(stderr, "unable to allocate port commands index\n");
+		free(port);
+		return NULL;
+	}
+
+	if (atport_out_reserve(port, 0x200)) {
+		fprintf(stderr, "unable to allocate port output buffer\n");
+		free(port->cidx.ents);
+		free(port);
+		return NULL;
+	}
+
 	return port;
 }
 
+static void atport_resp_free(struct atport *port)
+{
+	unsigned i, f;
+
+	for (i = 0; i <= port->cidx.mask; ++i)
+		for (f = 0; f < ARRAY_SIZE(port->cidx.ents[i].resp); ++f)
+			free(port->cidx.ents[i].resp[f].buf);
+}
+
 void atport_free(struct atport *port)
 {
+	if (!port)
+		return;
+
+	atport_resp_free(port);
+	free(port->out.buf);
+	free(port->cidx.ents);
 	free(port);
 }
@@ -7,23 +7,69 @@
 #ifndef _ATPORT_H_
 #define _ATPORT_H_
 
+#include <stdio.h>
+
+struct atcmd;
+struct atport;
+
 struct atops {
 	int (*write)(const char *buf, size_t len, void *priv);
+	/* Optional, called for each executed command, e.g. for accounting */
+	void (*cmd_exec)(const struct atcmd *cmd, void *priv);
+	/**
+	 * Optional, switch the line to the 27.010 multiplexer with the max
+	 * frame info length n1, see atport_mux(). The input following the
+	 * command line is passed over.
+	 */
+	int (*mux)(unsigned n1, const char *buf, size_t len, void *priv);
 };
 
+#define ATCMD_CACHE_EXEC	(1 << 0)	/* See atcmd::cache */
+#define ATCMD_CACHE_READ	(1 << 1)
+#define ATCMD_CACHE_TEST	(1 << 2)
+
+/**
+ * Handlers are called with the port, which received the command, since a
+ * few ports could share the same handlers context (e.g. multiplexer
+ * channels of a modem), and return 0 on success or a negative error code.
+ * A slow command handler could return -EINPROGRESS and finish the command
+ * later with atport_complete(), the port holds the input till that.
+ *
+ * A form with a constant response could be declared with a response line
+ * instead of a handler. A handler response, which changes only with the
+ * modem state, could be marked as cacheable, then it is captured on the
+ * first successful call and reused by the port till atport_invalidate().
+ */
 struct atcmd {
 	const char *name;				/* e.g. "+COPS" */
-	int (*exec)(void *priv);			/* AT<cmd> */
-	int (*read)(void *priv);			/* AT<cmd>? */
-	int (*test)(void *priv);			/* AT<cmd>=? */
-	int (*write)(const char *str, void *priv);	/* AT<cmd>=<param> */
+	int (*exec)(struct atport *port, void *priv);	/* AT<cmd> */
+	int (*read)(struct atport *port, void *priv);	/* AT<cmd>? */
+	int (*test)(struct atport *port, void *priv);	/* AT<cmd>=? */
+	int (*write)(struct atport *port, const char *str,
+		     void *priv);			/* AT<cmd>=<param> */
+	struct {		/* Constant response lines, used if no handler */
+		const char *exec;
+		const char *read;
+		const char *test;
+	} resp;
+	unsigned cache;		/* ATCMD_CACHE_xxx, cacheable handlers */
 };
 
-struct atport;
-
 int atport_parse(struct atport *port, const char *buf, size_t len);
 int atport_puts(struct atport *port, const char *str);
+int atport_putsn(struct atport *port, const char *str, size_t len);
 int atport_printf(struct atport *port, const char *fmt, ...);
+void atport_add(struct atport *port, const char *str);
+void atport_addn(struct atport *port, const char *str, size_t len);
+void atport_add_int(struct atport *port, long val);
+void atport_add_quoted(struct atport *port, const char *str);
+int atport_end(struct atport *port);
+int atport_flush(struct atport *port);
+int atport_urc(struct atport *port, const char *str);
+int atport_complete(struct atport *port, int res);
+int atport_mux(struct atport *port, unsigned n1);
+void atport_invalidate(struct atport *port);
+void atport_stats_dump(struct atport *port, FILE *fp);
 struct atport *atport_alloc(const struct atops *ops, void *ops_priv,
 			    const struct atcmd *commands, void *cmd_priv);
 void atport_free(struct atport *port);
@@ -0,0 +1,616 @@
+/**
+ * 3GPP TS 27.010 multiplexer
+ *
+ * Implements the basic option of the protocol with UIH information frames,
+ * which is what modems and their clients normally use, the modem is the
+ * responder side. Each frame is:
+ *
+ *   F9 | Address | Control | Length (1 or 2 octets) | Info | FCS | F9
+ *
+ * DLCI 0 is the multiplexer control channel, each opened data channel
+ * 1..CMUX_DLCI_MAX gets own AT port, the ports share the commands context
+ * (the modem state).
+ *
+ * Frames are mostly small (a command or a short response), so a frame is
+ * handled in place within the input buffer, only a frame, which spans reads,
+ * is collected into the own buffer. The FCS is computed with a lookup table
+ * and covers the UIH frame header only. Frames emitted while parsing input
+ * (e.g. responses of a few channels) are packed into the output buffer and
+ * written at once.
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "atport.h"
+#include "cmux.h"
+
+#define CMUX_FLAG		0xF9
+#define CMUX_EA			0x01	/* Extension bit, set in the last octet */
+#define CMUX_CR			0x02	/* Command/response bit */
+#define CMUX_PF			0x10	/* Poll/final bit of the control field */
+
+#define CMUX_SABM		0x2F	/* Control field frame types */
+#define CMUX_UA			0x63
+#define CMUX_DM			0x0F
+#define CMUX_DISC		0x43
+#define CMUX_UIH		0xEF
+
+#define CMUX_MSG_PN		0x80	/* Control channel message types */
+#define CMUX_MSG_PSC		0x40
+#define CMUX_MSG_CLD		0xC0
+#define CMUX_MSG_TEST		0x20
+#define CMUX_MSG_FCON		0xA0
+#define CMUX_MSG_FCOFF		0x60
+#define CMUX_MSG_MSC		0xE0
+#define CMUX_MSG_NSC		0x10
+
+#define CMUX_PN_LEN		8	/* Parameter negotiation values length */
+#define CMUX_FCS_GOOD		0xCF	/* Receiver check residue */
+#define CMUX_HDR_MAX		4	/* Address, control and 2 length octets */
+#define CMUX_FRAME_MAX		(CMUX_HDR_MAX + CMUX_N1_MAX + 2)
+
+struct cmux_chan {
+	struct cmux *mux;
+	struct atport *port;	/* NULL if the channel is closed */
+	unsigned dlci;
+	unsigned n1;		/* Max info length of emitted frames */
+};
+
+struct cmux {
+	const struct cmux_ops *ops;
+	void *priv;
+	const struct atcmd *cmds;
+	void *cmd_priv;
+	int sync;		/* Input position is just after a flag */
+	int closed;		/* Multiplexer is closed down */
+	int batch;		/* Output is held till the parsing end */
+	struct {		/* Frame, which spans reads */
+		uint8_t buf[CMUX_FRAME_MAX];
+		size_t len;
+	} in;
+	struct {		/* Output frames */
+		uint8_t *buf;
+		size_t len;
+		size_t size;
+	} out;
+	struct cmux_chan chans[CMUX_DLCI_MAX + 1];
+	struct {		/* Statistics */
+		unsigned long rx_frames;
+		unsigned long tx_frames;
+		unsigned long fcs_errors;
+		unsigned long bad_frames;	/* Malformed or unsupported */
+		unsigned long junk;	/* Bytes dropped while out of sync */
+	} st;
+};
+
+/* Reversed x^8 + x^2 + x + 1 polynomial CRC, see 27.010 annex B */
+static const uint8_t cmux_crc[256] = {
+	0x00, 0x91, 0xE3, 0x72, 0x07, 0x96, 0xE4, 0x75,
+	0x0E, 0x9F, 0xED, 0x7C, 0x09, 0x98, 0xEA, 0x7B,
+	0x1C, 0x8D, 0xFF, 0x6E, 0x1B, 0x8A, 0xF8, 0x69,
+	0x12, 0x83, 0xF1, 0x60, 0x15, 0x84, 0xF6, 0x67,
+	0x38, 0xA9, 0xDB, 0x4A, 0x3F, 0xAE, 0xDC, 0x4D,
+	0x36, 0xA7, 0xD5, 0x44, 0x31, 0xA0, 0xD2, 0x43,
+	0x24, 0xB5, 0xC7, 0x56, 0x23, 0xB2, 0xC0, 0x51,
+	0x2A, 0xBB, 0xC9, 0x58, 0x2D, 0xBC, 0xCE, 0x5F,
+	0x70, 0xE1, 0x93, 0x02, 0x77, 0xE6, 0x94, 0x05,
+	0x7E, 0xEF, 0x9D, 0x0C, 0x79, 0xE8, 0x9A, 0x0B,
+	0x6C, 0xFD, 0x8F, 0x1E, 0x6B, 0xFA, 0x88, 0x19,
+	0x62, 0xF3, 0x81, 0x10, 0x65, 0xF4, 0x86, 0x17,
+	0x48, 0xD9, 0xAB, 0x3A, 0x4F, 0xDE, 0xAC, 0x3D,
+	0x46, 0xD7, 0xA5, 0x34, 0x41, 0xD0, 0xA2, 0x33,
+	0x54, 0xC5, 0xB7, 0x26, 0x53, 0xC2, 0xB0, 0x21,
+	0x5A, 0xCB, 0xB9, 0x28, 0x5D, 0xCC, 0xBE, 0x2F,
+	0xE0, 0x71, 0x03, 0x92, 0xE7, 0x76, 0x04, 0x95,
+	0xEE, 0x7F, 0x0D, 0x9C, 0xE9, 0x78, 0x0A, 0x9B,
+	0xFC, 0x6D, 0x1F, 0x8E, 0xFB, 0x6A, 0x18, 0x89,
+	0xF2, 0x63, 0x11, 0x80, 0xF5, 0x64, 0x16, 0x87,
+	0xD8, 0x49, 0x3B, 0xAA, 0xDF, 0x4E, 0x3C, 0xAD,
+	0xD6, 0x47, 0x35, 0xA4, 0xD1, 0x40, 0x32, 0xA3,
+	0xC4, 0x55, 0x27, 0xB6, 0xC3, 0x52, 0x20, 0xB1,
+	0xCA, 0x5B, 0x29, 0xB8, 0xCD, 0x5C, 0x2E, 0xBF,
+	0x90, 0x01, 0x73, 0xE2, 0x97, 0x06, 0x74, 0xE5,
+	0x9E, 0x0F, 0x7D, 0xEC, 0x99, 0x08, 0x7A, 0xEB,
+	0x8C, 0x1D, 0x6F, 0xFE, 0x8B, 0x1A, 0x68, 0xF9,
+	0x82, 0x13, 0x61, 0xF0, 0x85, 0x14, 0x66, 0xF7,
+	0xA8, 0x39, 0x4B, 0xDA, 0xAF, 0x3E, 0x4C, 0xDD,
+	0xA6, 0x37, 0x45, 0xD4, 0xA1, 0x30, 0x42, 0xD3,
+	0xB4, 0x25, 0x57, 0xC6, 0xB3, 0x22, 0x50, 0xC1,
+	0xBA, 0x2B, 0x59, 0xC8, 0xBD, 0x2C, 0x5E, 0xCF,
+};
+
+static uint8_t cmux_fcs(uint8_t fcs, const uint8_t *buf, size_t len)
+{
+	while (len--)
+		fcs = cmux_crc[fcs ^ *buf++];
+
+	return fcs;
+}
+
+static int cmux_out_reserve(struct cmux *mux, size_t len)
+{
+	size_t size = mux->out.size ? mux->out.size : len;
+	uint8_t *buf;
+
+	if (mux->out.size - mux->out.len >= len)
+		return 0;
+
+	while (size - mux->out.len < len)
+		size *= 2;
+	buf = realloc(mux->out.buf, size);
+	if (!buf)
+		return -ENOMEM;
+	mux->out.buf = buf;
+	mux->out.size = size;
+
+	return 0;
+}
+
+static int cmux_flush(struct cmux *mux)
+{
+	size_t len = mux->out.len;
+
+	if (!len)
+		return 0;
+
+	mux->out.len = 0;
+
+	return mux->ops->write((const char *)mux->out.buf, len, mux->priv);
+}
+
+/* Queue a frame into the output buffer */
+static int cmux_put_frame(struct cmux *mux, unsigned dlci, uint8_t ctrl,
+			  int cr, const void *info, size_t ilen)
+{
+	size_t hlen = ilen > 0x7F ? 4 : 3;
+	uint8_t *p, fcs;
+	int res;
+
+	res = cmux_out_reserve(mux, 1 + hlen + ilen + 2);
+	if (res)
+		return res;
+
+	p = mux->out.buf + mux->out.len;
+	p[0] = CMUX_FLAG;
+	p[1] = dlci << 2 | (cr ? CMUX_CR : 0) | CMUX_EA;
+	p[2] = ctrl;
+	if (hlen == 3) {
+		p[3] = ilen << 1 | CMUX_EA;
+	} else {
+		p[3] = (ilen & 0x7F) << 1;
+		p[4] = ilen >> 7;
+	}
+	memcpy(p + 1 + hlen, info, ilen);
+	fcs = cmux_fcs(0xFF, p + 1, (ctrl & ~CMUX_PF) == CMUX_UIH ? hlen :
+							      hlen + ilen);
+	p[1 + hlen + ilen] = 0xFF - fcs;
+	p[1 + hlen + ilen + 1] = CMUX_FLAG;
+	mux->out.len += 1 + hlen + ilen + 2;
+	mux->st.tx_frames++;
+
+	return 0;
+}
+
+/* Responder commands have C/R cleared, responses have it set */
+static int cmux_put_resp(struct cmux *mux, unsigned dlci, uint8_t ctrl)
+{
+	return cmux_put_frame(mux, dlci, ctrl, 1, NULL, 0);
+}
+
+/* Pack the channel port output into UIH frames */
+static int cmux_chan_write(const char *buf, size_t len, void *priv)
+{
+	struct cmux_chan *ch = priv;
+	struct cmux *mux = ch->mux;
+	size_t n;
+	int res;
+
+	for (; len; buf += n, len -= n) {
+		n = len < ch->n1 ? len : ch->n1;
+		res = cmux_put_frame(mux, ch->dlci, CMUX_UIH, 0, buf, n);
+		if (res)
+			return res;
+	}
+
+	return mux->batch ? 0 : cmux_flush(mux);
+}
+
+static void cmux_chan_cmd_exec(const struct atcmd *cmd, void *priv)
+{
+	struct cmux_chan *ch = priv;
+
+	if (ch->mux->ops->cmd_exec)
+		ch->mux->ops->cmd_exec(cmd, ch->mux->priv);
+}
+
+/* No mux operation, so the +CMUX command is refused within a channel */
+static const struct atops cmux_chan_atops = {
+	.write = cmux_chan_write,
+	.cmd_exec = cmux_chan_cmd_exec,
+};
+
+static void cmux_chan_close(struct cmux *mux, struct cmux_chan *ch)
+{
+	mux->ops->chan_close(ch->port, mux->priv);
+	atport_free(ch->port);
+	ch->port = NULL;
+}
+
+static int cmux_sabm(struct cmux *mux, unsigned dlci, uint8_t pf)
+{
+	struct cmux_chan *ch = &mux->chans[dlci];
+
+	if (dlci == 0 || ch->port)
+		return cmux_put_resp(mux, dlci, CMUX_UA | pf);
+
+	ch->port = atport_alloc(&cmux_chan_atops, ch, mux->cmds,
+				mux->cmd_priv);
+	if (!ch->port)
+		return cmux_put_resp(mux, dlci, CMUX_DM | pf);
+	if (mux->ops->chan_open(ch->port, mux->priv)) {
+		atport_free(ch->port);
+		ch->port = NULL;
+		return cmux_put_resp(mux, dlci, CMUX_DM | pf);
+	}
+
+	return cmux_put_resp(mux, dlci, CMUX_UA | pf);
+}
+
+static int cmux_disc(struct cmux *mux, unsigned dlci, uint8_t pf)
+{
+	struct cmux_chan *ch = &mux->chans[dlci];
+
+	if (dlci == 0)
+		mux->closed = 1;
+	else if (ch->port)
+		cmux_chan_close(mux, ch);
+	else
+		return cmux_put_resp(mux, dlci, CMUX_DM | pf);
+
+	return cmux_put_resp(mux, dlci, CMUX_UA | pf);
+}
+
+/* Send a control channel message as a single UIH frame */
+static int cmux_ctl_send(struct cmux *mux, uint8_t type, const uint8_t *val,
+			 size_t vlen)
+{
+	uint8_t msg[3 + CMUX_N1_MAX];
+	size_t hlen = vlen > 0x7F ? 3 : 2;
+
+	msg[0] = type | CMUX_EA;
+	if (hlen == 2) {
+		msg[1] = vlen << 1 | CMUX_EA;
+	} else {
+		msg[1] = (vlen & 0x7F) << 1;
+		msg[2] = vlen >> 7;
+	}
+	memcpy(msg + hlen, val, vlen);
+
+	return cmux_put_frame(mux, 0, CMUX_UIH, 0, msg, hlen + vlen);
+}
+
+/* Accept the channel parameters, but limit the frame size */
+static int cmux_ctl_pn(struct cmux *mux, const uint8_t *val, size_t vlen)
+{
+	unsigned dlci = val[0] & 0x3F, n1 = val[4] | val[5] << 8;
+	uint8_t rsp[CMUX_PN_LEN];
+
+	if (n1 == 0 || n1 > CMUX_N1_MAX)
+		n1 = CMUX_N1_MAX;
+	if (dlci && dlci <= CMUX_DLCI_MAX)
+		mux->chans[dlci].n1 = n1;
+
+	memcpy(rsp, val, sizeof(rsp));
+	rsp[1] = 0;			/* UIH frames, convergence layer 1 */
+	rsp[4] = n1 & 0xFF;
+	rsp[5] = n1 >> 8;
+
+	return cmux_ctl_send(mux, CMUX_MSG_PN, rsp, sizeof(rsp));
+}
+
+/**
+ * Answer the initiator command. Flow control and modem status are accepted
+ * and echoed, since the emulated line never stalls, unknown commands are
+ * answered with the "not supported" response.
+ */
+static int cmux_ctl_cmd(struct cmux *mux, uint8_t type, const uint8_t *val,
+			size_t vlen)
+{
+	switch (type & ~(CMUX_CR | CMUX_EA)) {
+	case CMUX_MSG_PN:
+		if (vlen != CMUX_PN_LEN)
+			break;
+		return cmux_ctl_pn(mux, val, vlen);
+	case CMUX_MSG_CLD:
+		mux->closed = 1;
+		/* Fallthrough */
+	case CMUX_MSG_PSC:
+	case CMUX_MSG_TEST:
+	case CMUX_MSG_FCON:
+	case CMUX_MSG_FCOFF:
+	case CMUX_MSG_MSC:
+		return cmux_ctl_send(mux, type & ~(CMUX_CR | CMUX_EA), val,
+				     vlen);
+	}
+
+	return cmux_ctl_send(mux, CMUX_MSG_NSC, &type, 1);
+}
+
+/* Handle the control channel messages, initiator responses are ignored */
+static int cmux_ctl(struct cmux *mux, const uint8_t *p, size_t len)
+{
+	const uint8_t *end = p + len;
+	uint8_t type;
+	size_t vlen;
+	int res;
+
+	while (end - p >= 2 && !mux->closed) {
+		type = *p++;
+		vlen = *p >> 1;
+		if (!(*p++ & CMUX_EA)) {
+			if (p == end)
+				break;
+			vlen |= *p++ << 7;
+		}
+		if (!(type & CMUX_EA) || vlen > end - p) {
+			mux->st.bad_frames++;
+			break;
+		}
+		if (type & CMUX_CR) {
+			res = cmux_ctl_cmd(mux, type, p, vlen);
+			if (res)
+				return res;
+		}
+		p += vlen;
+	}
+
+	return 0;
+}
+
+/* Handle the frame from the address up to the closing flag (inclusive) */
+static int cmux_frame(struct cmux *mux, const uint8_t *f, size_t size)
+{
+	size_t hlen = f[2] & CMUX_EA ? 3 : 4, ilen = size - hlen - 2;
+	uint8_t ctrl = f[1] & ~CMUX_PF, pf = f[1] & CMUX_PF;
+	unsigned dlci = f[0] >> 2;
+	struct cmux_chan *ch;
+	uint8_t fcs;
+
+	fcs = cmux_fcs(0xFF, f, ctrl == CMUX_UIH ? hlen : hlen + ilen);
+	if (cmux_crc[fcs ^ f[size - 2]] != CMUX_FCS_GOOD) {
+		mux->st.fcs_errors++;
+		return 0;
+	}
+	mux->st.rx_frames++;
+
+	if (dlci > CMUX_DLCI_MAX) {
+		if (ctrl == CMUX_SABM || ctrl == CMUX_DISC ||
+		    ctrl == CMUX_UIH)
+			return cmux_put_resp(mux, dlci, CMUX_DM | pf);
+		return 0;
+	}
+
+	switch (ctrl) {
+	case CMUX_SABM:
+		return cmux_sabm(mux, dlci, pf);
+	case CMUX_DISC:
+		return cmux_disc(mux, dlci, pf);
+	case CMUX_UIH:
+		if (dlci == 0)
+			return cmux_ctl(mux, f + hlen, ilen);
+		ch = &mux->chans[dlci];
+		if (!ch->port)
+			return cmux_put_resp(mux, dlci, CMUX_DM | pf);
+		return atport_parse(ch->port, (const char *)f + hlen, ilen);
+	case CMUX_UA:		/* Initiator responses */
+	case CMUX_DM:
+		return 0;
+	}
+
+	mux->st.bad_frames++;
+
+	return 0;
+}
+
+/**
+ * Returns the frame size from the address up to the closing flag
+ * (inclusive), 0 if the header is incomplete or -1 if it is invalid.
+ */
+static ssize_t cmux_frame_size(const uint8_t *f, size_t len)
+{
+	size_t ilen;
+
+	if (len < 3)
+		return 0;
+	if (!(f[0] & CMUX_EA))
+		return -1;
+	if (f[2] & CMUX_EA)
+		return 3 + (f[2] >> 1) + 2;
+	if (len < 4)
+		return 0;
+	ilen = f[2] >> 1 | f[3] << 7;
+
+	return ilen > CMUX_N1_MAX ? -1 : 4 + ilen + 2;
+}
+
+static void cmux_resync(struct cmux *mux)
+{
+	mux->st.bad_frames++;
+	mux->sync = 0;
+}
+
+/* Collect the frame, which spans reads, and handle it once it is complete */
+static int cmux_collect(struct cmux *mux, const uint8_t **pp,
+			const uint8_t *end)
+{
+	uint8_t *f = mux->in.buf;
+	const uint8_t *p = *pp;
+	ssize_t size;
+	size_t n;
+
+	while ((size = cmux_frame_size(f, mux->in.len)) == 0 && p < end)
+		f[mux->in.len++] = *p++;
+	if (size <= 0) {
+		if (size < 0) {
+			mux->in.len = 0;
+			cmux_resync(mux);
+		}
+		*pp = p;
+		return 0;
+	}
+
+	n = size - mux->in.len;
+	if (n > end - p)
+		n = end - p;
+	memcpy(f + mux->in.len, p, n);
+	mux->in.len += n;
+	*pp = p + n;
+	if (mux->in.len < size)
+		return 0;
+
+	mux->in.len = 0;
+	if (f[size - 1] != CMUX_FLAG) {
+		cmux_resync(mux);
+		return 0;
+	}
+
+	return cmux_frame(mux, f, size);
+}
+
+/**
+ * Parse the line input. Frames, which follow the multiplexer close down, are
+ * dropped, the caller should check cmux_closed() and return the line to the
+ * AT mode.
+ */
+int cmux_parse(struct cmux *mux, const char *buf, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)buf, *end = p + len, *q;
+	ssize_t size;
+	int res = 0, ret;
+
+	mux->batch = 1;
+	while (p < end && !res && !mux->closed) {
+		if (mux->in.len) {
+			res = cmux_collect(mux, &p, end);
+			continue;
+		}
+		if (!mux->sync) {
+			q = memchr(p, CMUX_FLAG, end - p);
+			mux->st.junk += (q ? q : end) - p;
+			if (!q)
+				break;
+			p = q + 1;
+			mux->sync = 1;
+		}
+		while (p < end && *p == CMUX_FLAG)
+			p++;
+		if (p == end)
+			break;
+
+		size = cmux_frame_size(p, end - p);
+		if (size < 0) {
+			cmux_resync(mux);
+			continue;
+		}
+		if (size == 0 || size > end - p) {
+			res = cmux_collect(mux, &p, end);
+			continue;
+		}
+		if (p[size - 1] != CMUX_FLAG) {
+			cmux_resync(mux);
+			continue;
+		}
+		res = cmux_frame(mux, p, size);
+		p += size - 1;	/* Closing flag could open the next frame */
+	}
+	mux->batch = 0;
+
+	ret = cmux_flush(mux);
+
+	return res ? res : ret;
+}
+
+int cmux_closed(const struct cmux *mux)
+{
+	return mux->closed;
+}
+
+/* Dump the multiplexer statistics as a JSON object with channel ports */
+void cmux_stats_dump(const struct cmux *mux, FILE *fp)
+{
+	const char *sep = "";
+	unsigned i;
+
+	fprintf(fp, "{\"rx_frames\":%lu,\"tx_frames\":%lu,\"fcs_errors\":%lu,"
+		"\"bad_frames\":%lu,\"junk\":%lu,\"channels\":[",
+		mux->st.rx_frames, mux->st.tx_frames, mux->st.fcs_errors,
+		mux->st.bad_frames, mux->st.junk);
+	for (i = 1; i <= CMUX_DLCI_MAX; ++i) {
+		if (!mux->chans[i].port)
+			continue;
+		fprintf(fp, "%s{\"dlci\":%u,\"atport\":", sep, i);
+		atport_stats_dump(mux->chans[i].port, fp);
+		fputc('}', fp);
+		sep = ",";
+	}
+	fputs("]}", fp);
+}
+
+/**
+ * Allocate the multiplexer of a line, n1 is the max info length of emitted
+ * frames till the channel parameters negotiation (0 - default).
+ */
+struct cmux *cmux_alloc(const struct cmux_ops *ops, void *priv,
+			const struct atcmd *commands, void *cmd_priv,
+			unsigned n1)
+{
+	struct cmux *mux = calloc(1, sizeof(*mux));
+	unsigned i;
+
+	if (!mux) {
+		fprintf(stderr, "unable to allocate multiplexer state\n");
+		return NULL;
+	}
+
+	mux->ops = ops;
+	mux->priv = priv;
+	mux->cmds = commands;
+	mux->cmd_priv = cmd_priv;
+	if (n1 == 0 || n1 > CMUX_N1_MAX)
+		n1 = CMUX_N1_DEF;
+	for (i = 0; i <= CMUX_DLCI_MAX; ++i) {
+		mux->chans[i].mux = mux;
+		mux->chans[i].dlci = i;
+		mux->chans[i].n1 = n1;
+	}
+
+	if (cmux_out_reserve(mux, 0x200)) {
+		fprintf(stderr, "unable to allocate multiplexer output buffer\n");
+		free(mux);
+		return NULL;
+	}
+
+	return mux;
+}
+
+/* Close the channels left open, their ports are released */
+void cmux_free(struct cmux *mux)
+{
+	unsigned i;
+
+	if (!mux)
+		return;
+
+	for (i = 1; i <= CMUX_DLCI_MAX; ++i)
+		if (mux->chans[i].port)
+			cmux_chan_close(mux, &mux->chans[i]);
+	free(mux->out.buf);
+	free(mux);
+}
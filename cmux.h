@@ -0,0 +1,40 @@
+/**
+ * 3GPP TS 27.010 multiplexer header file
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#ifndef _CMUX_H_
+#define _CMUX_H_
+
+#include <stdio.h>
+
+#define CMUX_DLCI_MAX		15	/* Max data channel number */
+#define CMUX_N1_DEF		31	/* Default max frame info length */
+#define CMUX_N1_MAX		1509	/* Max supported frame info length */
+
+struct atcmd;
+struct atport;
+
+struct cmux_ops {
+	/* Line output, frames emitted while parsing are written at once */
+	int (*write)(const char *buf, size_t len, void *priv);
+	/* Optional, see atops::cmd_exec */
+	void (*cmd_exec)(const struct atcmd *cmd, void *priv);
+	/* Channel port is opened, an error refuses the channel */
+	int (*chan_open)(struct atport *port, void *priv);
+	/* Channel port is going to be freed */
+	void (*chan_close)(struct atport *port, void *priv);
+};
+
+struct cmux;
+
+int cmux_parse(struct cmux *mux, const char *buf, size_t len);
+int cmux_closed(const struct cmux *mux);
+void cmux_stats_dump(const struct cmux *mux, FILE *fp);
+struct cmux *cmux_alloc(const struct cmux_ops *ops, void *priv,
+			const struct atcmd *commands, void *cmd_priv,
+			unsigned n1);
+void cmux_free(struct cmux *mux);
+
+#endif	/* _CMUX_H_ */
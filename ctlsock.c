@@ -0,0 +1,323 @@
+/**
+ * Control socket
+ *
+ * UNIX stream socket with a line based request/response protocol. Each
+ * request line is answered with zero or more data lines followed by a final
+ * "OK" or "ERROR <reason>" line. Requests of a connection are processed one
+ * by one, a next line is not parsed until the current request is done, so a
+ * client could pipeline requests. The socket has its own epoll instance,
+ * which descriptor is polled by the owner event loop.
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#define _GNU_SOURCE		/* for accept4() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+
+#include "ctlsock.h"
+#include "ringbuf.h"
+
+#define CTLCONN_LINE_MAX	0x1000
+#define CTLCONN_OUT_SIZE	0x1000	/* Initial output queue size */
+
+struct ctlconn {
+	struct ctlconn *next;
+	struct ctlconn **pprev;
+	struct ctlsock *cs;
+	int fd;
+	uint32_t epev;		/* Currently subscribed epoll events */
+	int busy;		/* Request is in progress */
+	int in_req;		/* Request handler is being called */
+	int closing;		/* Peer is gone, free once the request done */
+	char in[CTLCONN_LINE_MAX];
+	size_t inlen;
+	struct ringbuf out;
+};
+
+struct ctlsock {
+	int fd;
+	int epfd;
+	char *path;
+	ctlsock_req_t req;
+	void *priv;
+	struct ctlconn *conns;
+};
+
+static void ctlconn_free(struct ctlconn *conn)
+{
+	*conn->pprev = conn->next;
+	if (conn->next)
+		conn->next->pprev = conn->pprev;
+	close(conn->fd);
+	ringbuf_fini(&conn->out);
+	free(conn);
+}
+
+static void ctlconn_update_events(struct ctlconn *conn)
+{
+	struct epoll_event ev;
+	uint32_t events = 0;
+
+	if (conn->inlen < sizeof(conn->in))
+		events |= EPOLLIN;
+	if (ringbuf_len(&conn->out))
+		events |= EPOLLOUT;
+	if (events == conn->epev)
+		return;
+
+	memset(&ev, 0x00, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = conn;
+	if (epoll_ctl(conn->cs->epfd, EPOLL_CTL_MOD, conn->fd, &ev)) {
+		perror("epoll_ctl()");
+		return;
+	}
+	conn->epev = events;
+}
+
+/* Queue the response data, the queue grows as needed */
+int ctlconn_write(struct ctlconn *conn, const char *buf, size_t len)
+{
+	if (ringbuf_room(&conn->out) < len &&
+	    ringbuf_grow(&conn->out, ringbuf_len(&conn->out) + len))
+		return -ENOMEM;
+	ringbuf_put(&conn->out, buf, len);
+
+	return 0;
+}
+
+static void ctlconn_flush(struct ctlconn *conn)
+{
+	if (ringbuf_write_fd(&conn->out, conn->fd, SIZE_MAX) < 0)
+		conn->closing = 1;	/* Peer is gone */
+}
+
+/* Process the received lines until a request becomes asynchronous */
+static void ctlconn_process(struct ctlconn *conn)
+{
+	char *p, *e;
+
+	while (!conn->busy && !conn->closing) {
+		e = memchr(conn->in, '\n', conn->inlen);
+		if (!e && conn->inlen == sizeof(conn->in)) {
+			static const char err[] = "ERROR line is too long\n";
+
+			ctlconn_write(conn, err, sizeof(err) - 1);
+			conn->inlen = 0;
+			continue;
+		}
+		if (!e)
+			break;
+
+		*e = '\0';
+		if (e > conn->in && e[-1] == '\r')
+			e[-1] = '\0';
+		p = conn->in + strspn(conn->in, " \t");
+		if (*p != '\0' && *p != '#') {
+			conn->busy = 1;
+			conn->in_req = 1;
+			conn->cs->req(conn, p, conn->cs->priv);
+			conn->in_req = 0;
+		}
+		conn->inlen -= e + 1 - conn->in;
+		memmove(conn->in, e + 1, conn->inlen);
+	}
+
+	ctlconn_flush(conn);
+	if (conn->closing && !conn->busy)
+		ctlconn_free(conn);
+	else if (!conn->closing)
+		ctlconn_update_events(conn);
+}
+
+/* Finish the current request with OK or the error reason */
+void ctlconn_done(struct ctlconn *conn, const char *err)
+{
+	char buf[0x100];
+	int len;
+
+	if (err)
+		len = snprintf(buf, sizeof(buf), "ERROR %s\n", err);
+	else
+		len = snprintf(buf, sizeof(buf), "OK\n");
+	if (len >= sizeof(buf))
+		len = sizeof(buf) - 1;
+	ctlconn_write(conn, buf, len);
+	conn->busy = 0;
+
+	/* Asynchronous completion resumes the pipelined requests */
+	if (!conn->in_req)
+		ctlconn_process(conn);
+}
+
+static void ctlconn_event(struct ctlconn *conn, uint32_t events)
+{
+	ssize_t res;
+
+	if (events & EPOLLOUT)
+		ctlconn_flush(conn);
+
+	if (events & (EPOLLIN | EPOLLHUP | EPOLLERR) &&
+	    conn->inlen < sizeof(conn->in)) {
+		res = read(conn->fd, conn->in + conn->inlen,
+			   sizeof(conn->in) - conn->inlen);
+		if (res > 0) {
+			conn->inlen += res;
+		} else if (res == 0 || (errno != EAGAIN && errno != EINTR)) {
+			conn->closing = 1;
+			/* Stop polling, the request could still be running */
+			epoll_ctl(conn->cs->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+		}
+	}
+
+	ctlconn_process(conn);
+}
+
+static void ctlsock_accept(struct ctlsock *cs)
+{
+	struct ctlconn *conn;
+	struct epoll_event ev;
+	int fd;
+
+	while ((fd = accept4(cs->fd, NULL, NULL, SOCK_NONBLOCK |
+					       SOCK_CLOEXEC)) >= 0) {
+		conn = calloc(1, sizeof(*conn));
+		if (!conn || ringbuf_init(&conn->out, CTLCONN_OUT_SIZE)) {
+			fprintf(stderr, "unable to allocate control connection\n");
+			free(conn);
+			close(fd);
+			continue;
+		}
+		conn->cs = cs;
+		conn->fd = fd;
+		conn->next = cs->conns;
+		if (conn->next)
+			conn->next->pprev = &conn->next;
+		conn->pprev = &cs->conns;
+		cs->conns = conn;
+
+		memset(&ev, 0x00, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = conn;
+		if (epoll_ctl(cs->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+			perror("epoll_ctl()");
+			ctlconn_free(conn);
+			continue;
+		}
+		conn->epev = EPOLLIN;
+	}
+}
+
+/* Process pending events, should be called on the descriptor readiness */
+void ctlsock_process(struct ctlsock *cs)
+{
+	struct epoll_event events[16];
+	int i, nev;
+
+	do {
+		nev = epoll_wait(cs->epfd, events, 16, 0);
+		for (i = 0; i < nev; ++i) {
+			if (events[i].data.ptr)
+				ctlconn_event(events[i].data.ptr,
+					      events[i].events);
+			else
+				ctlsock_accept(cs);
+		}
+	} while (nev == 16);
+}
+
+int ctlsock_fd(const struct ctlsock *cs)
+{
+	return cs->epfd;
+}
+
+struct ctlsock *ctlsock_open(const char *path, ctlsock_req_t req, void *priv)
+{
+	struct sockaddr_un sa;
+	struct epoll_event ev;
+	struct ctlsock *cs;
+
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		fprintf(stderr, "control socket path is too long\n");
+		return NULL;
+	}
+
+	cs = calloc(1, sizeof(*cs));
+	if (!cs)
+		return NULL;
+	cs->req = req;
+	cs->priv = priv;
+	cs->epfd = -1;
+
+	cs->path = strdup(path);
+	if (!cs->path)
+		goto err_free;
+
+	cs->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (cs->fd < 0) {
+		perror("socket()");
+		goto err_free;
+	}
+
+	memset(&sa, 0x00, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	unlink(path);		/* Remove a stale socket */
+	if (bind(cs->fd, (struct sockaddr *)&sa, sizeof(sa)) ||
+	    listen(cs->fd, 16)) {
+		fprintf(stderr, "unable to listen on %s: %s\n", path,
+			strerror(errno));
+		goto err_close;
+	}
+
+	cs->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (cs->epfd < 0) {
+		perror("epoll_create1()");
+		goto err_unlink;
+	}
+	memset(&ev, 0x00, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(cs->epfd, EPOLL_CTL_ADD, cs->fd, &ev)) {
+		perror("epoll_ctl()");
+		goto err_unlink;
+	}
+
+	return cs;
+
+err_unlink:
+	if (cs->epfd >= 0)
+		close(cs->epfd);
+	unlink(path);
+err_close:
+	close(cs->fd);
+err_free:
+	free(cs->path);
+	free(cs);
+
+	return NULL;
+}
+
+/* Connections with a running request are freed as well */
+void ctlsock_close(struct ctlsock *cs)
+{
+	if (!cs)
+		return;
+
+	while (cs->conns)
+		ctlconn_free(cs->conns);
+	close(cs->epfd);
+	close(cs->fd);
+	unlink(cs->path);
+	free(cs->path);
+	free(cs);
+}
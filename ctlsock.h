@@ -0,0 +1,28 @@
+/**
+ * Control socket header file
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#ifndef _CTLSOCK_H_
+#define _CTLSOCK_H_
+
+#include <stddef.h>
+
+struct ctlsock;
+struct ctlconn;
+
+/**
+ * Request handler, the line is valid during the call only. The handler should
+ * finish the request with ctlconn_done() either before returning or later.
+ */
+typedef void (*ctlsock_req_t)(struct ctlconn *conn, char *line, void *priv);
+
+struct ctlsock *ctlsock_open(const char *path, ctlsock_req_t req, void *priv);
+int ctlsock_fd(const struct ctlsock *cs);
+void ctlsock_process(struct ctlsock *cs);
+void ctlsock_close(struct ctlsock *cs);
+int ctlconn_write(struct ctlconn *conn, const char *buf, size_t len);
+void ctlconn_done(struct ctlconn *conn, const char *err);
+
+#endif	/* _CTLSOCK_H_ */
@@ -0,0 +1,240 @@
+/**
+ * Listening socket transports
+ *
+ * Each modem listens on its own TCP port (the base port plus the modem
+ * number) or UNIX socket path and serves a single client at a time. The
+ * telnet flavour asks the client for the character mode without local echo
+ * and strips the negotiation commands from the input, so a plain telnet
+ * client could be used as a terminal.
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#define _GNU_SOURCE		/* for accept4() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "listener.h"
+
+#define TELNET_IAC		255
+#define TELNET_DONT		254
+#define TELNET_DO		253
+#define TELNET_WONT		252
+#define TELNET_WILL		251
+#define TELNET_SB		250
+#define TELNET_SE		240
+#define TELNET_OPT_ECHO		1
+#define TELNET_OPT_SGA		3	/* Suppress go ahead */
+
+enum telnet_state {		/* Input filter state */
+	TELNET_DATA,
+	TELNET_CR,		/* CR received, skip a following NUL */
+	TELNET_CMD,		/* IAC received */
+	TELNET_OPT,		/* Option negotiation command received */
+	TELNET_SUB,		/* Subnegotiation */
+	TELNET_SUB_IAC,		/* IAC received inside the subnegotiation */
+};
+
+/**
+ * Parse the listening address: "tcp:[<host>:]<port>", "telnet:[<host>:]<port>"
+ * or "unix:<path>". Host defaults to the loopback one.
+ */
+int lsn_parse(const char *str, struct lsn_addr *addr)
+{
+	const char *p, *hp;
+	char *end;
+
+	memset(addr, 0x00, sizeof(*addr));
+
+	if (strncmp(str, "unix:", 5) == 0) {
+		addr->type = LSN_UNIX;
+		addr->path = str + 5;
+		return *addr->path ? 0 : -EINVAL;
+	} else if (strncmp(str, "tcp:", 4) == 0) {
+		addr->type = LSN_TCP;
+		p = str + 4;
+	} else if (strncmp(str, "telnet:", 7) == 0) {
+		addr->type = LSN_TELNET;
+		p = str + 7;
+	} else {
+		return -EINVAL;
+	}
+
+	hp = strrchr(p, ':');
+	if (hp) {
+		if (hp - p >= sizeof(addr->host))
+			return -EINVAL;
+		memcpy(addr->host, p, hp - p);
+		p = hp + 1;
+	} else {
+		strcpy(addr->host, "127.0.0.1");
+	}
+
+	addr->port = strtoul(p, &end, 10);
+	if (end == p || *end != '\0' || addr->port == 0 || addr->port > 65535)
+		return -EINVAL;
+
+	return 0;
+}
+
+/**
+ * Open the modem listening socket, the path is used for UNIX sockets
+ * instead of the address one (e.g. an expanded template).
+ */
+int lsn_open(const struct lsn_addr *addr, unsigned id, const char *path)
+{
+	struct sockaddr_in sin;
+	struct sockaddr_un sun;
+	int fd, on = 1;
+
+	if (addr->type == LSN_UNIX) {
+		if (strlen(path) >= sizeof(sun.sun_path)) {
+			fprintf(stderr, "socket path %s is too long\n", path);
+			return -1;
+		}
+		memset(&sun, 0x00, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, path);
+		unlink(path);		/* Remove a stale socket */
+	} else {
+		if (addr->port + id > 65535) {
+			fprintf(stderr, "modem %u port is out of range\n", id);
+			return -1;
+		}
+		memset(&sin, 0x00, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(addr->port + id);
+		if (inet_pton(AF_INET, addr->host, &sin.sin_addr) != 1) {
+			fprintf(stderr, "invalid listening address %s\n",
+				addr->host);
+			return -1;
+		}
+	}
+
+	fd = socket(addr->type == LSN_UNIX ? AF_UNIX : AF_INET,
+		    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket()");
+		return -1;
+	}
+
+	if (addr->type != LSN_UNIX)
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	if ((addr->type == LSN_UNIX ?
+	     bind(fd, (struct sockaddr *)&sun, sizeof(sun)) :
+	     bind(fd, (struct sockaddr *)&sin, sizeof(sin))) ||
+	    listen(fd, 4)) {
+		if (addr->type == LSN_UNIX)
+			fprintf(stderr, "unable to listen on %s: %s\n", path,
+				strerror(errno));
+		else
+			fprintf(stderr, "unable to listen on %s:%u: %s\n",
+				addr->host, addr->port + id, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	if (addr->type == LSN_UNIX)
+		printf("Listening socket - %s\n", path);
+	else
+		printf("Listening socket - %s:%u\n", addr->host,
+		       addr->port + id);
+
+	return fd;
+}
+
+/* Returns the client connection or -1 if there is nothing to accept */
+int lsn_accept(int lfd, const struct lsn_addr *addr)
+{
+	int fd, on = 1;
+
+	fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			perror("accept4()");
+		return -1;
+	}
+
+	/* Responses are written at once, do not wait for more data */
+	if (addr->type != LSN_UNIX)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	return fd;
+}
+
+/* Ask the client to not echo locally and to send characters at once */
+int telnet_hello(int fd)
+{
+	static const unsigned char hello[] = {
+		TELNET_IAC, TELNET_WILL, TELNET_OPT_ECHO,
+		TELNET_IAC, TELNET_WILL, TELNET_OPT_SGA,
+		TELNET_IAC, TELNET_DO, TELNET_OPT_SGA,
+	};
+
+	return write(fd, hello, sizeof(hello)) == sizeof(hello) ? 0 : -EIO;
+}
+
+/**
+ * Strip telnet commands from the input in place, returns the data length.
+ * The state should be zeroed for a new connection.
+ */
+size_t telnet_filter(uint8_t *state, char *buf, size_t len)
+{
+	unsigned char c;
+	size_t i, n = 0;
+
+	for (i = 0; i < len; ++i) {
+		c = buf[i];
+		switch (*state) {
+		case TELNET_CR:
+			*state = TELNET_DATA;
+			if (c == '\0')
+				break;
+			/* Fallthrough */
+		case TELNET_DATA:
+			if (c == TELNET_IAC) {
+				*state = TELNET_CMD;
+				break;
+			}
+			if (c == '\r')
+				*state = TELNET_CR;
+			buf[n++] = c;
+			break;
+		case TELNET_CMD:
+			if (c == TELNET_IAC) {		/* Escaped 255 */
+				buf[n++] = c;
+				*state = TELNET_DATA;
+			} else if (c >= TELNET_WILL && c <= TELNET_DONT) {
+				*state = TELNET_OPT;
+			} else if (c == TELNET_SB) {
+				*state = TELNET_SUB;
+			} else {
+				*state = TELNET_DATA;
+			}
+			break;
+		case TELNET_OPT:
+			*state = TELNET_DATA;
+			break;
+		case TELNET_SUB:
+			if (c == TELNET_IAC)
+				*state = TELNET_SUB_IAC;
+			break;
+		case TELNET_SUB_IAC:
+			*state = c == TELNET_SE ? TELNET_DATA : TELNET_SUB;
+			break;
+		}
+	}
+
+	return n;
+}
@@ -0,0 +1,32 @@
+/**
+ * Listening socket transports header file
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#ifndef _LISTENER_H_
+#define _LISTENER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum lsn_type {
+	LSN_TCP,		/* Raw TCP */
+	LSN_TELNET,		/* TCP with telnet negotiation filtering */
+	LSN_UNIX,		/* UNIX stream socket */
+};
+
+struct lsn_addr {
+	enum lsn_type type;
+	char host[0x40];	/* TCP address */
+	unsigned port;		/* TCP port of the first modem */
+	const char *path;	/* UNIX socket path (template) */
+};
+
+int lsn_parse(const char *str, struct lsn_addr *addr);
+int lsn_open(const struct lsn_addr *addr, unsigned id, const char *path);
+int lsn_accept(int lfd, const struct lsn_addr *addr);
+int telnet_hello(int fd);
+size_t telnet_filter(uint8_t *state, char *buf, size_t len);
+
+#endif	/* _LISTENER_H_ */
@@ -0,0 +1,440 @@
+/**
+ * Modem AT interface load generator and latency benchmark
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+
+#define ARRAY_SIZE(__a)		(sizeof(__a)/sizeof((__a)[0]))
+
+#define NSEC_PER_SEC		1000000000ULL
+
+struct bench_port {
+	unsigned id;
+	int fd;
+	int busy;		/* Command is in flight */
+	int warm;		/* Echo disabling command is done */
+	unsigned cmdidx;	/* Next command from the mix */
+	uint64_t sent;		/* In flight command send time, ns */
+	uint64_t next;		/* Next command send time, ns */
+	char line[0x400];	/* Incomplete response line */
+	size_t linelen;
+};
+
+static struct bench_state {
+	struct bench_port *ports;
+	unsigned nports;
+	const char *cmds[32];	/* Commands mix */
+	unsigned ncmds;
+	uint64_t interval;	/* Per port commands interval, 0 - flat out */
+	uint64_t timeout;	/* Response waiting timeout */
+	int epfd;
+	struct {		/* Collected latency samples, ns */
+		uint64_t *buf;
+		size_t len;
+		size_t size;
+	} lat;
+	unsigned long nok;
+	unsigned long nerr;
+	unsigned long ntimeout;
+	volatile sig_atomic_t stop;
+} __state, *state = &__state;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static int lat_add(uint64_t val)
+{
+	uint64_t *buf;
+	size_t size;
+
+	if (state->lat.len == state->lat.size) {
+		size = state->lat.size ? state->lat.size * 2 : 0x10000;
+		buf = realloc(state->lat.buf, size * sizeof(*buf));
+		if (!buf)
+			return -ENOMEM;
+		state->lat.buf = buf;
+		state->lat.size = size;
+	}
+	state->lat.buf[state->lat.len++] = val;
+
+	return 0;
+}
+
+static int lat_cmp(const void *a, const void *b)
+{
+	uint64_t va = *(const uint64_t *)a, vb = *(const uint64_t *)b;
+
+	return va < vb ? -1 : va > vb ? 1 : 0;
+}
+
+static double lat_pct(double q)
+{
+	return state->lat.buf[(size_t)(q * (state->lat.len - 1))] / 1000.0;
+}
+
+static int port_send(struct bench_port *port, uint64_t now)
+{
+	const char *cmd;
+	char buf[0x200];
+	int len;
+
+	if (!port->warm) {
+		cmd = "ATE0";
+	} else {
+		cmd = state->cmds[port->cmdidx];
+		port->cmdidx = (port->cmdidx + 1) % state->ncmds;
+	}
+
+	len = snprintf(buf, sizeof(buf), "%s\r", cmd);
+	if (write(port->fd, buf, len) != len) {
+		fprintf(stderr, "port %u write: %s\n", port->id,
+			strerror(errno));
+		return -EIO;
+	}
+	port->busy = 1;
+	port->sent = now;
+
+	return 0;
+}
+
+static int is_final_result(const char *line)
+{
+	return strcmp(line, "OK") == 0 || strcmp(line, "ERROR") == 0 ||
+	       strncmp(line, "+CME ERROR:", 11) == 0 ||
+	       strncmp(line, "+CMS ERROR:", 11) == 0;
+}
+
+static int port_complete(struct bench_port *port, const char *line,
+			 uint64_t now)
+{
+	port->busy = 0;
+	port->next = state->interval ? port->sent + state->interval : now;
+	if (port->next < now)
+		port->next = now;
+
+	if (!port->warm) {
+		port->warm = 1;
+		return 0;
+	}
+
+	if (strcmp(line, "OK") == 0)
+		state->nok++;
+	else
+		state->nerr++;
+
+	return lat_add(now - port->sent);
+}
+
+static int port_rx(struct bench_port *port)
+{
+	char buf[0x1000];
+	uint64_t now;
+	ssize_t i, res;
+
+	res = read(port->fd, buf, sizeof(buf));
+	if (res < 0)
+		return errno == EINTR || errno == EAGAIN ? 0 : -errno;
+
+	now = now_ns();
+	for (i = 0; i < res; ++i) {
+		if (buf[i] == '\r')
+			continue;
+		if (buf[i] != '\n') {
+			if (port->linelen < sizeof(port->line) - 1)
+				port->line[port->linelen++] = buf[i];
+			continue;
+		}
+		port->line[port->linelen] = '\0';
+		port->linelen = 0;
+		if (!port->busy || !is_final_result(port->line))
+			continue;
+		if (port_complete(port, port->line, now))
+			return -ENOMEM;
+		/* Send a next command as soon as possible in flat out mode */
+		if (!state->interval && port_send(port, now))
+			return -EIO;
+	}
+
+	return 0;
+}
+
+/**
+ * Send scheduled commands and detect lost responses, returns a time of the
+ * nearest scheduled event.
+ */
+static int ports_service(uint64_t now, uint64_t *nearest)
+{
+	struct bench_port *port;
+	unsigned i;
+
+	*nearest = now + state->timeout;
+	for (i = 0; i < state->nports; ++i) {
+		port = &state->ports[i];
+		if (port->busy) {
+			if (now - port->sent < state->timeout)
+				continue;
+			state->ntimeout++;
+			port->busy = 0;
+			port->linelen = 0;
+			port->next = now;
+		}
+		if (port->next > now) {
+			if (port->next < *nearest)
+				*nearest = port->next;
+			continue;
+		}
+		if (port_send(port, now))
+			return -EIO;
+	}
+
+	return 0;
+}
+
+static int make_devname(char *buf, size_t size, const char *tmpl,
+			unsigned id)
+{
+	const char *p = strstr(tmpl, "%u");
+	int res;
+
+	if (!p)
+		p = strstr(tmpl, "%d");
+	if (!p)
+		return -EINVAL;
+
+	res = snprintf(buf, size, "%.*s%u%s", (int)(p - tmpl), tmpl, id, p + 2);
+
+	return res < size ? 0 : -ENAMETOOLONG;
+}
+
+static int port_open(struct bench_port *port, unsigned id, const char *tmpl)
+{
+	char devname[0x100];
+	struct epoll_event ev;
+	struct termios tio;
+
+	port->id = id;
+	port->fd = -1;
+
+	if (state->nports > 1) {
+		if (make_devname(devname, sizeof(devname), tmpl, id)) {
+			fprintf(stderr, "invalid device name template\n");
+			return -EINVAL;
+		}
+		tmpl = devname;
+	}
+
+	port->fd = open(tmpl, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (port->fd < 0) {
+		fprintf(stderr, "unable to open %s: %s\n", tmpl,
+			strerror(errno));
+		return -errno;
+	}
+
+	/* Writes are short, so block on them to keep the code simple */
+	fcntl(port->fd, F_SETFL, fcntl(port->fd, F_GETFL) & ~O_NONBLOCK);
+
+	if (tcgetattr(port->fd, &tio) == 0) {
+		cfmakeraw(&tio);
+		tcsetattr(port->fd, TCSANOW, &tio);
+	}
+	tcflush(port->fd, TCIOFLUSH);
+
+	memset(&ev, 0x00, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = port;
+	if (epoll_ctl(state->epfd, EPOLL_CTL_ADD, port->fd, &ev)) {
+		perror("epoll_ctl()");
+		return -errno;
+	}
+
+	return 0;
+}
+
+static void report(uint64_t elapsed)
+{
+	double secs = (double)elapsed / NSEC_PER_SEC;
+
+	printf("Ports: %u, duration: %.3f s\n", state->nports, secs);
+	printf("Commands: %lu ok, %lu error, %lu timeout\n", state->nok,
+	       state->nerr, state->ntimeout);
+	printf("Throughput: %.1f cmd/s\n", (state->nok + state->nerr) / secs);
+	if (!state->lat.len)
+		return;
+
+	qsort(state->lat.buf, state->lat.len, sizeof(state->lat.buf[0]),
+	      lat_cmp);
+	printf("Latency, us: min %.1f, p50 %.1f, p99 %.1f, p999 %.1f, max %.1f\n",
+	       lat_pct(0.0), lat_pct(0.5), lat_pct(0.99), lat_pct(0.999),
+	       lat_pct(1.0));
+}
+
+static void sig_stop(int signal)
+{
+	state->stop = 1;
+}
+
+static void usage(const char *name)
+{
+	printf(
+		"Modem AT interface load generator and latency benchmark\n"
+		"\n"
+		"Usage:\n"
+		"  %s -h\n"
+		"  %s -l <filename> [-n <count>] [-c <command>]... [-r <rate>] [-t <secs>]\n"
+		"\n"
+		"Options:\n"
+		"  -h        Print this message\n"
+		"  -l <filename> Emulator terminal device (or its symbolic link). If\n"
+		"            multiple ports are requested, then the first \"%%u\" of the\n"
+		"            name is replaced with the port number (e.g. /tmp/modem%%u)\n"
+		"  -n <count> Number of ports to load (default: 1)\n"
+		"  -c <command> Add a command to the mix, could be specified multiple\n"
+		"            times (default: AT+CSQ, AT+COPS? and AT+CMGL=4)\n"
+		"  -r <rate> Commands per second per port (default: 0 - as fast as\n"
+		"            possible)\n"
+		"  -t <secs> Benchmark duration (default: 10)\n"
+		"\n", name, name
+	);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *name = basename(argv[0]);
+	const char *devname = NULL;
+	struct epoll_event events[64];
+	uint64_t start, end, now, nearest;
+	unsigned i, duration = 10;
+	struct sigaction sigact;
+	int opt, nev, res, timeout;
+	double rate = 0;
+
+	state->nports = 1;
+	state->timeout = 5 * NSEC_PER_SEC;
+
+	while (1) {
+		opt = getopt(argc, argv, "+hc:l:n:r:t:");
+		if (opt == -1)
+			break;
+		switch (opt) {
+		case 'h':
+			usage(name);
+			return EXIT_SUCCESS;
+		case 'c':
+			if (state->ncmds == ARRAY_SIZE(state->cmds)) {
+				fprintf(stderr, "too many commands\n");
+				return EXIT_FAILURE;
+			}
+			state->cmds[state->ncmds++] = optarg;
+			break;
+		case 'l':
+			devname = optarg;
+			break;
+		case 'n':
+			state->nports = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			rate = strtod(optarg, NULL);
+			break;
+		case 't':
+			duration = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!devname || !state->nports || rate < 0) {
+		usage(name);
+		return EXIT_FAILURE;
+	}
+
+	if (!state->ncmds) {
+		state->cmds[state->ncmds++] = "AT+CSQ";
+		state->cmds[state->ncmds++] = "AT+COPS?";
+		state->cmds[state->ncmds++] = "AT+CMGL=4";
+	}
+	state->interval = rate > 0 ? NSEC_PER_SEC / rate : 0;
+
+	state->epfd = epoll_create1(0);
+	if (state->epfd < 0) {
+		perror("epoll_create1()");
+		return EXIT_FAILURE;
+	}
+
+	state->ports = calloc(state->nports, sizeof(*state->ports));
+	if (!state->ports) {
+		fprintf(stderr, "unable to allocate ports state\n");
+		return EXIT_FAILURE;
+	}
+	now = now_ns();
+	for (i = 0; i < state->nports; ++i) {
+		if (port_open(&state->ports[i], i, devname))
+			return EXIT_FAILURE;
+		/* Spread ports start over the interval to avoid bursts */
+		state->ports[i].next = now + state->interval * i /
+					     state->nports;
+		state->ports[i].cmdidx = i % state->ncmds;
+	}
+
+	memset(&sigact, 0x00, sizeof(sigact));
+	sigact.sa_handler = sig_stop;
+	sigaction(SIGINT, &sigact, NULL);
+	sigaction(SIGTERM, &sigact, NULL);
+
+	start = now_ns();
+	end = start + duration * NSEC_PER_SEC;
+	for (now = start; !state->stop && now < end; now = now_ns()) {
+		if (ports_service(now, &nearest))
+			return EXIT_FAILURE;
+
+		timeout = nearest > now ? (nearest - now + 999999) / 1000000 : 0;
+		nev = epoll_wait(state->epfd, events, ARRAY_SIZE(events),
+				 timeout);
+		if (nev < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait()");
+			return EXIT_FAILURE;
+		}
+
+		for (i = 0; i < nev; ++i) {
+			res = port_rx(events[i].data.ptr);
+			if (res) {
+				fprintf(stderr, "port read: %s\n",
+					strerror(-res));
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	report(now - start);
+
+	for (i = 0; i < state->nports; ++i)
+		close(state->ports[i].fd);
+	free(state->ports);
+	free(state->lat.buf);
+	close(state->epfd);
+
+	return EXIT_SUCCESS;
+}
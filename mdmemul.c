@@ -4,62 +4,380 @@
  * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
  */
 
-#define _XOPEN_SOURCE		600	/* for posix_pty/grantpt/unlockpt */
+#define _XOPEN_SOURCE		700	/* for posix_pty/grantpt/unlockpt and
+					   open_memstream */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <libgen.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <fcntl.h>
 #include <termios.h>
 #include <signal.h>
 #include <errno.h>
 #include <time.h>
+#include <sched.h>
 
 #include <sys/types.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
 
 #include "atport.h"
+#include "cmux.h"
+#include "ctlsock.h"
+#include "listener.h"
 #include "modem.h"
+#include "ringbuf.h"
+#include "scenario.h"
+#include "profile.h"
+#include "shaper.h"
+#include "spscq.h"
+#include "timer.h"
+#include "trace.h"
+#include "vclock.h"
 
-static struct cmn_state {
+#define ARRAY_SIZE(__a)		(sizeof(__a)/sizeof((__a)[0]))
+
+#define TICK_PERIOD_MS		1000	/* Modem state update period */
+#define SMSINJ_PERIOD_MS	10	/* SMS injection granularity */
+
+#define TXQ_SIZE		0x10000	/* Per port output queue size */
+#define TXQ_SIZE_MAX		0x1000000	/* Queue growth limit */
+#define TXQ_RX_PAUSE		(TXQ_SIZE / 2)	/* Input pause threshold */
+
+#define CTLQ_SIZE		0x1000	/* Per worker control queue size */
+
+struct mdm_worker;
+
+struct mdm_inst {		/* Emulated modem instance */
+	unsigned id;
+	int fd;			/* PTY master or client connection, -1 - none */
+	int lfd;		/* Listening socket, -1 for the PTY transport */
+	uint8_t telnet;		/* Telnet input filter state */
+	uint32_t epev;		/* Currently subscribed epoll events */
+	struct ringbuf txq;	/* Not yet sent output */
+	unsigned long tx_dropped;
+	struct shaper shaper;	/* Serial line emulation, see state->shape */
+	struct timer txt;	/* Shaped output release */
+	int tx_blocked;		/* Shaped output waits for the PTY room */
 	struct atport *atport;
+	struct cmux *cmux;	/* Multiplexer, NULL in the AT mode */
 	struct modem_state *mdm;
-	int pty_fd;
-	int sig_usr1;
+	struct timer tick;
+	struct mdm_worker *wrk;	/* Owning worker */
+};
+
+enum ctl_op {
+	CTL_TEST_SMS,		/* Add a test SMS to each worker modem */
+	CTL_STATS_DUMP,		/* Dump each worker modem statistics */
+	CTL_ADD_SMS,		/* Add a text SMS to the specified modem */
+	CTL_REQ,		/* Apply the control socket request to modems */
+};
+
+enum ctl_req_type {
+	CTL_REQ_OP,		/* Scenario operation, e.g. "rssi -80" */
+	CTL_REQ_TEST_SMS,	/* Add a test SMS */
+	CTL_REQ_STATS,		/* Dump statistics */
+};
+
+/**
+ * Control socket request, which is shared by the workers that own the
+ * requested modems. The last one to finish passes the request back to the
+ * main thread to reply.
+ */
+struct ctl_req {
+	struct ctlconn *conn;
+	enum ctl_req_type type;
+	struct scn_op op;
+	char *text;		/* Operation text for the session recording */
+	atomic_uint refs;	/* Dispatcher and messages in flight */
+	unsigned long modems;	/* Requested modems */
+	unsigned dropped;	/* Control queue overflows */
+	FILE *out;		/* Response data lines */
+	char *buf;
+	size_t len;
+	int interned;		/* Operation strings are shared, see ctl_str */
+	struct ctl_req *next;	/* Done queue overflow list */
+};
+
+struct ctl_str {		/* Interned control request string */
+	struct ctl_str *next;
+	char str[];
+};
+
+struct ctl_msg {		/* Worker control message */
+	enum ctl_op op;
+	struct mdm_inst *inst;
+	const char *text;
+	struct ctl_req *req;
+	unsigned first;		/* CTL_REQ modems range (inclusive) */
+	unsigned last;
+};
+
+/**
+ * Event loop thread, which exclusively owns a shard of the fleet, so modems
+ * state is never shared between threads. The main thread controls workers
+ * via the lock-free control queues.
+ */
+struct mdm_worker {
+	unsigned id;
+	pthread_t thread;
+	int started;
+	int epfd;
+	int evfd;		/* Control queue doorbell */
+	struct spscq ctlq;
+	struct spscq doneq;	/* Finished control requests */
+	struct ctl_req *spilled;	/* Not fitted the done queue on exit */
+	struct timer_wheel timers;
+	struct mdm_inst *insts;
+	unsigned ninsts;
+	atomic_int stop;
+	atomic_int idle;	/* ASAP clock: waits for the clock advance */
+	atomic_ullong next;	/* ASAP clock: nearest timer moment */
+	int res;		/* Exit status, see inst_rx() */
+	atomic_ulong inj_parts;		/* Stored injected PDUs */
+	atomic_ulong inj_dropped;	/* Messages not fitted the storage */
+	atomic_ullong inj_gen_ns;	/* Time spent on generation */
+};
+
+static struct cmn_state {
+	struct mdm_inst *insts;
+	unsigned ninsts;
+	struct mdm_worker *wrks;
+	unsigned nwrks;
+	int epfd;
+	int sigfd;
+	int evfd;		/* Worker exit notification */
+	int idlefd;		/* Worker idle notification (ASAP clock) */
+	int donefd;		/* Control request finish notification */
+	struct ctlsock *ctl;
+	struct ctl_str *strs;	/* Strings referenced by modems */
+	struct timer_wheel timers;
+	uint64_t seed;		/* Modems pseudo random generators seed */
+	struct scenario *scn;
+	struct profile_db *profs;	/* Modems identities, NULL - default */
+	struct shaper_cfg shape;	/* Serial line emulation */
+	int shaped;
+	struct lsn_addr lsn;	/* Modems listening address, see listen */
+	int listen;		/* Serve modems on sockets instead of PTYs */
+	struct {		/* SMS injection engine */
+		double rate;		/* Messages per second, 0 - disabled */
+		uint64_t start;		/* Injection start time, ms */
+		unsigned long msgs;	/* Injected messages */
+		unsigned long dropped;	/* Control queue overflows */
+		unsigned next;		/* Next modem to receive a message */
+		struct timer timer;
+	} inj;
 } __state, *state = &__state;
 
-static void dump_exchange(const char *pref, const char *buf, size_t len)
+/* Sample texts, cover GSM 7 bit, extension table, UCS2 and concatenation */
+static const char * const smsinj_texts[] = {
+	"Your verification code is 472913",
+	"Balance: 12.50 EUR [bonus 3 €]",
+	"Добро пожаловать в сеть FunComm!",
+	"This is a long message that does not fit a single SMS, so it will be "
+	"split into several parts and delivered as a concatenated message. "
+	"Each part carries a user data header with a reference number, the "
+	"total number of parts and the sequence number of the part.",
+};
+
+static uint64_t now_ns(void)
 {
-	size_t i;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	printf("%s[%zd]: ", pref, len);
-	for (i = 0; i < len; ++i) {
-		if (buf[i] == '\r')
-			fputs("\\r", stdout);
-		else if (buf[i] == '\n')
-			fputs("\\n", stdout);
-		else
-			putc(buf[i], stdout);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Subscribe to the output readiness while there are queued data and stop
+ * receiving input while the output queue is (almost) full to pause parsing
+ * for a port with a stalled client.
+ */
+static void inst_update_events(struct mdm_inst *inst)
+{
+	struct epoll_event ev;
+	uint32_t events = 0;
+
+	if (ringbuf_len(&inst->txq) < TXQ_RX_PAUSE)
+		events |= EPOLLIN;
+	/* Shaped output is paced by the timer unless the PTY is full */
+	if (ringbuf_len(&inst->txq) && (!state->shaped || inst->tx_blocked))
+		events |= EPOLLOUT;
+	if (events == inst->epev)
+		return;
+
+	memset(&ev, 0x00, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = inst;
+	if (epoll_ctl(inst->wrk->epfd, EPOLL_CTL_MOD, inst->fd, &ev)) {
+		perror("epoll_ctl()");
+		return;
 	}
-	putc('\n', stdout);
+	inst->epev = events;
+}
+
+static int inst_tx(struct mdm_inst *inst)
+{
+	size_t max = SIZE_MAX;
+	uint64_t next;
+	int res;
+
+	if (state->shaped) {
+		max = shaper_budget(&inst->shaper, vclock_now_ms(), &next);
+		if (max > ringbuf_len(&inst->txq))
+			max = ringbuf_len(&inst->txq);
+	}
+
+	res = ringbuf_write_fd(&inst->txq, inst->fd, max);
+	if (res < 0) {
+		fprintf(stderr, "modem %u write: %s\n", inst->id,
+			strerror(-res));
+		return res;
+	}
+
+	if (state->shaped) {
+		shaper_consume(&inst->shaper, res);
+		inst->tx_blocked = res < max;
+		if (!inst->tx_blocked && next != SHAPER_NEVER)
+			timer_add(&inst->wrk->timers, &inst->txt, next);
+	}
+
+	/* Do not keep the queue grown by a long response */
+	ringbuf_shrink(&inst->txq, TXQ_SIZE);
+	inst_update_events(inst);
+
+	return 0;
+}
+
+static void inst_tx_release(struct timer *t, void *priv)
+{
+	inst_tx(priv);
 }
 
 static int port_write(const char *buf, size_t len, void *priv)
 {
-	struct cmn_state *state = priv;
+	struct mdm_inst *inst = priv;
+	ssize_t res;
+	size_t n;
 
 	if (len == 0)
 		return 0;
 
-	dump_exchange("Tx", buf, len);
+	if (trace_enabled())
+		trace_data(inst->id, TRACE_TX, buf, len);
 
-	return write(state->pty_fd, buf, len) < 0 ? -errno : 0;
+	/* Preserve ordering, write directly only if nothing is queued */
+	if (!ringbuf_len(&inst->txq) && !state->shaped) {
+		res = write(inst->fd, buf, len);
+		if (res < 0 && errno != EAGAIN && errno != EINTR)
+			return -errno;
+		if (res > 0) {
+			buf += res;
+			len -= res;
+		}
+	}
+	if (!len)
+		return 0;
+
+	/**
+	 * Input is paused while the queue is filled, but a single response
+	 * (e.g. a long messages list) could still exceed the queue size, so
+	 * grow the queue up to a sane limit instead of response truncation.
+	 */
+	if (ringbuf_room(&inst->txq) < len &&
+	    ringbuf_len(&inst->txq) + len <= TXQ_SIZE_MAX)
+		ringbuf_grow(&inst->txq, ringbuf_len(&inst->txq) + len);
+
+	n = ringbuf_put(&inst->txq, buf, len);
+	if (n < len) {
+		if (!inst->tx_dropped)
+			fprintf(stderr, "modem %u output queue overflow, data will be dropped\n",
+				inst->id);
+		inst->tx_dropped += len - n;
+	}
+
+	if (state->shaped) {
+		shaper_enqueue(&inst->shaper, n, vclock_now_ms());
+		if (!inst->tx_blocked)
+			return inst_tx(inst);
+	}
+	inst_update_events(inst);
+
+	return 0;
+}
+
+static void port_cmd_exec(const struct atcmd *cmd, void *priv)
+{
+	struct mdm_inst *inst = priv;
+
+	if (state->shaped)
+		shaper_cmd(&inst->shaper, cmd->name);
+}
+
+static int port_mux_chan_open(struct atport *port, void *priv)
+{
+	struct mdm_inst *inst = priv;
+
+	return modem_add_atport(inst->mdm, port);
+}
+
+static void port_mux_chan_close(struct atport *port, void *priv)
+{
+	struct mdm_inst *inst = priv;
+
+	modem_del_atport(inst->mdm, port);
+}
+
+static const struct cmux_ops cmux_ops = {
+	.write = port_write,
+	.cmd_exec = port_cmd_exec,
+	.chan_open = port_mux_chan_open,
+	.chan_close = port_mux_chan_close,
+};
+
+/* Feed the multiplexer, the line returns to the AT port on close down */
+static int inst_mux_parse(struct mdm_inst *inst, const char *buf, size_t len)
+{
+	int res = cmux_parse(inst->cmux, buf, len);
+
+	if (cmux_closed(inst->cmux)) {
+		cmux_free(inst->cmux);
+		inst->cmux = NULL;
+		modem_add_atport(inst->mdm, inst->atport);
+	}
+
+	return res;
+}
+
+/**
+ * Switch the line to the multiplexer on AT+CMUX. The AT port is kept idle
+ * meanwhile, so it neither gets URCs nor loses its settings.
+ */
+static int port_mux(unsigned n1, const char *buf, size_t len, void *priv)
+{
+	struct mdm_inst *inst = priv;
+
+	inst->cmux = cmux_alloc(&cmux_ops, inst, modem_atcommands, inst->mdm,
+				n1);
+	if (!inst->cmux)
+		return -ENOMEM;
+	modem_del_atport(inst->mdm, inst->atport);
+
+	return len ? inst_mux_parse(inst, buf, len) : 0;
 }
 
 struct atops atops = {
 	.write = port_write,
+	.cmd_exec = port_cmd_exec,
+	.mux = port_mux,
 };
 
 static int open_pty(const char *linkname)
@@ -73,6 +391,12 @@ static int open_pty(const char *linkname)
 		return -1;
 	}
 
+	/* One stalled client should not block the whole event loop */
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+		perror("fcntl()");
+		goto err_close;
+	}
+
 	/* Disable master echo */
 	tcgetattr(fd, &tio);
 	tio.c_lflag = ~ECHO;
@@ -90,7 +414,8 @@ static int open_pty(const char *linkname)
 		goto err_close;
 	}
 
-	printf("Slave device name - %s\n", devname);
+	printf("Slave device name - %s%s%s\n", devname,
+	       linkname ? " -> " : "", linkname ? linkname : "");
 
 	/* Open slave PTY device to prevent it destroying on client close */
 	if (open(devname, O_RDWR | O_NOCTTY) < 0) {
@@ -124,10 +449,959 @@ err_close:
 	return -1;
 }
 
-static void sig_usr1(int signal)
+/**
+ * Build an instance symbolic link name from the user provided template by
+ * substitution of the first "%u" (or "%d") sequence with the instance id.
+ * We intentionally avoid passing the template to printf() as a format.
+ */
+static int make_linkname(char *buf, size_t size, const char *tmpl,
+			 unsigned id)
 {
-	/* NB: do not call modem API here to avoid races */
-	state->sig_usr1 = 1;
+	const char *p = strstr(tmpl, "%u");
+	int res;
+
+	if (!p)
+		p = strstr(tmpl, "%d");
+	if (!p)
+		return -EINVAL;
+
+	res = snprintf(buf, size, "%.*s%u%s", (int)(p - tmpl), tmpl, id, p + 2);
+
+	return res < size ? 0 : -ENAMETOOLONG;
+}
+
+/**
+ * To maintain stable frequency by price of phase instabillity, the next tick
+ * moment is calculated from the previous target moment, not from the actual
+ * handler call time.
+ */
+static void inst_tick(struct timer *t, void *priv)
+{
+	struct mdm_inst *inst = priv;
+
+	if (trace_recording())
+		trace_data(inst->id, TRACE_TICK, NULL, 0);
+	modem_tick(inst->mdm);
+	timer_add(&inst->wrk->timers, t, t->expires + TICK_PERIOD_MS);
+}
+
+static int inst_init(struct mdm_inst *inst, struct mdm_worker *wrk,
+		     unsigned id, const char *ltmpl, unsigned msgs_num)
+{
+	char linkname[0x100];
+	struct epoll_event ev;
+	int fd;
+
+	inst->id = id;
+	inst->wrk = wrk;
+	timer_init(&inst->tick, inst_tick, inst);
+	timer_init(&inst->txt, inst_tx_release, inst);
+	shaper_init(&inst->shaper, &state->shape, state->seed ^ ~(uint64_t)id,
+		    vclock_now_ms());
+
+	/* UNIX socket path is a template just like the link name */
+	if (state->listen)
+		ltmpl = state->lsn.type == LSN_UNIX ? state->lsn.path : NULL;
+
+	if (ltmpl && state->ninsts > 1) {
+		if (make_linkname(linkname, sizeof(linkname), ltmpl, id)) {
+			fprintf(stderr, "invalid %s name template\n",
+				state->listen ? "socket path" : "symbolic link");
+			return -EINVAL;
+		}
+		ltmpl = linkname;
+	}
+
+	if (state->listen) {
+		inst->lfd = lsn_open(&state->lsn, id, ltmpl);
+		fd = inst->lfd;
+	} else {
+		inst->fd = open_pty(ltmpl);
+		fd = inst->fd;
+	}
+	if (fd < 0)
+		return -EIO;
+
+	if (ringbuf_init(&inst->txq, TXQ_SIZE)) {
+		fprintf(stderr, "unable to allocate output queue\n");
+		goto err_close;
+	}
+
+	inst->mdm = modem_alloc(msgs_num);
+	if (!inst->mdm)
+		goto err_free_txq;
+	modem_set_seed(inst->mdm, state->seed ^ (uint64_t)id << 32);
+	if (state->profs) {
+		const struct profile_rec *prof = profile_get(state->profs, id);
+
+		if (!prof) {
+			fprintf(stderr, "modem %u profile is corrupted\n", id);
+			goto err_free_modem;
+		}
+		modem_set_profile(inst->mdm, prof);
+	}
+	modem_set_scenario(inst->mdm, scenario_prog(state->scn, id));
+
+	/* Listening port gets the AT port with a client */
+	if (!state->listen) {
+		inst->atport = atport_alloc(&atops, inst, modem_atcommands,
+					    inst->mdm);
+		if (!inst->atport)
+			goto err_free_modem;
+		modem_add_atport(inst->mdm, inst->atport);
+	}
+
+	memset(&ev, 0x00, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = inst;
+	if (epoll_ctl(wrk->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		perror("epoll_ctl()");
+		goto err_free_atport;
+	}
+	inst->epev = ev.events;
+
+	return 0;
+
+err_free_atport:
+	atport_free(inst->atport);
+err_free_modem:
+	modem_free(inst->mdm);
+err_free_txq:
+	ringbuf_fini(&inst->txq);
+err_close:
+	close(fd);
+	inst->fd = -1;
+	inst->lfd = -1;
+
+	return -ENOMEM;
+}
+
+static void inst_fini(struct mdm_inst *inst)
+{
+	if (inst->fd < 0 && inst->lfd < 0)
+		return;
+
+	timer_del(&inst->wrk->timers, &inst->tick);
+	timer_del(&inst->wrk->timers, &inst->txt);
+	cmux_free(inst->cmux);
+	modem_free(inst->mdm);
+	atport_free(inst->atport);
+	ringbuf_fini(&inst->txq);
+	if (inst->fd >= 0)
+		close(inst->fd);
+	if (inst->lfd >= 0)
+		close(inst->lfd);
+	inst->fd = -1;
+	inst->lfd = -1;
+}
+
+/**
+ * Serve the connected client with a fresh AT port, so it does not inherit
+ * the previous client parser state or output. A modem serves one client at
+ * a time, so the listener is paused till the client goes away.
+ */
+static int inst_accept(struct mdm_inst *inst)
+{
+	struct epoll_event ev;
+	int fd;
+
+	fd = lsn_accept(inst->lfd, &state->lsn);
+	if (fd < 0)
+		return 0;
+
+	inst->atport = atport_alloc(&atops, inst, modem_atcommands,
+				    inst->mdm);
+	if (!inst->atport) {
+		close(fd);
+		return 0;
+	}
+
+	memset(&ev, 0x00, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = inst;
+	if (epoll_ctl(inst->wrk->epfd, EPOLL_CTL_DEL, inst->lfd, NULL) ||
+	    epoll_ctl(inst->wrk->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		perror("epoll_ctl()");
+		atport_free(inst->atport);
+		inst->atport = NULL;
+		close(fd);
+		return -EIO;
+	}
+	inst->fd = fd;
+	inst->epev = ev.events;
+	inst->telnet = 0;
+
+	if (state->lsn.type == LSN_TELNET)
+		telnet_hello(fd);	/* Negotiation is advisory */
+
+	if (trace_recording())
+		trace_data(inst->id, TRACE_CONNECT, NULL, 0);
+	modem_add_atport(inst->mdm, inst->atport);
+
+	return 0;
+}
+
+/* Drop the client along with its AT port, multiplexer and unsent output */
+static int inst_disconnect(struct mdm_inst *inst)
+{
+	struct epoll_event ev;
+
+	if (trace_recording())
+		trace_data(inst->id, TRACE_DISCONNECT, NULL, 0);
+	cmux_free(inst->cmux);
+	inst->cmux = NULL;
+	modem_del_atport(inst->mdm, inst->atport);
+	atport_free(inst->atport);
+	inst->atport = NULL;
+
+	timer_del(&inst->wrk->timers, &inst->txt);
+	ringbuf_reset(&inst->txq);
+	shaper_init(&inst->shaper, &state->shape,
+		    state->seed ^ ~(uint64_t)inst->id, vclock_now_ms());
+	inst->tx_blocked = 0;
+
+	epoll_ctl(inst->wrk->epfd, EPOLL_CTL_DEL, inst->fd, NULL);
+	close(inst->fd);
+	inst->fd = -1;
+
+	memset(&ev, 0x00, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = inst;
+	if (epoll_ctl(inst->wrk->epfd, EPOLL_CTL_ADD, inst->lfd, &ev)) {
+		perror("epoll_ctl()");
+		return -EIO;
+	}
+	inst->epev = ev.events;
+
+	return 0;
+}
+
+/**
+ * Returns 0 on success, 1 if the parser requests emulation stop or negative
+ * error code in case of input reading failure.
+ */
+static int inst_rx(struct mdm_inst *inst)
+{
+	char buf[0x100];
+	int res;
+
+	res = read(inst->fd, buf, sizeof(buf));
+	if (res < 0 && (errno == EINTR || errno == EAGAIN))
+		return 0;
+	if (res <= 0 && inst->lfd >= 0)	/* Client has gone */
+		return inst_disconnect(inst);
+	if (res < 0) {
+		perror("read()");
+		return -errno;
+	}
+
+	if (state->listen && state->lsn.type == LSN_TELNET)
+		res = telnet_filter(&inst->telnet, buf, res);
+
+	if (trace_enabled())
+		trace_data(inst->id, TRACE_RX, buf, res);
+
+	if (inst->cmux)
+		res = inst_mux_parse(inst, buf, res);
+	else
+		res = atport_parse(inst->atport, buf, res);
+	if (res >= 0)
+		return 0;
+
+	/* A socket client failure (e.g. a reset on write) drops the client */
+	return inst->lfd >= 0 ? inst_disconnect(inst) : 1;
+}
+
+/**
+ * Each modem instance consumes a master and a slave PTY descriptors (or a
+ * listening and a client sockets), so raise the soft limit of open files up
+ * to the hard one to be able to run a large fleet without a manual ulimit
+ * tuning.
+ */
+static void raise_nofile_limit(unsigned ninsts)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl))
+		return;
+	if (rl.rlim_cur >= ninsts * 2 + 16)
+		return;
+	rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl))
+		perror("setrlimit()");
+	if (rl.rlim_cur < ninsts * 2 + 16)
+		fprintf(stderr, "open files limit is too low for %u modems\n",
+			ninsts);
+}
+
+/**
+ * Wake up the worker. Called by the main thread, which also moves the ASAP
+ * clock, so the clearing of the idle flag here holds the clock until the
+ * worker handles whatever it was kicked for and publishes idle again.
+ */
+static void worker_kick(struct mdm_worker *wrk)
+{
+	uint64_t val = 1;
+
+	atomic_store_explicit(&wrk->idle, 0, memory_order_relaxed);
+	if (write(wrk->evfd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		perror("write(eventfd)");
+}
+
+/* Returns non-zero if the worker control queue is full */
+static int worker_ctl(struct mdm_worker *wrk, enum ctl_op op)
+{
+	struct ctl_msg msg = {.op = op};
+
+	if (spscq_push(&wrk->ctlq, &msg)) {
+		fprintf(stderr, "worker %u control queue overflow\n", wrk->id);
+		return -ENOSPC;
+	}
+	worker_kick(wrk);
+
+	return 0;
+}
+
+/* Dump the modem statistics as a JSON line */
+static void inst_stats_dump(struct mdm_inst *inst, FILE *fp)
+{
+	fprintf(fp, "{\"modem\":%u,\"tx_dropped\":%lu,\"atport\":",
+		inst->id, inst->tx_dropped);
+	if (inst->atport)
+		atport_stats_dump(inst->atport, fp);
+	else
+		fputs("null", fp);	/* No client */
+	if (inst->cmux) {
+		fputs(",\"cmux\":", fp);
+		cmux_stats_dump(inst->cmux, fp);
+	}
+	fputs("}\n", fp);
+}
+
+static void worker_stats_dump(struct mdm_worker *wrk)
+{
+	unsigned i;
+
+	/* Keep the worker lines together */
+	flockfile(stdout);
+	for (i = 0; i < wrk->ninsts; ++i)
+		inst_stats_dump(&wrk->insts[i], stdout);
+	fflush(stdout);
+	funlockfile(stdout);
+}
+
+static void ctl_req_finish(struct ctl_req *req);
+
+/* Drop the request reference, the main thread passes NULL as the worker */
+static void ctl_req_put(struct ctl_req *req, struct mdm_worker *wrk)
+{
+	uint64_t val = 1;
+
+	if (atomic_fetch_sub(&req->refs, 1) != 1)
+		return;
+
+	if (!wrk) {
+		ctl_req_finish(req);
+		return;
+	}
+
+	/* Wait for the main thread to drain the queue, it never waits for us */
+	while (spscq_push(&wrk->doneq, &req)) {
+		if (atomic_load_explicit(&wrk->stop, memory_order_relaxed)) {
+			req->next = wrk->spilled;	/* Finished on exit */
+			wrk->spilled = req;
+			return;
+		}
+		if (write(state->donefd, &val, sizeof(val)) < 0 &&
+		    errno != EAGAIN)
+			perror("write(eventfd)");
+		sched_yield();
+	}
+	if (write(state->donefd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		perror("write(eventfd)");
+}
+
+static void worker_req_process(struct mdm_worker *wrk, struct ctl_msg *msg)
+{
+	struct ctl_req *req = msg->req;
+	struct mdm_inst *inst;
+	unsigned i;
+
+	if (req->type == CTL_REQ_STATS)
+		flockfile(req->out);
+	for (i = msg->first; i <= msg->last; ++i) {
+		inst = &state->insts[i];
+		switch (req->type) {
+		case CTL_REQ_OP:
+			if (trace_recording())
+				trace_data(inst->id, TRACE_CTL, req->text,
+					   strlen(req->text));
+			modem_exec(inst->mdm, &req->op);
+			break;
+		case CTL_REQ_TEST_SMS:
+			if (trace_recording())
+				trace_data(inst->id, TRACE_TEST_SMS, NULL, 0);
+			modem_add_test_sms(inst->mdm);
+			break;
+		case CTL_REQ_STATS:
+			inst_stats_dump(inst, req->out);
+			break;
+		}
+	}
+	if (req->type == CTL_REQ_STATS)
+		funlockfile(req->out);
+
+	ctl_req_put(req, wrk);
+}
+
+static void worker_add_sms(struct mdm_worker *wrk, struct mdm_inst *inst,
+			   const char *text)
+{
+	uint64_t ts = now_ns();
+	int res;
+
+	if (trace_recording())
+		trace_data(inst->id, TRACE_SMS, text, strlen(text));
+	res = modem_add_sms(inst->mdm, text);
+	atomic_fetch_add_explicit(&wrk->inj_gen_ns, now_ns() - ts,
+				  memory_order_relaxed);
+	if (res < 0)
+		atomic_fetch_add_explicit(&wrk->inj_dropped, 1,
+					  memory_order_relaxed);
+	else
+		atomic_fetch_add_explicit(&wrk->inj_parts, res,
+					  memory_order_relaxed);
+}
+
+static void worker_ctl_process(struct mdm_worker *wrk)
+{
+	struct ctl_msg msg;
+	uint64_t val;
+	unsigned i;
+
+	/* Reset the doorbell before the queue draining to not miss a kick */
+	if (read(wrk->evfd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		perror("read(eventfd)");
+
+	while (!spscq_pop(&wrk->ctlq, &msg)) {
+		switch (msg.op) {
+		case CTL_TEST_SMS:
+			for (i = 0; i < wrk->ninsts; ++i) {
+				if (trace_recording())
+					trace_data(wrk->insts[i].id,
+						   TRACE_TEST_SMS, NULL, 0);
+				modem_add_test_sms(wrk->insts[i].mdm);
+			}
+			break;
+		case CTL_STATS_DUMP:
+			worker_stats_dump(wrk);
+			break;
+		case CTL_ADD_SMS:
+			worker_add_sms(wrk, msg.inst, msg.text);
+			break;
+		case CTL_REQ:
+			worker_req_process(wrk, &msg);
+			break;
+		}
+	}
+}
+
+/* Publish the nearest timer moment and let the main thread move the clock */
+static void worker_idle(struct mdm_worker *wrk)
+{
+	uint64_t val = 1;
+
+	atomic_store_explicit(&wrk->next, timer_wheel_next(&wrk->timers),
+			      memory_order_relaxed);
+	atomic_store_explicit(&wrk->idle, 1, memory_order_release);
+	if (write(state->idlefd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		perror("write(eventfd)");
+}
+
+static void *worker_run(void *arg)
+{
+	int asap = vclock_get_mode() == VCLOCK_ASAP;
+	struct mdm_worker *wrk = arg;
+	struct epoll_event events[64];
+	uint64_t val = 1;
+	int i, nev, timeout;
+
+	/**
+	 * Listening ports start without a client. Record it from the owning
+	 * thread to keep the port records order in the trace.
+	 */
+	for (i = 0; i < wrk->ninsts && trace_recording(); ++i)
+		if (wrk->insts[i].lfd >= 0)
+			trace_data(wrk->insts[i].id, TRACE_DISCONNECT, NULL, 0);
+
+	while (!atomic_load_explicit(&wrk->stop, memory_order_relaxed)) {
+		/* NB: the next moment could be in the past if it was missed */
+		timeout = vclock_timeout(timer_wheel_next(&wrk->timers));
+		if (asap && timeout < 0)
+			worker_idle(wrk);
+		nev = epoll_wait(wrk->epfd, events, ARRAY_SIZE(events),
+				 timeout);
+		if (nev < 0) {
+			if (errno != EINTR)
+				perror("epoll_wait()");
+			nev = 0;
+		}
+		if (asap)
+			atomic_store_explicit(&wrk->idle, 0,
+					      memory_order_relaxed);
+
+		for (i = 0; i < nev; ++i) {
+			struct mdm_inst *inst = events[i].data.ptr;
+
+			if (!inst) {
+				worker_ctl_process(wrk);
+				continue;
+			}
+			if (inst->fd < 0) {
+				wrk->res = inst_accept(inst);
+				if (wrk->res)
+					goto exit;
+				continue;
+			}
+			/* Socket client failures affect the client only */
+			if (inst->lfd >= 0 &&
+			    (events[i].events & (EPOLLHUP | EPOLLERR) ||
+			     (events[i].events & EPOLLOUT && inst_tx(inst)))) {
+				wrk->res = inst_disconnect(inst);
+				if (wrk->res)
+					goto exit;
+				continue;
+			}
+			if (events[i].events & EPOLLOUT && inst_tx(inst)) {
+				wrk->res = -EIO;
+				goto exit;
+			}
+			if (!(events[i].events & EPOLLIN))
+				continue;
+			wrk->res = inst_rx(inst);
+			if (wrk->res)
+				goto exit;
+		}
+
+		/* Run the timers even if we are busy with I/O */
+		timer_wheel_run(&wrk->timers, vclock_now_ms());
+	}
+
+	return NULL;
+
+exit:
+	/* Stop the whole emulation */
+	if (write(state->evfd, &val, sizeof(val)) < 0)
+		perror("write(eventfd)");
+
+	return NULL;
+}
+
+static int worker_init(struct mdm_worker *wrk, unsigned id,
+		       struct mdm_inst *insts, unsigned ninsts,
+		       const char *ltmpl, unsigned msgs_num)
+{
+	struct epoll_event ev;
+	unsigned i;
+
+	wrk->id = id;
+	wrk->insts = insts;
+	wrk->evfd = -1;
+	timer_wheel_init(&wrk->timers, vclock_now_ms());
+
+	wrk->epfd = epoll_create1(0);
+	if (wrk->epfd < 0) {
+		perror("epoll_create1()");
+		return -errno;
+	}
+
+	wrk->evfd = eventfd(0, EFD_NONBLOCK);
+	if (wrk->evfd < 0) {
+		perror("eventfd()");
+		return -errno;
+	}
+
+	memset(&ev, 0x00, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;	/* Distinguish the doorbell from modems */
+	if (epoll_ctl(wrk->epfd, EPOLL_CTL_ADD, wrk->evfd, &ev)) {
+		perror("epoll_ctl()");
+		return -errno;
+	}
+
+	if (spscq_init(&wrk->ctlq, CTLQ_SIZE, sizeof(struct ctl_msg)) ||
+	    spscq_init(&wrk->doneq, CTLQ_SIZE, sizeof(struct ctl_req *))) {
+		fprintf(stderr, "unable to allocate control queue\n");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < ninsts; ++i) {
+		if (inst_init(&insts[i], wrk, insts[i].id, ltmpl, msgs_num))
+			return -EIO;
+		wrk->ninsts++;
+	}
+
+	return 0;
+}
+
+static void worker_fini(struct mdm_worker *wrk)
+{
+	unsigned i;
+
+	for (i = 0; i < wrk->ninsts; ++i)
+		inst_fini(&wrk->insts[i]);
+	spscq_fini(&wrk->ctlq);
+	spscq_fini(&wrk->doneq);
+	if (wrk->evfd >= 0)
+		close(wrk->evfd);
+	if (wrk->epfd >= 0)
+		close(wrk->epfd);
+}
+
+/**
+ * Inject messages that are due since the injection start, distributing them
+ * over the fleet in a round robin manner. Messages are generated by the
+ * owning workers.
+ */
+static void smsinj_run(struct timer *t, void *priv)
+{
+	struct ctl_msg msg = {.op = CTL_ADD_SMS};
+	unsigned long due;
+	unsigned i;
+
+	timer_add(&state->timers, t, t->expires + SMSINJ_PERIOD_MS);
+
+	due = (vclock_now_ms() - state->inj.start) / 1e3 * state->inj.rate;
+	if (due <= state->inj.msgs)
+		return;
+
+	for (; state->inj.msgs < due; state->inj.msgs++) {
+		msg.inst = &state->insts[state->inj.next];
+		msg.text = smsinj_texts[state->inj.msgs %
+					ARRAY_SIZE(smsinj_texts)];
+		if (spscq_push(&msg.inst->wrk->ctlq, &msg))
+			state->inj.dropped++;
+		state->inj.next = (state->inj.next + 1) % state->ninsts;
+	}
+
+	for (i = 0; i < state->nwrks; ++i)
+		worker_kick(&state->wrks[i]);
+}
+
+static void smsinj_report(FILE *fp)
+{
+	double secs = (vclock_now_ms() - state->inj.start) / 1e3;
+	unsigned long parts = 0, dropped = state->inj.dropped;
+	unsigned long long gen_ns = 0;
+	struct mdm_worker *wrk;
+	unsigned i;
+
+	for (i = 0; i < state->nwrks; ++i) {
+		wrk = &state->wrks[i];
+		parts += atomic_load_explicit(&wrk->inj_parts,
+					      memory_order_relaxed);
+		dropped += atomic_load_explicit(&wrk->inj_dropped,
+						memory_order_relaxed);
+		gen_ns += atomic_load_explicit(&wrk->inj_gen_ns,
+					       memory_order_relaxed);
+	}
+
+	fprintf(fp, "{\"smsinj\":{\"msgs\":%lu,\"parts\":%lu,\"dropped\":%lu,"
+		"\"msgs_per_sec\":%.1f,\"gen_ns_per_msg\":%.1f,"
+		"\"gen_msgs_per_sec\":%.1f}}\n", state->inj.msgs, parts,
+		dropped, secs > 0 ? state->inj.msgs / secs : 0,
+		state->inj.msgs ? (double)gen_ns / state->inj.msgs : 0,
+		gen_ns ? state->inj.msgs * 1e9 / gen_ns : 0);
+	fflush(fp);
+}
+
+/**
+ * In the as fast as possible clock mode, once all the event loops are idle,
+ * move the clock straight to the nearest timer moment over all of them and
+ * wake up the workers, which timers become expired.
+ */
+static void asap_advance(void)
+{
+	uint64_t next = timer_wheel_next(&state->timers), n;
+	struct mdm_worker *wrk;
+	unsigned i;
+
+	for (i = 0; i < state->nwrks; ++i) {
+		wrk = &state->wrks[i];
+		if (!atomic_load_explicit(&wrk->idle, memory_order_acquire))
+			return;
+		n = atomic_load_explicit(&wrk->next, memory_order_relaxed);
+		if (n < next)
+			next = n;
+	}
+	if (next == TIMER_NEVER || next <= vclock_now_ms())
+		return;
+
+	vclock_advance(next);
+
+	for (i = 0; i < state->nwrks; ++i) {
+		wrk = &state->wrks[i];
+		if (atomic_load_explicit(&wrk->next, memory_order_relaxed) >
+		    next)
+			continue;
+		worker_kick(wrk);
+	}
+}
+
+/**
+ * Returns the shared copy of the string. Modems keep referencing the network
+ * strings after the request finish, so the copies live till the exit, but
+ * only one per distinct string.
+ */
+static const char *ctl_str_intern(const char *str)
+{
+	struct ctl_str *s;
+
+	for (s = state->strs; s; s = s->next)
+		if (strcmp(s->str, str) == 0)
+			return s->str;
+
+	s = malloc(sizeof(*s) + strlen(str) + 1);
+	if (!s)
+		return NULL;
+	strcpy(s->str, str);
+	s->next = state->strs;
+	state->strs = s;
+
+	return s->str;
+}
+
+static int ctl_req_intern(struct ctl_req *req)
+{
+	const char *str = NULL, *str2 = NULL;
+
+	if (req->op.str && !(str = ctl_str_intern(req->op.str)))
+		return -ENOMEM;
+	if (req->op.str2 && !(str2 = ctl_str_intern(req->op.str2)))
+		return -ENOMEM;
+
+	scenario_op_fini(&req->op);
+	req->op.str = str;
+	req->op.str2 = str2;
+	req->interned = 1;
+
+	return 0;
+}
+
+static void ctl_req_free(struct ctl_req *req)
+{
+	if (!req->interned)
+		scenario_op_fini(&req->op);
+	if (req->out)
+		fclose(req->out);
+	free(req->buf);
+	free(req->text);
+	free(req);
+}
+
+static void ctl_req_finish(struct ctl_req *req)
+{
+	if (req->out) {
+		fclose(req->out);
+		req->out = NULL;
+		ctlconn_write(req->conn, req->buf, req->len);
+	}
+
+	if (req->dropped)
+		ctlconn_done(req->conn, "control queue overflow");
+	else if (!req->modems)
+		ctlconn_done(req->conn, "no such modem");
+	else
+		ctlconn_done(req->conn, NULL);
+
+	ctl_req_free(req);
+}
+
+/* Pass the ranges to the owning workers, one message per worker range */
+static void ctl_req_dispatch(struct ctl_req *req,
+			     const struct scn_range *ranges, unsigned nranges)
+{
+	struct ctl_msg msg = {.op = CTL_REQ, .req = req};
+	struct mdm_worker *wrk;
+	unsigned i, j, first, last;
+
+	atomic_init(&req->refs, 1);	/* Hold the request while dispatching */
+
+	for (i = 0; i < nranges; ++i) {
+		for (j = 0; j < state->nwrks; ++j) {
+			wrk = &state->wrks[j];
+			first = wrk->insts - state->insts;
+			last = first + wrk->ninsts - 1;
+			msg.first = ranges[i].first > first ? ranges[i].first :
+							       first;
+			msg.last = ranges[i].last < last ? ranges[i].last :
+							     last;
+			if (msg.first > msg.last)
+				continue;
+			atomic_fetch_add(&req->refs, 1);
+			if (spscq_push(&wrk->ctlq, &msg)) {
+				atomic_fetch_sub(&req->refs, 1);
+				req->dropped++;
+				continue;
+			}
+			req->modems += msg.last - msg.first + 1;
+			worker_kick(wrk);
+		}
+	}
+
+	ctl_req_put(req, NULL);
+}
+
+/* Switch the trace level of the whole emulator */
+static void ctl_trace(struct ctlconn *conn, const char *str)
+{
+	int level = trace_parse_level(str), err;
+
+	if (level < 0) {
+		ctlconn_done(conn, "invalid trace level");
+		return;
+	}
+
+	err = trace_set_level(level);
+	if (err == -ENOENT)
+		ctlconn_done(conn, "no trace file");
+	else if (err)
+		ctlconn_done(conn, "recording could not be started at runtime");
+	else
+		ctlconn_done(conn, NULL);
+}
+
+/**
+ * Control socket request: "<command> <ids> [<args>...]", where ids are
+ * modem numbers and ranges (e.g. 0-99,120) or "*". Commands are the scenario
+ * operations (rssi, ramp, jitter, reg, plmn, sms) with the same arguments,
+ * "testsms" and "stats". The "trace <level>" request changes the trace
+ * level (off, hdr or full) of the whole emulator.
+ */
+static void ctl_request(struct ctlconn *conn, char *line, void *priv)
+{
+	struct scn_range *ranges = NULL;
+	char *tok[SCN_TOKENS_MAX], *args;
+	size_t cmdlen = strcspn(line, " \t");
+	unsigned nranges = 0;
+	struct ctl_req *req;
+	int ntok;
+
+	req = calloc(1, sizeof(*req));
+	if (!req) {
+		ctlconn_done(conn, "out of memory");
+		return;
+	}
+	req->conn = conn;
+
+	/* Keep the operation text (command and arguments) for recording */
+	args = line + cmdlen;
+	args += strspn(args, " \t");
+	args += strcspn(args, " \t");
+	req->text = malloc(cmdlen + strlen(args) + 1);
+	if (!req->text) {
+		ctlconn_done(conn, "out of memory");
+		goto exit_free;
+	}
+	sprintf(req->text, "%.*s%s", (int)cmdlen, line, args);
+
+	ntok = scenario_tokenize(line, tok);
+	if (ntok < 2) {
+		ctlconn_done(conn, "invalid request");
+		goto exit_free;
+	}
+	if (strcmp(tok[0], "trace") == 0 && ntok == 2) {
+		ctl_trace(conn, tok[1]);
+		goto exit_free;
+	}
+	if (scenario_parse_ids(tok[1], &ranges, &nranges)) {
+		ctlconn_done(conn, "invalid modems list");
+		goto exit_free;
+	}
+
+	if (strcmp(tok[0], "stats") == 0 && ntok == 2) {
+		req->type = CTL_REQ_STATS;
+		req->out = open_memstream(&req->buf, &req->len);
+		if (!req->out) {
+			ctlconn_done(conn, "out of memory");
+			goto exit_free;
+		}
+	} else if (strcmp(tok[0], "testsms") == 0 && ntok == 2) {
+		req->type = CTL_REQ_TEST_SMS;
+	} else {
+		req->type = CTL_REQ_OP;
+		tok[1] = tok[0];
+		if (scenario_op_parse(&req->op, tok + 1, ntok - 1)) {
+			ctlconn_done(conn, "invalid operation");
+			goto exit_free;
+		}
+		if (req->op.type == SCN_OP_PLMN && ctl_req_intern(req)) {
+			ctlconn_done(conn, "out of memory");
+			goto exit_free;
+		}
+	}
+
+	ctl_req_dispatch(req, ranges, nranges);
+	free(ranges);
+
+	return;
+
+exit_free:
+	free(ranges);
+	ctl_req_free(req);
+}
+
+static void ctl_done_process(void)
+{
+	struct ctl_req *req;
+	uint64_t val;
+	unsigned i;
+
+	if (read(state->donefd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		perror("read(eventfd)");
+
+	for (i = 0; i < state->nwrks; ++i)
+		while (!spscq_pop(&state->wrks[i].doneq, &req))
+			ctl_req_finish(req);
+}
+
+/* Switch the trace to the next level: off, hdr, full and off again */
+static void trace_level_next(void)
+{
+	int level = atomic_load(&trace_level);
+
+	level = level >= TRACE_FULL ? TRACE_OFF : level + 1;
+	if (trace_set_level(level))
+		fprintf(stderr, "no trace file, the level is not changed\n");
+}
+
+/* Returns non-zero if the emulation should be stopped */
+static int sig_process(void)
+{
+	struct signalfd_siginfo si;
+	unsigned i;
+
+	while (read(state->sigfd, &si, sizeof(si)) == sizeof(si)) {
+		switch (si.ssi_signo) {
+		case SIGUSR1:
+			for (i = 0; i < state->nwrks; ++i)
+				worker_ctl(&state->wrks[i], CTL_TEST_SMS);
+			break;
+		case SIGUSR2:
+			for (i = 0; i < state->nwrks; ++i)
+				worker_ctl(&state->wrks[i], CTL_STATS_DUMP);
+			if (state->inj.rate)
+				smsinj_report(stdout);
+			break;
+		case SIGHUP:
+			trace_level_next();
+			break;
+		default:	/* Terminate gracefully to flush the trace */
+			return 1;
+		}
+	}
+
+	return 0;
 }
 
 static void usage(const char *name)
@@ -137,13 +1411,66 @@ static void usage(const char *name)
 		"\n"
 		"Usage:\n"
 		"  %s -h\n"
-		"  %s -l <filename>\n"
+		"  %s [-n <count>] [-j <threads>] [-l <filename>] [-m <count>]\n"
+		"        [-s <rate>] [-T <filename> [-t <level>]] [-x <speed>]\n"
+		"        [-e <time>] [-S <seed>] [-c <filename>] [-P <filename>]\n"
+		"        [-b <baud>] [-L <ms>[,<ms>]] [-d <command>=<ms>]...\n"
+		"        [-C <path>] [-a <address>]\n"
 		"\n"
 		"Options:\n"
+		"  -a <address> Serve modems on listening sockets instead of pseudo\n"
+		"            terminals, one client per modem at a time, each client\n"
+		"            gets a fresh AT port. Address formats:\n"
+		"              tcp:[<host>:]<port>     raw TCP, modem N listens on\n"
+		"                                      the port + N (default host:\n"
+		"                                      127.0.0.1)\n"
+		"              telnet:[<host>:]<port>  TCP with telnet negotiation\n"
+		"                                      filtering\n"
+		"              unix:<path>   UNIX stream socket, the path is a\n"
+		"                            template like the -l one\n"
+		"  -b <baud> Emulate the serial line rate of modems output (8N1)\n"
+		"  -C <path> Serve the control socket, which allows to apply scenario\n"
+		"            operations, add test SMS and dump statistics for modems\n"
+		"            ranges or change the trace level at runtime (see\n"
+		"            ctl_request() for the protocol)\n"
+		"  -c <filename> Load the network scenario, which scripts signal level,\n"
+		"            registration, network and SMS arrival timelines of modems\n"
+		"            groups (see scenario.c for the format)\n"
+		"  -d <command>=<ms> Delay the command response by the specified\n"
+		"            processing time (e.g. +COPS=2000), could be repeated\n"
+		"  -e <time> Emulator wall clock start time, seconds since the Epoch\n"
+		"            (default: current time)\n"
 		"  -h        Print this message\n"
+		"  -j <threads> Number of event loop threads, modems are evenly split\n"
+		"            between them (default: 1)\n"
+		"  -L <ms>[,<ms>] Output latency and optional random jitter limit\n"
 		"  -l <filename> Create a symbolic link that points to the actual pseudo\n"
-		"            terminal device\n"
-		"\n", name, name
+		"            terminal device. In the fleet mode the name is used as a\n"
+		"            template, where the first \"%%u\" is replaced with the modem\n"
+		"            number (e.g. /tmp/modem%%u)\n"
+		"  -m <count> SMS storage capacity of each modem (default: %u)\n"
+		"  -n <count> Number of emulated modems (default: 1)\n"
+		"  -P <filename> Load modems identities (ICCID, IMSI, IMEI, home\n"
+		"            network, etc.) from the profiles database, use the\n"
+		"            mdmprofgen utility to create it\n"
+		"  -S <seed> Modems pseudo random generators seed, the same seed gives\n"
+		"            the same emulation (default: 0)\n"
+		"  -s <rate> Inject generated SMS at the specified rate (messages per\n"
+		"            second over the whole fleet)\n"
+		"  -T <filename> Write the binary exchange trace to the file, use the\n"
+		"            mdmtrace utility to decode it\n"
+		"  -t <level> Trace level: off, hdr (headers only), full (default) or\n"
+		"            rec (lossless session recording for mdmreplay)\n"
+		"  -x <speed> Run the emulator clock (modems ticks, timers, SMS\n"
+		"            timestamps) the specified times faster than the real one,\n"
+		"            or as fast as possible if \"max\" is specified\n"
+		"\n"
+		"Signals:\n"
+		"  SIGUSR1   Add a test SMS to each modem\n"
+		"  SIGUSR2   Dump per modem statistics as JSON lines to stdout\n"
+		"  SIGHUP    Switch the trace to the next level: off, hdr, full and\n"
+		"            off again\n"
+		"\n", name, name, MODEM_MSGS_NUM_DEF
 	);
 }
 
@@ -151,114 +1478,356 @@ int main(int argc, char *argv[])
 {
 	const char *name = basename(argv[0]);
 	const char *slinkname = NULL;
-	struct timespec nexttime;
-	struct sigaction sigact;
-	int opt;
+	const char *tracename = NULL;
+	const char *scnname = NULL;
+	const char *profname = NULL;
+	const char *ctlname = NULL;
+	int tracelevel = TRACE_FULL;
+	struct epoll_event events[8];
+	struct mdm_worker *wrk;
+	unsigned i, ninsts = 1, nwrks = 1, msgs_num = MODEM_MSGS_NUM_DEF;
+	double speed = 1;
+	time_t epoch = 0;
+	uint64_t start;
+	sigset_t sigs;
+	int opt, ret = EXIT_FAILURE;
 
 	while (1) {
-		opt = getopt(argc, argv, "+hl:");
+		opt = getopt(argc, argv, "+a:b:C:c:d:e:hj:L:l:m:n:P:S:s:t:T:x:");
 		if (opt == -1)
 			break;
 		switch (opt) {
+		case 'a':
+			if (lsn_parse(optarg, &state->lsn)) {
+				fprintf(stderr, "invalid listening address\n");
+				return EXIT_FAILURE;
+			}
+			state->listen = 1;
+			break;
+		case 'b':
+			state->shape.rate = strtoul(optarg, NULL, 0) / 10;
+			if (state->shape.rate == 0) {
+				fprintf(stderr, "invalid line rate\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'C':
+			ctlname = optarg;
+			break;
+		case 'c':
+			scnname = optarg;
+			break;
+		case 'd':
+			if (shaper_cfg_add_delay(&state->shape, optarg)) {
+				fprintf(stderr, "invalid command delay\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'e':
+			epoch = strtoll(optarg, NULL, 0);
+			break;
 		case 'h':
 			usage(name);
 			return EXIT_SUCCESS;
+		case 'j':
+			nwrks = strtoul(optarg, NULL, 0);
+			if (nwrks == 0) {
+				fprintf(stderr, "invalid number of threads\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'L':
+			if (sscanf(optarg, "%u,%u", &state->shape.latency,
+				   &state->shape.jitter) < 1) {
+				fprintf(stderr, "invalid output latency\n");
+				return EXIT_FAILURE;
+			}
+			break;
 		case 'l':
 			slinkname = optarg;
 			break;
+		case 'm':
+			msgs_num = strtoul(optarg, NULL, 0);
+			if (msgs_num == 0) {
+				fprintf(stderr, "invalid SMS storage capacity\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'n':
+			ninsts = strtoul(optarg, NULL, 0);
+			if (ninsts == 0) {
+				fprintf(stderr, "invalid number of modems\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'P':
+			profname = optarg;
+			break;
+		case 'S':
+			state->seed = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			state->inj.rate = strtod(optarg, NULL);
+			if (state->inj.rate < 0) {
+				fprintf(stderr, "invalid SMS injection rate\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 't':
+			tracelevel = trace_parse_level(optarg);
+			if (tracelevel < 0) {
+				fprintf(stderr, "invalid trace level\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'T':
+			tracename = optarg;
+			break;
+		case 'x':
+			if (vclock_parse_speed(optarg, &speed)) {
+				fprintf(stderr, "invalid clock speed\n");
+				return EXIT_FAILURE;
+			}
+			break;
 		default:
 			return EXIT_FAILURE;
 		}
 	}
 
-	srandom(time(NULL));
+	if (nwrks > ninsts)
+		nwrks = ninsts;
+	state->shaped = shaper_cfg_enabled(&state->shape);
 
-	state->pty_fd = open_pty(slinkname);
-	if (state->pty_fd < 0)
-		return EXIT_FAILURE;
+	/**
+	 * Signals are blocked in all threads (workers inherit the mask) and
+	 * are handled synchronously by the main thread only.
+	 */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGUSR1);
+	sigaddset(&sigs, SIGUSR2);
+	sigaddset(&sigs, SIGHUP);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+	/* Socket peers could go away at any moment, handle it as EPIPE */
+	signal(SIGPIPE, SIG_IGN);
 
-	state->mdm = modem_alloc();
-	if (!state->mdm)
-		return EXIT_FAILURE;
+	if (scnname) {
+		state->scn = scenario_load(scnname);
+		if (!state->scn)
+			return EXIT_FAILURE;
+	}
 
-	state->atport = atport_alloc(&atops, state, modem_atcommands,
-				     state->mdm);
-	if (!state->atport) {
-		close(state->pty_fd);
-		return EXIT_FAILURE;
+	if (profname) {
+		state->profs = profile_open(profname);
+		if (!state->profs)
+			goto exit_free_scenario;
+		if (profile_count(state->profs) < ninsts) {
+			fprintf(stderr, "%s contains only %lu profiles\n",
+				profname, profile_count(state->profs));
+			goto exit_close_profiles;
+		}
 	}
-	modem_set_atport(state->mdm, state->atport);
 
-	clock_gettime(CLOCK_MONOTONIC, &nexttime);
+	if (tracename && trace_init(tracename, tracelevel))
+		goto exit_close_profiles;
 
-	memset(&sigact, 0x00, sizeof(sigact));
-	sigact.sa_handler = sig_usr1;
-	sigaction(SIGUSR1, &sigact, NULL);
+	raise_nofile_limit(ninsts);
 
-	while (1) {
-		struct timeval timeout;
-		struct timespec now;
-		char buf[0x100];
-		fd_set rfds;
-		int res;
+	vclock_init(speed, (uint64_t)epoch * 1000);
+	timer_wheel_init(&state->timers, vclock_now_ms());
 
-		/**
-		 * To maintain stable frequency by price of phase instabillity,
-		 * each time calculate a new time interval to target tick
-		 * moment. And just move the target time each time when "timer"
-		 * fired.
-		 *
-		 * NB: interval could be negative in case of missed momment.
-		 */
-		clock_gettime(CLOCK_MONOTONIC, &now);
-		timeout.tv_sec = nexttime.tv_sec - now.tv_sec;
-		timeout.tv_usec = (nexttime.tv_nsec - now.tv_nsec + 500) / 1000;
-		if (timeout.tv_usec < 0) {
-			timeout.tv_sec -= 1;
-			timeout.tv_usec += 1000 * 1000;
-		}
-		if (timeout.tv_sec < 0)
-			memset(&timeout, 0x00, sizeof(timeout));
-
-		FD_ZERO(&rfds);
-		FD_SET(state->pty_fd, &rfds);
-		res = select(state->pty_fd + 1, &rfds, NULL, NULL, &timeout);
-		if (res < 0 && errno != EINTR) {
-			perror("select()");
-			continue;
+	state->epfd = epoll_create1(0);
+	state->sigfd = signalfd(-1, &sigs, SFD_NONBLOCK);
+	state->evfd = eventfd(0, EFD_NONBLOCK);
+	state->idlefd = eventfd(0, EFD_NONBLOCK);
+	state->donefd = eventfd(0, EFD_NONBLOCK);
+	if (state->epfd < 0 || state->sigfd < 0 || state->evfd < 0 ||
+	    state->idlefd < 0 || state->donefd < 0) {
+		perror("epoll_create1()/signalfd()/eventfd()");
+		goto exit_close_fds;
+	}
+
+	memset(events, 0x00, sizeof(events));
+	events[0].events = EPOLLIN;
+	events[0].data.fd = state->sigfd;
+	events[1].events = EPOLLIN;
+	events[1].data.fd = state->evfd;
+	events[2].events = EPOLLIN;
+	events[2].data.fd = state->idlefd;
+	events[3].events = EPOLLIN;
+	events[3].data.fd = state->donefd;
+	if (epoll_ctl(state->epfd, EPOLL_CTL_ADD, state->sigfd, &events[0]) ||
+	    epoll_ctl(state->epfd, EPOLL_CTL_ADD, state->evfd, &events[1]) ||
+	    epoll_ctl(state->epfd, EPOLL_CTL_ADD, state->idlefd, &events[2]) ||
+	    epoll_ctl(state->epfd, EPOLL_CTL_ADD, state->donefd, &events[3])) {
+		perror("epoll_ctl()");
+		goto exit_close_fds;
+	}
+
+	if (ctlname) {
+		state->ctl = ctlsock_open(ctlname, ctl_request, NULL);
+		if (!state->ctl)
+			goto exit_close_fds;
+		events[4].events = EPOLLIN;
+		events[4].data.fd = ctlsock_fd(state->ctl);
+		if (epoll_ctl(state->epfd, EPOLL_CTL_ADD, events[4].data.fd,
+			      &events[4])) {
+			perror("epoll_ctl()");
+			goto exit_close_fds;
 		}
+	}
 
-		if (state->sig_usr1) {
-			state->sig_usr1 = 0;
-			modem_add_test_sms(state->mdm);
-			continue;
+	state->insts = calloc(ninsts, sizeof(*state->insts));
+	state->wrks = calloc(nwrks, sizeof(*state->wrks));
+	if (!state->insts || !state->wrks) {
+		fprintf(stderr, "unable to allocate modems state\n");
+		goto exit_free_state;
+	}
+	state->ninsts = ninsts;
+	state->nwrks = nwrks;
+	for (i = 0; i < ninsts; ++i) {
+		state->insts[i].id = i;
+		state->insts[i].fd = -1;
+		state->insts[i].lfd = -1;
+	}
+	for (i = 0; i < nwrks; ++i) {
+		state->wrks[i].epfd = -1;
+		state->wrks[i].evfd = -1;
+	}
+
+	/* Give each worker a contiguous shard of the fleet */
+	for (i = 0; i < nwrks; ++i) {
+		unsigned first = (uint64_t)ninsts * i / nwrks;
+		unsigned last = (uint64_t)ninsts * (i + 1) / nwrks;
+
+		if (worker_init(&state->wrks[i], i, &state->insts[first],
+				last - first, slinkname, msgs_num))
+			goto exit_fini_workers;
+	}
+
+	/* Spread the modems ticks over the period to avoid load bursts */
+	start = vclock_now_ms();
+	for (i = 0; i < ninsts; ++i)
+		timer_add(&state->insts[i].wrk->timers, &state->insts[i].tick,
+			  start + (uint64_t)i * TICK_PERIOD_MS / ninsts);
+
+	state->inj.start = vclock_now_ms();
+	if (state->inj.rate) {
+		timer_init(&state->inj.timer, smsinj_run, NULL);
+		timer_add(&state->timers, &state->inj.timer,
+			  state->timers.now + SMSINJ_PERIOD_MS);
+	}
+
+	for (i = 0; i < nwrks; ++i) {
+		wrk = &state->wrks[i];
+		if (pthread_create(&wrk->thread, NULL, worker_run, wrk)) {
+			fprintf(stderr, "unable to start worker thread\n");
+			goto exit_stop_workers;
 		}
+		wrk->started = 1;
+	}
 
-		if (res == 0) {	/* Timeout (tick time) */
-			modem_tick(state->mdm);
-			nexttime.tv_sec += 1;	/* Move next target moment */
-			continue;
+	while (1) {
+		int nev;
+
+		nev = epoll_wait(state->epfd, events, ARRAY_SIZE(events),
+				 vclock_timeout(timer_wheel_next(&state->timers)));
+		if (nev < 0) {
+			if (errno != EINTR)
+				perror("epoll_wait()");
+			nev = 0;
 		}
 
-		if (!FD_ISSET(state->pty_fd, &rfds))
-			continue;
+		for (i = 0; i < nev; ++i) {
+			uint64_t val;
 
-		res = read(state->pty_fd, buf, sizeof(buf));
-		if (res < 0) {
-			if (errno == EINTR)
+			if (events[i].data.fd == state->evfd)
+				goto exit_stop_workers;	/* Worker stopped */
+			if (events[i].data.fd == state->idlefd) {
+				if (read(state->idlefd, &val, sizeof(val)) < 0)
+					perror("read(eventfd)");
 				continue;
-			perror("read()");
-			return EXIT_FAILURE;
+			}
+			if (events[i].data.fd == state->donefd) {
+				ctl_done_process();
+				continue;
+			}
+			if (state->ctl &&
+			    events[i].data.fd == ctlsock_fd(state->ctl)) {
+				ctlsock_process(state->ctl);
+				continue;
+			}
+			if (sig_process())
+				goto exit_stop_workers;
 		}
 
-		dump_exchange("Rx", buf, res);
-		if (atport_parse(state->atport, buf, res) < 0)
-			break;
+		timer_wheel_run(&state->timers, vclock_now_ms());
+		if (vclock_get_mode() == VCLOCK_ASAP)
+			asap_advance();
 	}
 
-	modem_free(state->mdm);
-	atport_free(state->atport);
-	close(state->pty_fd);
+exit_stop_workers:
+	ret = EXIT_SUCCESS;
+	for (i = 0; i < nwrks; ++i) {
+		wrk = &state->wrks[i];
+		if (!wrk->started) {
+			ret = EXIT_FAILURE;
+			continue;
+		}
+		atomic_store(&wrk->stop, 1);
+		worker_kick(wrk);
+		pthread_join(wrk->thread, NULL);
+		if (wrk->res < 0)
+			ret = EXIT_FAILURE;
+	}
+	/* Finish the control requests, which are still in flight */
+	for (i = 0; i < nwrks; ++i) {
+		struct ctl_msg msg;
+
+		while (!spscq_pop(&state->wrks[i].ctlq, &msg))
+			if (msg.op == CTL_REQ)
+				ctl_req_put(msg.req, NULL);
+		while (state->wrks[i].spilled) {
+			struct ctl_req *req = state->wrks[i].spilled;
+
+			state->wrks[i].spilled = req->next;
+			ctl_req_finish(req);
+		}
+	}
+	ctl_done_process();
+	if (state->inj.rate)
+		smsinj_report(stderr);
+exit_fini_workers:
+	for (i = 0; i < nwrks; ++i)
+		worker_fini(&state->wrks[i]);
+exit_free_state:
+	free(state->wrks);
+	free(state->insts);
+exit_close_fds:
+	ctlsock_close(state->ctl);
+	while (state->strs) {
+		struct ctl_str *s = state->strs;
+
+		state->strs = s->next;
+		free(s);
+	}
+	if (state->donefd >= 0)
+		close(state->donefd);
+	if (state->idlefd >= 0)
+		close(state->idlefd);
+	if (state->evfd >= 0)
+		close(state->evfd);
+	if (state->sigfd >= 0)
+		close(state->sigfd);
+	if (state->epfd >= 0)
+		close(state->epfd);
+	trace_fini();
+exit_close_profiles:
+	profile_close(state->profs);
+exit_free_scenario:
+	scenario_free(state->scn);
+	free(state->shape.delays);
 
-	return EXIT_SUCCESS;
+	return ret;
 }
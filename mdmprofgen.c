@@ -0,0 +1,176 @@
+/**
+ * Modem profiles database generator
+ *
+ * Creates a database of distinct, but valid looking (proper lengths and
+ * check digits), modem identities for the emulator fleet.
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "profile.h"
+
+#define IMEI_TAC		"86719103"	/* Huawei E3372 */
+
+/* Append the Luhn check digit to the digits string */
+static void luhn_append(char *str)
+{
+	size_t i, len = strlen(str);
+	unsigned d, sum = 0;
+
+	for (i = 0; i < len; ++i) {
+		d = str[len - 1 - i] - '0';
+		if (i % 2 == 0) {
+			d *= 2;
+			if (d > 9)
+				d -= 9;
+		}
+		sum += d;
+	}
+	str[len] = '0' + (10 - sum % 10) % 10;
+	str[len + 1] = '\0';
+}
+
+static void profile_gen(struct profile_rec *rec, uint64_t serial,
+			const char *plmn, const char *oper, int rssi)
+{
+	int i, msin_len = sizeof(rec->imsi) - 1 - strlen(plmn);
+	uint64_t msin_mod = 1;
+
+	for (i = 0; i < msin_len; ++i)
+		msin_mod *= 10;
+
+	memset(rec, 0x00, sizeof(*rec));
+
+	snprintf(rec->iccid, sizeof(rec->iccid), "8970%.2s%012llu", plmn + 3,
+		 (unsigned long long)(serial % 1000000000000ULL));
+	luhn_append(rec->iccid);
+	snprintf(rec->imsi, sizeof(rec->imsi), "%s%0*llu", plmn, msin_len,
+		 (unsigned long long)(serial % msin_mod));
+	snprintf(rec->imei, sizeof(rec->imei), IMEI_TAC "%06u",
+		 (unsigned)(serial % 1000000));
+	luhn_append(rec->imei);
+	strcpy(rec->plmn, plmn);
+	strncpy(rec->oper, oper, sizeof(rec->oper) - 1);
+	strcpy(rec->vendor, "huawei");
+	strcpy(rec->model, "E3372");
+	strcpy(rec->revision, "21.180.01.00.00");
+	rec->rssi = rssi;
+}
+
+static void usage(const char *name)
+{
+	printf(
+		"Modem profiles database generator\n"
+		"\n"
+		"Usage:\n"
+		"  %s -h\n"
+		"  %s [-n <count>] [-p <plmn>] [-o <name>] [-r <dBm>] [-b <serial>]\n"
+		"        <filename>\n"
+		"\n"
+		"Options:\n"
+		"  -b <serial> First identities serial number (default: 0)\n"
+		"  -h        Print this message\n"
+		"  -n <count> Number of profiles (default: 1)\n"
+		"  -o <name> Home network name (default: FunComm)\n"
+		"  -p <plmn> Home network MCC and MNC (default: 25069)\n"
+		"  -r <dBm>  Initial signal level (default: random)\n"
+		"  <filename> Database file name\n"
+		"\n", name, name
+	);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *name = basename(argv[0]);
+	const char *plmn = "25069", *oper = "FunComm";
+	struct profile_hdr hdr;
+	struct profile_rec rec;
+	unsigned long i, count = 1;
+	uint64_t base = 0;
+	int opt, rssi = 0;
+	FILE *fp;
+
+	while (1) {
+		opt = getopt(argc, argv, "+b:hn:o:p:r:");
+		if (opt == -1)
+			break;
+		switch (opt) {
+		case 'b':
+			base = strtoull(optarg, NULL, 0);
+			break;
+		case 'h':
+			usage(name);
+			return EXIT_SUCCESS;
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			oper = optarg;
+			break;
+		case 'p':
+			plmn = optarg;
+			if (strspn(plmn, "0123456789") != strlen(plmn) ||
+			    strlen(plmn) < 5 || strlen(plmn) > 6) {
+				fprintf(stderr, "invalid PLMN\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'r':
+			rssi = strtol(optarg, NULL, 0);
+			if (rssi < -113 || rssi > -51) {
+				fprintf(stderr, "invalid signal level\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(name);
+		return EXIT_FAILURE;
+	}
+
+	fp = fopen(argv[optind], "wb");
+	if (!fp) {
+		fprintf(stderr, "unable to open %s: %s\n", argv[optind],
+			strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	memset(&hdr, 0x00, sizeof(hdr));
+	memcpy(hdr.magic, PROFILE_MAGIC, sizeof(hdr.magic));
+	hdr.version = PROFILE_VERSION;
+	hdr.rec_size = sizeof(rec);
+	hdr.count = count;
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		goto err_write;
+
+	for (i = 0; i < count; ++i) {
+		profile_gen(&rec, base + i, plmn, oper, rssi);
+		if (fwrite(&rec, sizeof(rec), 1, fp) != 1)
+			goto err_write;
+	}
+
+	if (fclose(fp)) {
+		perror("fclose()");
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+
+err_write:
+	perror("fwrite()");
+	fclose(fp);
+
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,624 @@
+/**
+ * Recorded session replay and regression checker
+ *
+ * Feeds the recorded input and emulation events (ticks, SMS injections) of
+ * each port into an in-process modem instance and compares the produced
+ * output with the recorded one. The emulator clock follows the record
+ * timestamps, so a session recorded in the real time mode is reproduced
+ * exactly, provided the modems are configured in the same way (SMS storage
+ * capacity, seed, scenario and profiles).
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "atport.h"
+#include "cmux.h"
+#include "modem.h"
+#include "scenario.h"
+#include "profile.h"
+#include "trace.h"
+#include "vclock.h"
+
+#define NSEC_PER_SEC		1000000000ULL
+#define NSEC_PER_MSEC		1000000ULL
+
+#define DIVERGE_CTX_LEN		40	/* Divergence report context length */
+
+struct buf {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+struct rport {			/* Replayed port */
+	unsigned id;
+	struct modem_state *mdm;
+	struct atport *atport;
+	struct cmux *cmux;	/* Multiplexer, NULL in the AT mode */
+	struct buf exp;		/* Recorded, but not yet produced output */
+	struct buf got;		/* Produced, but not yet recorded output */
+	size_t off;		/* Matched output length */
+	int diverged;
+	int stopped;		/* Parser requested the emulation stop */
+};
+
+static struct {
+	unsigned msgs_num;
+	uint64_t seed;
+	struct scenario *scn;
+	struct profile_db *profs;
+	struct rport **ports;	/* Indexed by the port number */
+	unsigned nports;
+	struct scn_op *ops;	/* Control operations used by modems */
+	unsigned nops;
+	unsigned long recs;
+	unsigned long events;
+	unsigned long rx_bytes;
+	unsigned long tx_bytes;
+	unsigned ndiverged;
+} replay = {
+	.msgs_num = MODEM_MSGS_NUM_DEF,
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static int buf_append(struct buf *b, const char *data, size_t len)
+{
+	size_t size;
+	char *p;
+
+	if (b->len + len > b->size) {
+		size = b->size ? b->size : 0x100;
+		while (size < b->len + len)
+			size *= 2;
+		p = realloc(b->data, size);
+		if (!p)
+			return -ENOMEM;
+		b->data = p;
+		b->size = size;
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+
+	return 0;
+}
+
+static void buf_consume(struct buf *b, size_t len)
+{
+	memmove(b->data, b->data + len, b->len - len);
+	b->len -= len;
+}
+
+static int rport_write(const char *buf, size_t len, void *priv)
+{
+	struct rport *p = priv;
+
+	return buf_append(&p->got, buf, len);
+}
+
+static int rport_mux_chan_open(struct atport *port, void *priv)
+{
+	struct rport *p = priv;
+
+	return modem_add_atport(p->mdm, port);
+}
+
+static void rport_mux_chan_close(struct atport *port, void *priv)
+{
+	struct rport *p = priv;
+
+	modem_del_atport(p->mdm, port);
+}
+
+static const struct cmux_ops rport_cmux_ops = {
+	.write = rport_write,
+	.chan_open = rport_mux_chan_open,
+	.chan_close = rport_mux_chan_close,
+};
+
+/* Same as the emulator does, see inst_mux_parse() */
+static int rport_mux_parse(struct rport *p, const char *buf, size_t len)
+{
+	int res = cmux_parse(p->cmux, buf, len);
+
+	if (cmux_closed(p->cmux)) {
+		cmux_free(p->cmux);
+		p->cmux = NULL;
+		modem_add_atport(p->mdm, p->atport);
+	}
+
+	return res;
+}
+
+static int rport_mux(unsigned n1, const char *buf, size_t len, void *priv)
+{
+	struct rport *p = priv;
+
+	p->cmux = cmux_alloc(&rport_cmux_ops, p, modem_atcommands, p->mdm,
+			     n1);
+	if (!p->cmux)
+		return -ENOMEM;
+	modem_del_atport(p->mdm, p->atport);
+
+	return len ? rport_mux_parse(p, buf, len) : 0;
+}
+
+static const struct atops rport_atops = {
+	.write = rport_write,
+	.mux = rport_mux,
+};
+
+static void print_escaped(const char *pref, const char *buf, size_t len)
+{
+	size_t i;
+
+	fputs(pref, stdout);
+	for (i = 0; i < len && i < DIVERGE_CTX_LEN; ++i) {
+		if (buf[i] == '\r')
+			fputs("\\r", stdout);
+		else if (buf[i] == '\n')
+			fputs("\\n", stdout);
+		else
+			putc(buf[i], stdout);
+	}
+	if (len > DIVERGE_CTX_LEN)
+		fputs("...", stdout);
+	putc('\n', stdout);
+}
+
+/**
+ * Compare the produced output with the recorded one as far as both are
+ * available. Only the first divergence of a port is reported, since the
+ * port output is meaningless for comparison after it.
+ */
+static void rport_check(struct rport *p, int final)
+{
+	size_t i, n = p->exp.len < p->got.len ? p->exp.len : p->got.len;
+
+	if (p->diverged) {
+		p->exp.len = 0;
+		p->got.len = 0;
+		return;
+	}
+
+	for (i = 0; i < n; ++i)
+		if (p->exp.data[i] != p->got.data[i])
+			break;
+
+	if (i == n && !(final && (p->exp.len || p->got.len))) {
+		buf_consume(&p->exp, n);
+		buf_consume(&p->got, n);
+		p->off += n;
+		return;
+	}
+
+	printf("port %u: output diverged at offset %zu\n", p->id, p->off + i);
+	print_escaped("  recorded: ", p->exp.data + i, p->exp.len - i);
+	print_escaped("  replayed: ", p->got.data + i, p->got.len - i);
+	p->diverged = 1;
+	p->exp.len = 0;
+	p->got.len = 0;
+	replay.ndiverged++;
+}
+
+static void rport_disconnect(struct rport *p)
+{
+	cmux_free(p->cmux);
+	p->cmux = NULL;
+	modem_del_atport(p->mdm, p->atport);
+	atport_free(p->atport);
+	p->atport = NULL;
+}
+
+/* Give the modem a fresh AT port as the emulator does for a new client */
+static int rport_connect(struct rport *p)
+{
+	struct atport *atport;
+
+	atport = atport_alloc(&rport_atops, p, modem_atcommands, p->mdm);
+	if (!atport)
+		return -ENOMEM;
+	rport_disconnect(p);
+	modem_add_atport(p->mdm, atport);
+	p->atport = atport;
+
+	return 0;
+}
+
+static struct rport *rport_get(unsigned id)
+{
+	struct rport **ports, *p;
+	unsigned n;
+
+	if (id < replay.nports && replay.ports[id])
+		return replay.ports[id];
+
+	if (id >= replay.nports) {
+		n = id + 1;
+		ports = realloc(replay.ports, n * sizeof(*ports));
+		if (!ports)
+			return NULL;
+		memset(ports + replay.nports, 0x00,
+		       (n - replay.nports) * sizeof(*ports));
+		replay.ports = ports;
+		replay.nports = n;
+	}
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		return NULL;
+	p->id = id;
+
+	/* Configure the modem exactly as the emulator does */
+	p->mdm = modem_alloc(replay.msgs_num);
+	if (!p->mdm)
+		goto err_free;
+	modem_set_seed(p->mdm, replay.seed ^ (uint64_t)id << 32);
+	if (replay.profs) {
+		const struct profile_rec *prof = profile_get(replay.profs, id);
+
+		if (!prof) {
+			fprintf(stderr, "no valid profile for modem %u\n", id);
+			goto err_free_modem;
+		}
+		modem_set_profile(p->mdm, prof);
+	}
+	modem_set_scenario(p->mdm, scenario_prog(replay.scn, id));
+
+	if (rport_connect(p))
+		goto err_free_modem;
+
+	replay.ports[id] = p;
+
+	return p;
+
+err_free_modem:
+	modem_free(p->mdm);
+err_free:
+	free(p);
+
+	return NULL;
+}
+
+static void rport_free(struct rport *p)
+{
+	if (!p)
+		return;
+
+	cmux_free(p->cmux);
+	atport_free(p->atport);
+	modem_free(p->mdm);
+	free(p->exp.data);
+	free(p->got.data);
+	free(p);
+}
+
+/* Execute the recorded control operation */
+static int replay_ctl(struct rport *p, const char *payload, size_t len)
+{
+	char *text, *tok[SCN_TOKENS_MAX];
+	struct scn_op op, *ops;
+	int ntok, res;
+
+	text = strndup(payload, len);
+	if (!text)
+		return -ENOMEM;
+
+	memset(&op, 0x00, sizeof(op));
+	ntok = scenario_tokenize(text, tok);
+	res = ntok < 0 ? ntok : scenario_op_parse(&op, tok, ntok);
+	free(text);
+	if (res) {
+		fprintf(stderr, "invalid control operation record\n");
+		scenario_op_fini(&op);
+		return res;
+	}
+
+	modem_exec(p->mdm, &op);
+
+	/* Network names are referenced by the modem, keep them */
+	if (op.type != SCN_OP_PLMN) {
+		scenario_op_fini(&op);
+		return 0;
+	}
+	ops = realloc(replay.ops, (replay.nops + 1) * sizeof(*ops));
+	if (!ops) {
+		scenario_op_fini(&op);
+		return -ENOMEM;
+	}
+	replay.ops = ops;
+	replay.ops[replay.nops++] = op;
+
+	return 0;
+}
+
+static int replay_rec(const struct trace_rec *rec, const char *payload)
+{
+	struct rport *p;
+	char *text;
+	int res;
+
+	if (rec->caplen != rec->len) {
+		fprintf(stderr, "trace is not a session recording (no payload)\n");
+		return -EINVAL;
+	}
+
+	p = rport_get(rec->port);
+	if (!p) {
+		fprintf(stderr, "unable to allocate port %u\n", rec->port);
+		return -ENOMEM;
+	}
+
+	switch (rec->dir) {
+	case TRACE_RX:
+		replay.rx_bytes += rec->len;
+		if (p->stopped || !p->atport)
+			break;
+		if (p->cmux)
+			res = rport_mux_parse(p, payload, rec->len);
+		else
+			res = atport_parse(p->atport, payload, rec->len);
+		if (res < 0)
+			p->stopped = 1;
+		break;
+	case TRACE_TX:
+		replay.tx_bytes += rec->len;
+		if (buf_append(&p->exp, payload, rec->len))
+			return -ENOMEM;
+		break;
+	case TRACE_TICK:
+		replay.events++;
+		modem_tick(p->mdm);
+		break;
+	case TRACE_SMS:
+		replay.events++;
+		text = strndup(payload, rec->len);
+		if (!text)
+			return -ENOMEM;
+		modem_add_sms(p->mdm, text);
+		free(text);
+		break;
+	case TRACE_TEST_SMS:
+		replay.events++;
+		modem_add_test_sms(p->mdm);
+		break;
+	case TRACE_CTL:
+		replay.events++;
+		if (replay_ctl(p, payload, rec->len))
+			return -EINVAL;
+		break;
+	case TRACE_CONNECT:
+		replay.events++;
+		if (rport_connect(p))
+			return -ENOMEM;
+		break;
+	case TRACE_DISCONNECT:
+		replay.events++;
+		rport_disconnect(p);
+		break;
+	}
+
+	rport_check(p, 0);
+
+	return 0;
+}
+
+static char *load_file(const char *filename, size_t *len)
+{
+	size_t size = 0x10000, n;
+	char *data = NULL, *p;
+	FILE *fp;
+
+	fp = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "rb");
+	if (!fp) {
+		fprintf(stderr, "unable to open %s: %s\n", filename,
+			strerror(errno));
+		return NULL;
+	}
+
+	*len = 0;
+	while (1) {
+		p = realloc(data, size);
+		if (!p) {
+			fprintf(stderr, "unable to allocate trace buffer\n");
+			free(data);
+			data = NULL;
+			break;
+		}
+		data = p;
+		n = fread(data + *len, 1, size - *len, fp);
+		*len += n;
+		if (*len < size)
+			break;
+		size *= 2;
+	}
+
+	if (fp != stdin)
+		fclose(fp);
+
+	return data;
+}
+
+static void usage(const char *name)
+{
+	printf(
+		"Recorded session replay and regression checker\n"
+		"\n"
+		"Usage:\n"
+		"  %s -h\n"
+		"  %s [-r] [-p <port>] [-m <count>] [-S <seed>] [-c <filename>]\n"
+		"        [-P <filename>] <filename>\n"
+		"\n"
+		"Options:\n"
+		"  -h        Print this message\n"
+		"  -r        Keep the original pacing (default: as fast as possible)\n"
+		"  -p <port> Replay only the specified modem (port)\n"
+		"  -m <count> SMS storage capacity of each modem (default: %u)\n"
+		"  -S <seed> Modems pseudo random generators seed (default: 0)\n"
+		"  -c <filename> Network scenario\n"
+		"  -P <filename> Modems profiles database\n"
+		"  <filename> Session recording (see the mdmemul \"rec\" trace level)\n"
+		"            or \"-\" to read it from stdin\n"
+		"\n"
+		"Modems options should match the recording emulator ones.\n"
+		"\n", name, name, MODEM_MSGS_NUM_DEF
+	);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *name = basename(argv[0]);
+	const struct trace_file_hdr *hdr;
+	const struct trace_rec *rec;
+	uint64_t ts0 = 0, base = 0, start, t, dt;
+	struct timespec pause;
+	int opt, paced = 0, ret = EXIT_FAILURE;
+	size_t len, off;
+	long port = -1;
+	unsigned i;
+	char *data;
+
+	while (1) {
+		opt = getopt(argc, argv, "+hc:m:p:P:rS:");
+		if (opt == -1)
+			break;
+		switch (opt) {
+		case 'h':
+			usage(name);
+			return EXIT_SUCCESS;
+		case 'c':
+			replay.scn = scenario_load(optarg);
+			if (!replay.scn)
+				return EXIT_FAILURE;
+			break;
+		case 'm':
+			replay.msgs_num = strtoul(optarg, NULL, 0);
+			if (replay.msgs_num == 0) {
+				fprintf(stderr, "invalid SMS storage capacity\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'p':
+			port = strtol(optarg, NULL, 0);
+			break;
+		case 'P':
+			replay.profs = profile_open(optarg);
+			if (!replay.profs)
+				return EXIT_FAILURE;
+			break;
+		case 'r':
+			paced = 1;
+			break;
+		case 'S':
+			replay.seed = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(name);
+		return EXIT_FAILURE;
+	}
+
+	/* Load the whole recording to measure the replay only */
+	data = load_file(argv[optind], &len);
+	if (!data)
+		goto exit_free_scenario;
+
+	hdr = (const struct trace_file_hdr *)data;
+	if (len < sizeof(*hdr) ||
+	    memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != TRACE_VERSION) {
+		fprintf(stderr, "not a trace file or unsupported version\n");
+		goto exit_free_data;
+	}
+
+	start = now_ns();
+	for (off = sizeof(*hdr); off + sizeof(*rec) <= len;
+	     off += TRACE_REC_SIZE(rec->caplen)) {
+		rec = (const struct trace_rec *)(data + off);
+		if (off + TRACE_REC_SIZE(rec->caplen) > len) {
+			fprintf(stderr, "truncated trace record\n");
+			break;
+		}
+
+		/* Start the emulator clock at the first record moment */
+		if (!replay.recs++) {
+			ts0 = rec->ts;
+			vclock_init(0, (hdr->realtime_off + ts0) /
+				       NSEC_PER_MSEC);
+			base = vclock_now_ms();
+		}
+		/**
+		 * Records of the threads rings are interleaved in the file, so
+		 * a record could be earlier than the first one.
+		 */
+		dt = rec->ts > ts0 ? rec->ts - ts0 : 0;
+		vclock_advance(base + dt / NSEC_PER_MSEC);
+
+		if (paced) {
+			t = now_ns() - start;
+			if (dt > t) {
+				t = dt - t;
+				pause.tv_sec = t / NSEC_PER_SEC;
+				pause.tv_nsec = t % NSEC_PER_SEC;
+				nanosleep(&pause, NULL);
+			}
+		}
+
+		if (port >= 0 && rec->port != port)
+			continue;
+		if (replay_rec(rec, (const char *)(rec + 1)))
+			goto exit_free_ports;
+	}
+	t = now_ns() - start;
+
+	for (i = 0; i < replay.nports; ++i)
+		if (replay.ports[i])
+			rport_check(replay.ports[i], 1);
+
+	printf("Records: %lu (%lu events), Rx %lu bytes, Tx %lu bytes\n",
+	       replay.recs, replay.events, replay.rx_bytes, replay.tx_bytes);
+	printf("Replay: %.3f s, %.1f MB/s Rx, %.0f records/s\n", t / 1e9,
+	       t ? replay.rx_bytes * 1e3 / t : 0,
+	       t ? replay.recs * 1e9 / t : 0);
+	for (i = 0, len = 0; i < replay.nports; ++i)
+		len += replay.ports[i] != NULL;
+	printf("Ports: %zu, diverged: %u\n", len, replay.ndiverged);
+
+	if (!replay.ndiverged)
+		ret = EXIT_SUCCESS;
+
+exit_free_ports:
+	for (i = 0; i < replay.nports; ++i)
+		rport_free(replay.ports[i]);
+	free(replay.ports);
+	for (i = 0; i < replay.nops; ++i)
+		scenario_op_fini(&replay.ops[i]);
+	free(replay.ops);
+exit_free_data:
+	free(data);
+exit_free_scenario:
+	profile_close(replay.profs);
+	scenario_free(replay.scn);
+
+	return ret;
+}
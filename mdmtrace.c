@@ -0,0 +1,165 @@
+/**
+ * Binary exchange trace decoder
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define ARRAY_SIZE(__a)		(sizeof(__a)/sizeof((__a)[0]))
+
+static void dump_exchange(const struct trace_rec *rec, const char *buf,
+			  int64_t realtime_off, int show_ts, int show_port)
+{
+	static const char * const pref[] = {
+		[TRACE_RX] = "Rx",
+		[TRACE_TX] = "Tx",
+		[TRACE_TICK] = "Tick",
+		[TRACE_SMS] = "SMS",
+		[TRACE_TEST_SMS] = "TestSMS",
+		[TRACE_CTL] = "Ctl",
+		[TRACE_CONNECT] = "Connect",
+		[TRACE_DISCONNECT] = "Disconnect",
+	};
+	uint64_t ts = rec->ts + realtime_off;
+	char tbuf[0x20];
+	struct tm tm;
+	time_t secs;
+	size_t i;
+
+	if (show_ts) {
+		secs = ts / 1000000000;
+		localtime_r(&secs, &tm);
+		strftime(tbuf, sizeof(tbuf), "%H:%M:%S", &tm);
+		printf("%s.%06u ", tbuf, (unsigned)(ts % 1000000000 / 1000));
+	}
+	if (show_port)
+		printf("%u:", rec->port);
+	printf("%s[%u]", rec->dir < ARRAY_SIZE(pref) && pref[rec->dir] ?
+			 pref[rec->dir] : "??", rec->len);
+	if (rec->caplen == 0) {	/* Header only record */
+		putc('\n', stdout);
+		return;
+	}
+
+	fputs(": ", stdout);
+	for (i = 0; i < rec->caplen; ++i) {
+		if (buf[i] == '\r')
+			fputs("\\r", stdout);
+		else if (buf[i] == '\n')
+			fputs("\\n", stdout);
+		else
+			putc(buf[i], stdout);
+	}
+	putc('\n', stdout);
+}
+
+static void usage(const char *name)
+{
+	printf(
+		"Modem emulator binary trace decoder\n"
+		"\n"
+		"Usage:\n"
+		"  %s -h\n"
+		"  %s [-t] [-a] [-p <port>] <filename>\n"
+		"\n"
+		"Options:\n"
+		"  -h        Print this message\n"
+		"  -t        Print records timestamps\n"
+		"  -a        Always print modem (port) number\n"
+		"  -p <port> Print only records of the specified modem (port)\n"
+		"  <filename> Trace file name or \"-\" to read it from stdin\n"
+		"\n", name, name
+	);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *name = basename(argv[0]);
+	int show_ts = 0, show_port = 0;
+	struct trace_file_hdr hdr;
+	struct trace_rec rec;
+	long port = -1;
+	char *buf;
+	FILE *fp;
+	int opt;
+
+	while (1) {
+		opt = getopt(argc, argv, "+hatp:");
+		if (opt == -1)
+			break;
+		switch (opt) {
+		case 'h':
+			usage(name);
+			return EXIT_SUCCESS;
+		case 'a':
+			show_port = 1;
+			break;
+		case 't':
+			show_ts = 1;
+			break;
+		case 'p':
+			port = strtol(optarg, NULL, 0);
+			break;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(name);
+		return EXIT_FAILURE;
+	}
+
+	if (strcmp(argv[optind], "-") == 0) {
+		fp = stdin;
+	} else {
+		fp = fopen(argv[optind], "rb");
+		if (!fp) {
+			fprintf(stderr, "unable to open %s: %s\n",
+				argv[optind], strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != TRACE_VERSION) {
+		fprintf(stderr, "not a trace file or unsupported version\n");
+		return EXIT_FAILURE;
+	}
+
+	buf = malloc(TRACE_REC_SIZE(UINT16_MAX));
+	if (!buf) {
+		fprintf(stderr, "unable to allocate record buffer\n");
+		return EXIT_FAILURE;
+	}
+
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		size_t l = TRACE_REC_SIZE(rec.caplen) - sizeof(rec);
+
+		if (l && fread(buf, l, 1, fp) != 1) {
+			fprintf(stderr, "truncated trace record\n");
+			break;
+		}
+		if (port >= 0 && rec.port != port)
+			continue;
+		dump_exchange(&rec, buf, hdr.realtime_off, show_ts,
+			      show_port || port >= 0);
+	}
+
+	free(buf);
+	if (fp != stdin)
+		fclose(fp);
+
+	return EXIT_SUCCESS;
+}
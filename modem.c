@@ -7,6 +7,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
@@ -14,58 +15,155 @@
 
 #include "modem.h"
 #include "atport.h"
+#include "smsstore.h"
+#include "smsgen.h"
+#include "scenario.h"
+#include "profile.h"
+#include "vclock.h"
 
 struct modem_state {
-	struct atport *atport;
+	struct atport *ports[MODEM_PORTS_MAX];	/* URCs go to the first one */
+	unsigned nports;
+	const struct profile_rec *prof;	/* Identity, shared, never copied */
 	struct {
-		char *iccid;
-		char *imsi;
-	} sim;
-	struct {
-		char *plmn;
-		char *name;
+		const char *plmn;
+		const char *name;
 		int rssi;
+		int sysmode;	/* See enum modem_sysmode */
 	} net;
-	struct {
-		int state;
-		char *pdu;
-	} msgs[10];
+	unsigned cops_scan;	/* Ticks till the networks scan completion */
+	struct atport *cops_port;	/* Port, which waits for the scan */
+	struct smsstore msgs;
+	unsigned char msgs_ref;	/* Concatenated SMS reference */
+	uint64_t rnd;		/* Pseudo random generator state */
+	struct {		/* Unsolicited result codes control and state */
+		int cnmi_mode;		/* +CNMI <mode> */
+		int cnmi_mt;		/* +CNMI <mt> */
+		int curc;		/* ^CURC, Huawei URCs enabled */
+		unsigned csq;		/* Last reported signal level */
+		unsigned holdoff;	/* Ticks till next signal report */
+	} urc;
+	struct {		/* Scenario timeline execution state */
+		const struct scn_prog *prog;
+		int active;		/* Signal level is scripted */
+		unsigned pc;		/* Next operation */
+		long t;			/* Ticks since the timeline start */
+		int rssi;		/* Scripted signal level, dBm/256 */
+		int ramp_step;		/* Signal level change per tick */
+		unsigned ramp_left;	/* Ticks till the ramp end */
+		int ramp_to;		/* Ramp target level, dBm */
+		unsigned jitter;	/* Signal level noise amplitude, dB */
+	} scn;
 };
 
 #define ARRAY_SIZE(__a)		(sizeof(__a)/sizeof((__a)[0]))
 
-static int mdm_cmd_cimi_exec(void *priv)
+#define MODEM_RSSI_URC_DELTA	2	/* Signal report threshold (CSQ units) */
+#define MODEM_RSSI_URC_HOLDOFF	5	/* Min signal reports interval, ticks */
+#define MODEM_COPS_SCAN_MIN	10	/* Networks scan duration, ticks */
+#define MODEM_COPS_SCAN_RND	10	/* Random scan duration addition */
+
+/* Almost arbitrary codes/values of a modem without a profile */
+static const struct profile_rec modem_default_profile = {
+	.iccid = "8970169934461058920",
+	.imsi = "250692933657186",
+	.imei = "867191030143852",
+	.plmn = "25069",
+	.oper = "FunComm",
+	.vendor = "huawei",
+	.model = "E3372",
+	.revision = "21.180.01.00.00",
+	.rssi = -60,
+};
+
+/* Per modem xorshift64* generator, so a fleet is reproducible for a seed */
+static uint32_t modem_rand(struct modem_state *mstate)
+{
+	mstate->rnd ^= mstate->rnd >> 12;
+	mstate->rnd ^= mstate->rnd << 25;
+	mstate->rnd ^= mstate->rnd >> 27;
+
+	return (mstate->rnd * 0x2545F4914F6CDD1DULL) >> 32;
+}
+
+static unsigned modem_csq(const struct modem_state *mstate)
+{
+	if (mstate->net.rssi == 0)	/* Unknown */
+		return 99;
+	else if (mstate->net.rssi >= -57)
+		return 28;
+	else if (mstate->net.rssi <= -107)
+		return 3;
+
+	return (mstate->net.rssi + 113) / 2;
+}
+
+static void modem_urc(struct modem_state *mstate, const char *fmt, ...)
+{
+	char buf[0x80];
+	va_list ap;
+
+	if (!mstate->nports)
+		return;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	atport_urc(mstate->ports[0], buf);
+}
+
+static int mdm_cmd_cimi_exec(struct atport *port, void *priv)
 {
 	struct modem_state *mstate = priv;
 
-	return atport_puts(mstate->atport, mstate->sim.imsi);
+	return atport_puts(port, mstate->prof->imsi);
 }
 
-static int mdm_cmd_cgmi_exec(void *priv)
+static int mdm_cmd_cgmi_exec(struct atport *port, void *priv)
 {
 	struct modem_state *mstate = priv;
 
-	return atport_puts(mstate->atport, "huawei");
+	return atport_puts(port, mstate->prof->vendor);
 }
 
-static int mdm_cmd_cmgd_write(const char *str, void *priv)
+static int mdm_cmd_cgmm_exec(struct atport *port, void *priv)
+{
+	struct modem_state *mstate = priv;
+
+	return atport_puts(port, mstate->prof->model);
+}
+
+static int mdm_cmd_cgmr_exec(struct atport *port, void *priv)
+{
+	struct modem_state *mstate = priv;
+
+	return atport_puts(port, mstate->prof->revision);
+}
+
+static int mdm_cmd_cgsn_exec(struct atport *port, void *priv)
+{
+	struct modem_state *mstate = priv;
+
+	return atport_puts(port, mstate->prof->imei);
+}
+
+static int mdm_cmd_cmgd_write(struct atport *port, const char *str,
+			      void *priv)
 {
 	struct modem_state *mstate = priv;
 	int idx, len;
 
 	if (sscanf(str, "%d%n", &idx, &len) != 1 || str[len] != '\0')
 		return -EINVAL;
-	if (idx < 0 || idx >= ARRAY_SIZE(mstate->msgs) ||
-	    !mstate->msgs[idx].pdu)
+	if (idx < 0)
 		return -EINVAL;
 
-	free(mstate->msgs[idx].pdu);
-	mstate->msgs[idx].pdu = NULL;
-
-	return 0;
+	return smsstore_del(&mstate->msgs, idx);
 }
 
-static int mdm_cmd_cmgf_write(const char *str, void *priv)
+static int mdm_cmd_cmgf_write(struct atport *port, const char *str,
+			      void *priv)
 {
 	if (strcmp(str, "0") != 0)	/* Only PDU mode */
 		return -EINVAL;
@@ -73,23 +171,33 @@ static int mdm_cmd_cmgf_write(const char *str, void *priv)
 	return 0;
 }
 
-static int mdm_cmd_cmgl_write(const char *str, void *priv)
+static int mdm_cmd_cmgl_write(struct atport *port, const char *str,
+			      void *priv)
 {
 	struct modem_state *mstate = priv;
-	int i, l, res;
+	const struct smsstore *ss = &mstate->msgs;
+	const struct sms_msg *msg;
+	unsigned i, n;
+	int res;
 
 	if (strcmp(str, "4") != 0)	/* Only "ALL" mode */
 		return -EINVAL;
 
-	for (i = 0; i < ARRAY_SIZE(mstate->msgs); ++i) {
-		if (!mstate->msgs[i].pdu)
+	for (i = 0, n = 0; i < ss->cap && n < ss->nused; ++i) {
+		msg = smsstore_get(ss, i);
+		if (!msg)
 			continue;
-		l = strlen(mstate->msgs[i].pdu);
-		res = atport_printf(mstate->atport, "+CMGL: %d,%d,,%d", i,
-				    mstate->msgs[i].state, l / 2);
+		n++;
+		atport_add(port, "+CMGL: ");
+		atport_add_int(port, i);
+		atport_add(port, ",");
+		atport_add_int(port, msg->state);
+		atport_add(port, ",,");
+		atport_add_int(port, msg->len / 2);
+		res = atport_end(port);
 		if (res)
 			return res;
-		res = atport_puts(mstate->atport, mstate->msgs[i].pdu);
+		res = atport_putsn(port, smsstore_pdu(ss, i), msg->len);
 		if (res)
 			return res;
 	}
@@ -97,15 +205,99 @@ static int mdm_cmd_cmgl_write(const char *str, void *priv)
 	return 0;
 }
 
-static int mdm_cmd_cops_read(void *priv)
+static int mdm_cmd_cnmi_read(struct atport *port, void *priv)
+{
+	struct modem_state *mstate = priv;
+
+	atport_add(port, "+CNMI: ");
+	atport_add_int(port, mstate->urc.cnmi_mode);
+	atport_add(port, ",");
+	atport_add_int(port, mstate->urc.cnmi_mt);
+	atport_add(port, ",0,0,0");
+
+	return atport_end(port);
+}
+
+static int mdm_cmd_cnmi_write(struct atport *port, const char *str,
+			      void *priv)
+{
+	struct modem_state *mstate = priv;
+	int v[5] = {0}, i, len;
+
+	/* Only indication of SMS storing (<mt> = 1) is supported */
+	for (i = 0; i < ARRAY_SIZE(v); ++i) {
+		if (sscanf(str, "%d%n", &v[i], &len) != 1)
+			return -EINVAL;
+		str += len;
+		if (*str == '\0')
+			break;
+		if (*str++ != ',')
+			return -EINVAL;
+	}
+	if (*str != '\0' || v[0] < 0 || v[0] > 2 || v[1] < 0 || v[1] > 1 ||
+	    v[2] || v[3] || v[4])
+		return -EINVAL;
+
+	mstate->urc.cnmi_mode = v[0];
+	mstate->urc.cnmi_mt = v[1];
+
+	return 0;
+}
+
+static int mdm_cmd_cops_read(struct atport *port, void *priv)
+{
+	struct modem_state *mstate = priv;
+
+	if (mstate->net.sysmode == MODEM_SYSMODE_NONE)
+		return atport_puts(port, "+COPS: 0");
+
+	atport_add(port, "+COPS: 0,2,");
+	atport_add_quoted(port, mstate->net.plmn);
+	atport_add(port, ",7");
+
+	return atport_end(port);
+}
+
+/**
+ * Networks scan takes a while, so complete the command from the tick. The
+ * modem runs a single scan at a time, even if it has a few ports.
+ */
+static int mdm_cmd_cops_test(struct atport *port, void *priv)
 {
 	struct modem_state *mstate = priv;
 
-	return atport_printf(mstate->atport, "+COPS: 0,2,\"%s\",7",
-			     mstate->net.plmn);
+	if (mstate->cops_scan)
+		return -EBUSY;
+
+	mstate->cops_port = port;
+	mstate->cops_scan = MODEM_COPS_SCAN_MIN +
+			    modem_rand(mstate) % MODEM_COPS_SCAN_RND;
+
+	return -EINPROGRESS;
+}
+
+static void modem_cops_scan_done(struct modem_state *mstate)
+{
+	struct atport *port = mstate->cops_port;
+
+	mstate->cops_port = NULL;
+	atport_add(port, "+COPS: ");
+	if (mstate->net.sysmode != MODEM_SYSMODE_NONE) {
+		atport_add(port, "(2,");
+		atport_add_quoted(port, mstate->net.name);
+		atport_add(port, ",");
+		atport_add_quoted(port, mstate->net.name);
+		atport_add(port, ",");
+		atport_add_quoted(port, mstate->net.plmn);
+		atport_add(port, ",7)");
+	}
+	atport_add(port, ",,(0,1,2,3,4),(0,1,2)");
+
+	atport_complete(port, atport_end(port));
 }
 
-static int mdm_cmd_cops_write(const char *str, void *priv)
+static int mdm_cmd_cops_write(struct atport *port, const char *str,
+			      void *priv)
 {
 	if (strcmp(str, "3,2") != 0)	/* Support only numeric OP conf */
 		return -EINVAL;
@@ -113,45 +305,99 @@ static int mdm_cmd_cops_write(const char *str, void *priv)
 	return 0;
 }
 
-static int mdm_cmd_cpin_read(void *priv)
+/**
+ * Only the basic option with UIH frames is supported. The rest of
+ * parameters are checked for the range, but ignored except the max frame
+ * size, which the multiplexer uses for responses, see cmux.c.
+ */
+static int mdm_cmd_cmux_write(struct atport *port, const char *str,
+			      void *priv)
 {
-	return atport_puts(((struct modem_state *)priv)->atport,
-			   "+CPIN: READY");
+	static const struct {
+		unsigned min, max, def;
+	} lim[] = {		/* <mode>,<subset>,<speed>,<N1>,<T1>,... */
+		{0, 0, 0}, {0, 0, 0}, {1, 5, 5}, {1, 1509, 31}, {1, 255, 10},
+		{0, 100, 3}, {2, 255, 30}, {1, 255, 10}, {1, 7, 2},
+	};
+	unsigned v[ARRAY_SIZE(lim)], i;
+	int len;
+
+	for (i = 0; i < ARRAY_SIZE(lim); ++i)
+		v[i] = lim[i].def;
+
+	for (i = 0; i < ARRAY_SIZE(lim); ++i) {
+		if (*str != ',' && *str != '\0') {
+			if (sscanf(str, "%u%n", &v[i], &len) != 1 ||
+			    v[i] < lim[i].min || v[i] > lim[i].max)
+				return -EINVAL;
+			str += len;
+		} else if (i == 0) {
+			return -EINVAL;	/* Mode is mandatory */
+		}
+		if (*str == '\0')
+			break;
+		if (*str++ != ',')
+			return -EINVAL;
+	}
+	if (*str != '\0')
+		return -EINVAL;
+
+	return atport_mux(port, v[3]);
 }
 
-static int mdm_cmd_csq_exec(void *priv)
+static int mdm_cmd_csq_exec(struct atport *port, void *priv)
 {
 	struct modem_state *mstate = priv;
-	unsigned signal;
 
-	if (mstate->net.rssi == 0)	/* Unknown */
-		signal = 99;
-	else if (mstate->net.rssi >= -57)
-		signal = 28;
-	else if (mstate->net.rssi <= -107)
-		signal = 3;
-	else
-		signal = (mstate->net.rssi + 113) / 2;
+	atport_add(port, "+CSQ: ");
+	atport_add_int(port, modem_csq(mstate));
+	atport_add(port, ",99");
 
-	return atport_printf(mstate->atport, "+CSQ: %u,99", signal);
+	return atport_end(port);
 }
 
-static int mdm_cmd_iccid_read(void *priv)
+static int mdm_cmd_curc_read(struct atport *port, void *priv)
 {
-	char buf[29], *p = buf, *e = buf + sizeof(buf);
 	struct modem_state *mstate = priv;
 
-	p += snprintf(p, e - p, "^ICCID: %s", mstate->sim.iccid);
-	if (p - buf < 28)	/* Pad ICCID val to 20 symbols */
-		p += snprintf(p, e - p, "%.*s", 28 - (p - buf),
-			      "FFFFFFFFFFFFFFFFFFFF");
+	atport_add(port, "^CURC: ");
+	atport_add_int(port, mstate->urc.curc);
 
-	return atport_puts(mstate->atport, buf);
+	return atport_end(port);
+}
+
+static int mdm_cmd_curc_write(struct atport *port, const char *str,
+			      void *priv)
+{
+	struct modem_state *mstate = priv;
+
+	if (strcmp(str, "0") != 0 && strcmp(str, "1") != 0)
+		return -EINVAL;
+
+	mstate->urc.curc = str[0] - '0';
+
+	return 0;
 }
 
-static int mdm_cmd_sysinfoex_exec(void *priv)
+static int mdm_cmd_iccid_read(struct atport *port, void *priv)
 {
 	struct modem_state *mstate = priv;
+	size_t len = strlen(mstate->prof->iccid);
+
+	atport_add(port, "^ICCID: ");
+	atport_addn(port, mstate->prof->iccid, len);
+	if (len < 20)		/* Pad ICCID val to 20 symbols */
+		atport_addn(port, "FFFFFFFFFFFFFFFFFFFF", 20 - len);
+
+	return atport_end(port);
+}
+
+static int mdm_cmd_sysinfoex_exec(struct atport *port, void *priv)
+{
+	struct modem_state *mstate = priv;
+
+	if (mstate->net.sysmode == MODEM_SYSMODE_NONE)
+		return atport_puts(port, "^SYSINFOEX:0,0,0,1,,0,\"\",0,\"\"");
 
 	/* Values:
 	 *  2 - Service,
@@ -164,37 +410,97 @@ static int mdm_cmd_sysinfoex_exec(void *priv)
 	 *  101 - system submode LTE,
 	 *  "LTE" - submode name
 	 */
-	return atport_puts(mstate->atport, "^SYSINFOEX:2,3,0,1,,6,\"LTE\",101,\"LTE\"");
+	return atport_puts(port, "^SYSINFOEX:2,3,0,1,,6,\"LTE\",101,\"LTE\"");
 }
 
+/**
+ * Identity responses are constant for a profile and ^SYSINFOEX depends on
+ * the sysmode only, so they are cached by the port, see modem_invalidate().
+ */
 struct atcmd modem_atcommands[] = {
-	{"+CIMI", .exec = mdm_cmd_cimi_exec},
-	{"+CGMI", .exec = mdm_cmd_cgmi_exec},
+	{"+CIMI", .exec = mdm_cmd_cimi_exec, .cache = ATCMD_CACHE_EXEC},
+	{"+CGMI", .exec = mdm_cmd_cgmi_exec, .cache = ATCMD_CACHE_EXEC},
+	{"+CGMM", .exec = mdm_cmd_cgmm_exec, .cache = ATCMD_CACHE_EXEC},
+	{"+CGMR", .exec = mdm_cmd_cgmr_exec, .cache = ATCMD_CACHE_EXEC},
+	{"+CGSN", .exec = mdm_cmd_cgsn_exec, .cache = ATCMD_CACHE_EXEC},
 	{"+CMGD", .write = mdm_cmd_cmgd_write},
 	{"+CMGF", .write = mdm_cmd_cmgf_write},
 	{"+CMGL", .write = mdm_cmd_cmgl_write},
-	{"+COPS", .read = mdm_cmd_cops_read, .write = mdm_cmd_cops_write},
-	{"+CPIN", .read = mdm_cmd_cpin_read},
+	{"+CMUX", .write = mdm_cmd_cmux_write,
+		  .resp.test = "+CMUX: (0),(0),(1-5),(1-1509),(1-255),(0-100),"
+			       "(2-255),(1-255),(1-7)"},
+	{"+CNMI", .read = mdm_cmd_cnmi_read, .write = mdm_cmd_cnmi_write,
+		  .resp.test = "+CNMI: (0-2),(0-1),(0),(0),(0)"},
+	{"+COPS", .read = mdm_cmd_cops_read, .test = mdm_cmd_cops_test,
+		  .write = mdm_cmd_cops_write},
+	{"+CPIN", .resp.read = "+CPIN: READY"},
 	{"+CSQ", .exec = mdm_cmd_csq_exec},
-	{"^ICCID", .read = mdm_cmd_iccid_read},
-	{"^SYSINFOEX", .exec = mdm_cmd_sysinfoex_exec},
+	{"^CURC", .read = mdm_cmd_curc_read, .write = mdm_cmd_curc_write},
+	{"^ICCID", .read = mdm_cmd_iccid_read, .cache = ATCMD_CACHE_READ},
+	{"^SYSINFOEX", .exec = mdm_cmd_sysinfoex_exec,
+		       .cache = ATCMD_CACHE_EXEC},
 	{NULL}
 };
 
-static void modem_add_sms_recv(struct modem_state *mstate, const char *pdu)
+/* Drop the ports cached responses, which depend on the changed state */
+static void modem_invalidate(struct modem_state *mstate)
 {
-	int i;
+	unsigned i;
 
-	for (i = 0; i < ARRAY_SIZE(mstate->msgs); ++i) {
-		if (!mstate->msgs[i].pdu)
-			break;
-	}
-	if (i == ARRAY_SIZE(mstate->msgs)) {
-		fprintf(stderr, "no free message slot(s), PDU will be dropped\n");
-		return;
-	}
-	mstate->msgs[i].state = 0;	/* Recv unreaded */
-	mstate->msgs[i].pdu = strdup(pdu);
+	for (i = 0; i < mstate->nports; ++i)
+		atport_invalidate(mstate->ports[i]);
+}
+
+static int modem_add_sms_recv(struct modem_state *mstate, const char *pdu,
+			      size_t len)
+{
+	/* Recv unreaded */
+	int res = smsstore_add(&mstate->msgs, pdu, len, 0);
+
+	if (res < 0)
+		return res;
+
+	if (mstate->urc.cnmi_mode && mstate->urc.cnmi_mt == 1)
+		modem_urc(mstate, "+CMTI: \"SM\",%d", res);
+
+	return 0;
+}
+
+/* Put an octet as two hex digits, returns the position after them */
+static char *modem_hex8(char *p, unsigned char val)
+{
+	static const char hexdig[] = "0123456789ABCDEF";
+
+	p[0] = hexdig[val >> 4];
+	p[1] = hexdig[val & 0xf];
+
+	return p + 2;
+}
+
+static int modem_add_sms_cb(const char *pdu, size_t len, void *priv)
+{
+	return modem_add_sms_recv(priv, pdu, len);
+}
+
+/**
+ * Receive a text message, returns number of stored PDUs or negative error
+ * code (e.g. -ENOSPC if storage is full).
+ */
+int modem_add_sms(struct modem_state *mstate, const char *text)
+{
+	struct smsgen_msg msg = {
+		.smsc = "79001234567",
+		.addr = "79012345678",
+		.text = text,
+	};
+	struct tm tm;
+
+	msg.scts = vclock_time();
+	localtime_r(&msg.scts, &tm);
+	msg.gmtoff = tm.tm_gmtoff;
+	msg.ref = mstate->msgs_ref++;
+
+	return smsgen_encode(&msg, modem_add_sms_cb, mstate);
 }
 
 void modem_add_test_sms(struct modem_state *mstate)
@@ -220,65 +526,290 @@ void modem_add_test_sms(struct modem_state *mstate)
 		"6E3A0B34AFBBE9A0B41B34AEB3E16150BC9E06BDCDE6F4381D0691CBF3B2BCEE"
 		"A683DA6F363B4D0785DDE936284D0695E774103B2C7ECBEB6D17",
 	};
-	static char buf[0x200];
-	char scts[7 * 2 + 1];
-	char udh[6 * 2 + 1];
-	struct tm *tm;
+	char buf[0x200];	/* Could be called from any modem thread */
+	char scts[7 * 2];
+	unsigned char ref = mstate->msgs_ref++;
+	struct tm tm;
 	time_t now;
-	int i, off;
-
-	now = time(NULL);
-	tm = localtime(&now);
-	memset(scts, '0', sizeof(scts) - 1);
-	scts[0x0] += (tm->tm_year % 100) % 10;
-	scts[0x1] += (tm->tm_year % 100) / 10;
-	scts[0x2] += (tm->tm_mon + 1) % 10;
-	scts[0x3] += (tm->tm_mon + 1) / 10;
-	scts[0x4] += tm->tm_mday % 10;
-	scts[0x5] += tm->tm_mday / 10;
-	scts[0x6] += tm->tm_hour % 10;
-	scts[0x7] += tm->tm_hour / 10;
-	scts[0x8] += tm->tm_min % 10;
-	scts[0x9] += tm->tm_min / 10;
-	scts[0xa] += tm->tm_sec % 10;
-	scts[0xb] += tm->tm_sec / 10;
-	i = tm->tm_gmtoff > 0 ? tm->tm_gmtoff : -tm->tm_gmtoff;
+	size_t off;
+	char *p;
+	int i;
+
+	now = vclock_time();
+	localtime_r(&now, &tm);
+	memset(scts, '0', sizeof(scts));
+	scts[0x0] += (tm.tm_year % 100) % 10;
+	scts[0x1] += (tm.tm_year % 100) / 10;
+	scts[0x2] += (tm.tm_mon + 1) % 10;
+	scts[0x3] += (tm.tm_mon + 1) / 10;
+	scts[0x4] += tm.tm_mday % 10;
+	scts[0x5] += tm.tm_mday / 10;
+	scts[0x6] += tm.tm_hour % 10;
+	scts[0x7] += tm.tm_hour / 10;
+	scts[0x8] += tm.tm_min % 10;
+	scts[0x9] += tm.tm_min / 10;
+	scts[0xa] += tm.tm_sec % 10;
+	scts[0xb] += tm.tm_sec / 10;
+	i = tm.tm_gmtoff > 0 ? tm.tm_gmtoff : -tm.tm_gmtoff;
 	i = i / 60 / 15;	/* Secs into number of quarters of hour */
-	if (tm->tm_gmtoff < 0)	/* Rize high bit for negative offset */
+	if (tm.tm_gmtoff < 0)	/* Rize high bit for negative offset */
 		i += 8 * 10;
-	snprintf(&scts[0xc], 3, "%1hhx%1hhx", i % 10, i / 10);
+	scts[0xc] = '0' + i % 10;
+	scts[0xd] = "0123456789abcdef"[i / 10];
 
 	/* Join base header with TP-SCTS */
-	off = snprintf(buf, sizeof(buf), "%s%s", basehdr, scts);
-
-	/* Prepare UDH template with SM concatenation element */
-	snprintf(udh, sizeof(udh), "%02hhX%02hhX%02hhX%02hhX%02hhX%02hhX",
-		 5, 0, 3, (unsigned char)random(), ARRAY_SIZE(parts), 0);
+	off = strlen(basehdr);
+	memcpy(buf, basehdr, off);
+	memcpy(&buf[off], scts, sizeof(scts));
+	off += sizeof(scts);
 
 	for (i = 0; i < ARRAY_SIZE(parts); ++i) {
-		int l = ((strlen(parts[i]) + 12) / 2 * 8) / 7;	/* Septets */
+		size_t len = strlen(parts[i]);
+
+		/* TP-UDL (septets) and UDH with SM concatenation element */
+		p = modem_hex8(&buf[off], ((len + 12) / 2 * 8) / 7);
+		p = modem_hex8(p, 5);			/* UDHL */
+		p = modem_hex8(p, 0);			/* IEI */
+		p = modem_hex8(p, 3);			/* IEDL */
+		p = modem_hex8(p, ref);
+		p = modem_hex8(p, ARRAY_SIZE(parts));
+		p = modem_hex8(p, i + 1);
+		memcpy(p, parts[i], len);
+		if (modem_add_sms_recv(mstate, buf, p + len - buf))
+			fprintf(stderr, "no free message slot(s), PDU will be dropped\n");
+	}
+}
+
+/**
+ * Report signal level only on a significant change and not more often than
+ * once per holdoff period to avoid URCs flood.
+ */
+static void modem_urc_signal(struct modem_state *mstate)
+{
+	unsigned csq = modem_csq(mstate);
+
+	if (mstate->urc.holdoff)
+		mstate->urc.holdoff--;
+	if (!mstate->urc.curc || mstate->urc.holdoff)
+		return;
+	if (csq < mstate->urc.csq + MODEM_RSSI_URC_DELTA &&
+	    csq + MODEM_RSSI_URC_DELTA > mstate->urc.csq)
+		return;
+
+	mstate->urc.csq = csq;
+	mstate->urc.holdoff = MODEM_RSSI_URC_HOLDOFF;
+	modem_urc(mstate, "^RSSI:%u", csq);
+}
 
-		snprintf(&udh[5 * 2], 3, "%02hhX", i + 1);
-		snprintf(&buf[off], sizeof(buf) - off, "%02hhX%s%s", l, udh,
-			 parts[i]);
-		modem_add_sms_recv(mstate, buf);
+void modem_set_sysmode(struct modem_state *mstate, enum modem_sysmode sysmode)
+{
+	if (mstate->net.sysmode == sysmode)
+		return;
+
+	mstate->net.sysmode = sysmode;
+	modem_invalidate(mstate);
+	if (mstate->urc.curc)
+		modem_urc(mstate, "^MODE:%d,%d", sysmode,
+			  sysmode == MODEM_SYSMODE_LTE ? 101 : 0);
+}
+
+static void modem_scn_exec(struct modem_state *mstate,
+			   const struct scn_op *op)
+{
+	int i;
+
+	switch (op->type) {
+	case SCN_OP_RSSI:
+		mstate->scn.rssi = op->arg * 256;
+		mstate->scn.ramp_left = 0;
+		break;
+	case SCN_OP_RAMP:
+		mstate->scn.ramp_step = (op->arg * 256 - mstate->scn.rssi) /
+					op->arg2;
+		mstate->scn.ramp_left = op->arg2;
+		mstate->scn.ramp_to = op->arg;
+		break;
+	case SCN_OP_JITTER:
+		mstate->scn.jitter = op->arg;
+		break;
+	case SCN_OP_REG:
+		modem_set_sysmode(mstate, op->arg ? MODEM_SYSMODE_LTE :
+						    MODEM_SYSMODE_NONE);
+		break;
+	case SCN_OP_PLMN:
+		mstate->net.plmn = op->str;
+		mstate->net.name = op->str2;
+		break;
+	case SCN_OP_SMS:
+		for (i = 0; i < op->arg; ++i)
+			if (modem_add_sms(mstate, op->str) < 0)
+				break;
+		break;
 	}
 }
 
+/**
+ * Execute the scenario operation right now, e.g. on the runtime control
+ * request. Signal level operations switch the default signal dynamics off.
+ * Operation strings should outlive the modem.
+ */
+void modem_exec(struct modem_state *mstate, const struct scn_op *op)
+{
+	if (!mstate->scn.active &&
+	    (op->type == SCN_OP_RSSI || op->type == SCN_OP_RAMP ||
+	     op->type == SCN_OP_JITTER)) {
+		mstate->scn.active = 1;
+		mstate->scn.rssi = mstate->net.rssi * 256;
+	}
+
+	modem_scn_exec(mstate, op);
+	if (op->type == SCN_OP_RSSI)	/* Do not wait for the tick */
+		mstate->net.rssi = op->arg;
+}
+
+/* Execute the scenario operations of the current tick */
+static void modem_scn_tick(struct modem_state *mstate)
+{
+	const struct scn_prog *prog = mstate->scn.prog;
+	int rssi;
+
+	if (mstate->scn.ramp_left) {
+		if (--mstate->scn.ramp_left)
+			mstate->scn.rssi += mstate->scn.ramp_step;
+		else	/* Avoid the rounding error accumulation */
+			mstate->scn.rssi = mstate->scn.ramp_to * 256;
+	}
+
+	/* Runtime operations could activate a modem without a timeline */
+	if (!prog)
+		goto update_rssi;
+
+	while (mstate->scn.pc < prog->nops &&
+	       prog->ops[mstate->scn.pc].at == mstate->scn.t)
+		modem_scn_exec(mstate, &prog->ops[mstate->scn.pc++]);
+
+	if (++mstate->scn.t == prog->period) {
+		mstate->scn.t = 0;
+		mstate->scn.pc = 0;
+	}
+
+update_rssi:
+	rssi = mstate->scn.rssi / 256;
+	if (mstate->scn.jitter)
+		rssi += (int)(modem_rand(mstate) % (mstate->scn.jitter * 2 + 1)) -
+			(int)mstate->scn.jitter;
+	mstate->net.rssi = rssi;
+}
+
 void modem_tick(struct modem_state *mstate)
 {
-	/* Make RSSI more dynamic and increase it each tick */
-	mstate->net.rssi += 2;
-	if (mstate->net.rssi > -55)
-		mstate->net.rssi = -109;
+	if (mstate->cops_scan && !--mstate->cops_scan)
+		modem_cops_scan_done(mstate);
+
+	if (mstate->scn.active) {
+		modem_scn_tick(mstate);
+	} else {
+		/* Make RSSI more dynamic and increase it each tick */
+		mstate->net.rssi += 2;
+		if (mstate->net.rssi > -55)
+			mstate->net.rssi = -109;
+	}
+
+	modem_urc_signal(mstate);
+}
+
+/**
+ * Attach the scenario timeline, which replaces the default signal level
+ * dynamics. The timeline start of each modem is randomly delayed if the
+ * scenario requests spreading.
+ */
+void modem_set_scenario(struct modem_state *mstate,
+			const struct scn_prog *prog)
+{
+	memset(&mstate->scn, 0x00, sizeof(mstate->scn));
+	mstate->scn.prog = prog;
+	mstate->scn.active = prog != NULL;
+	mstate->scn.rssi = mstate->net.rssi * 256;
+	if (prog && prog->spread)
+		mstate->scn.t = -(long)(modem_rand(mstate) % prog->spread);
+}
+
+/**
+ * Seed the modem pseudo random generator and randomize the initial state,
+ * e.g. the signal level phase, to avoid a fleet moving in lockstep.
+ */
+void modem_set_seed(struct modem_state *mstate, uint64_t seed)
+{
+	/* SplitMix64 step to get a well mixed non zero state */
+	seed += 0x9E3779B97F4A7C15ULL;
+	seed = (seed ^ seed >> 30) * 0xBF58476D1CE4E5B9ULL;
+	seed = (seed ^ seed >> 27) * 0x94D049BB133111EBULL;
+	mstate->rnd = (seed ^ seed >> 31) | 1;
+
+	mstate->msgs_ref = modem_rand(mstate);
+	mstate->net.rssi = -109 + 2 * (modem_rand(mstate) % 28);
+	mstate->urc.csq = modem_csq(mstate);
+}
+
+/**
+ * Use the identity and home network of the profile. The profile is used in
+ * place (e.g. directly from the database mapping), so it should outlive the
+ * modem. Should be called after the seeding, since the profile signal level
+ * overrides the random one.
+ */
+void modem_set_profile(struct modem_state *mstate,
+		       const struct profile_rec *prof)
+{
+	mstate->prof = prof;
+	modem_invalidate(mstate);
+	mstate->net.plmn = prof->plmn;
+	mstate->net.name = prof->oper;
+	if (prof->rssi) {
+		mstate->net.rssi = prof->rssi;
+		mstate->urc.csq = modem_csq(mstate);
+	}
 }
 
-void modem_set_atport(struct modem_state *mstate, struct atport *atport)
+/**
+ * Attach a port, e.g. a client connection or a multiplexer channel. Ports
+ * share the modem state, but each one has own response cache and command
+ * line state. URCs are sent to the earliest attached port only. A port could
+ * be attached again (e.g. on the multiplexer close down) and miss the state
+ * changes meanwhile, so its cache is dropped.
+ */
+int modem_add_atport(struct modem_state *mstate, struct atport *port)
 {
-	mstate->atport = atport;
+	if (mstate->nports == ARRAY_SIZE(mstate->ports))
+		return -ENOSPC;
+
+	atport_invalidate(port);
+	mstate->ports[mstate->nports++] = port;
+
+	return 0;
 }
 
-struct modem_state *modem_alloc(void)
+/* Detach the port before its release, its pending command is cancelled */
+void modem_del_atport(struct modem_state *mstate, struct atport *port)
+{
+	unsigned i;
+
+	if (mstate->cops_port == port) {
+		mstate->cops_port = NULL;
+		mstate->cops_scan = 0;
+	}
+
+	for (i = 0; i < mstate->nports; ++i)
+		if (mstate->ports[i] == port)
+			break;
+	if (i == mstate->nports)
+		return;
+
+	mstate->nports--;
+	memmove(&mstate->ports[i], &mstate->ports[i + 1],
+		(mstate->nports - i) * sizeof(mstate->ports[0]));
+}
+
+struct modem_state *modem_alloc(unsigned msgs_num)
 {
 	struct modem_state *mstate = calloc(1, sizeof(*mstate));
 
@@ -287,25 +818,24 @@ struct modem_state *modem_alloc(void)
 		return NULL;
 	}
 
-	/* Almost arbitrary codes/values */
-	mstate->sim.iccid = "8970169934461058920";
-	mstate->sim.imsi = "250692933657186";
-	mstate->net.plmn = "25069";
-	mstate->net.name = "FunComm";
-	mstate->net.rssi = -60;
+	if (smsstore_init(&mstate->msgs, msgs_num)) {
+		fprintf(stderr, "unable to allocate the messages storage\n");
+		free(mstate);
+		return NULL;
+	}
+
+	mstate->net.sysmode = MODEM_SYSMODE_LTE;
+	mstate->rnd = 1;
+	modem_set_profile(mstate, &modem_default_profile);
 
 	return mstate;
 }
 
 void modem_free(struct modem_state *mstate)
 {
-	int i;
-
 	if (!mstate)
 		return;
 
-	for (i = 0; i < sizeof(mstate->msgs)/sizeof(mstate->msgs[0]); ++i)
-		free(mstate->msgs[i].pdu);
-
+	smsstore_fini(&mstate->msgs);
 	free(mstate);
 }
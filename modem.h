@@ -7,16 +7,38 @@
 #ifndef _MODEM_H_
 #define _MODEM_H_
 
+#include <stdint.h>
+
 #include "atport.h"
 
+#define MODEM_MSGS_NUM_DEF	10	/* Default SMS storage capacity */
+#define MODEM_PORTS_MAX		16	/* Max attached ports (e.g. channels) */
+
 struct modem_state;
+struct scn_prog;
+struct scn_op;
+struct profile_rec;
+
+enum modem_sysmode {		/* See ^SYSINFOEX <sysmode> */
+	MODEM_SYSMODE_NONE = 0,	/* No service */
+	MODEM_SYSMODE_LTE = 6,
+};
 
 extern struct atcmd modem_atcommands[];
 
+int modem_add_sms(struct modem_state *mstate, const char *text);
 void modem_add_test_sms(struct modem_state *mstate);
 void modem_tick(struct modem_state *mstate);
-void modem_set_atport(struct modem_state *mstate, struct atport *atport);
-struct modem_state *modem_alloc(void);
+void modem_set_sysmode(struct modem_state *mstate, enum modem_sysmode sysmode);
+void modem_set_scenario(struct modem_state *mstate,
+			const struct scn_prog *prog);
+void modem_exec(struct modem_state *mstate, const struct scn_op *op);
+void modem_set_seed(struct modem_state *mstate, uint64_t seed);
+void modem_set_profile(struct modem_state *mstate,
+		       const struct profile_rec *prof);
+int modem_add_atport(struct modem_state *mstate, struct atport *port);
+void modem_del_atport(struct modem_state *mstate, struct atport *port);
+struct modem_state *modem_alloc(unsigned msgs_num);
 void modem_free(struct modem_state *mstate);
 
 #endif	/* _MODEM_H_ */
@@ -0,0 +1,126 @@
+/**
+ * Modem profiles database
+ *
+ * Database is a file with a header and an array of fixed size records. The
+ * file is mmap'd, so opening costs neither parsing nor allocation, records
+ * are paged in on the first access and are used by modems in place.
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "profile.h"
+
+#define PROFILE_STR_VALID(__s)	(memchr(__s, '\0', sizeof(__s)) != NULL)
+
+struct profile_db {
+	void *map;
+	size_t size;
+	const struct profile_rec *recs;
+	unsigned long count;
+};
+
+struct profile_db *profile_open(const char *filename)
+{
+	const struct profile_hdr *hdr;
+	struct profile_db *db;
+	struct stat st;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "unable to open profiles %s: %s\n", filename,
+			strerror(errno));
+		return NULL;
+	}
+
+	db = calloc(1, sizeof(*db));
+	if (!db)
+		goto err_close;
+
+	if (fstat(fd, &st)) {
+		perror("fstat()");
+		goto err_free;
+	}
+	if (st.st_size < sizeof(*hdr)) {
+		fprintf(stderr, "profiles file %s is too short\n", filename);
+		goto err_free;
+	}
+
+	db->size = st.st_size;
+	db->map = mmap(NULL, db->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (db->map == MAP_FAILED) {
+		perror("mmap()");
+		goto err_free;
+	}
+	close(fd);
+
+	hdr = db->map;
+	if (memcmp(hdr->magic, PROFILE_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != PROFILE_VERSION ||
+	    hdr->rec_size != sizeof(struct profile_rec) ||
+	    hdr->count > (db->size - sizeof(*hdr)) / hdr->rec_size) {
+		fprintf(stderr, "%s is not a profiles file, has unsupported version or is truncated\n",
+			filename);
+		munmap(db->map, db->size);
+		free(db);
+		return NULL;
+	}
+	db->recs = (const struct profile_rec *)(hdr + 1);
+	db->count = hdr->count;
+
+	return db;
+
+err_free:
+	free(db);
+err_close:
+	close(fd);
+
+	return NULL;
+}
+
+unsigned long profile_count(const struct profile_db *db)
+{
+	return db->count;
+}
+
+/**
+ * Returns the record or NULL if the index is out of range or the record is
+ * corrupted. Only the requested record is checked (and paged in).
+ */
+const struct profile_rec *profile_get(const struct profile_db *db,
+				      unsigned long idx)
+{
+	const struct profile_rec *rec;
+
+	if (idx >= db->count)
+		return NULL;
+
+	rec = &db->recs[idx];
+	if (!PROFILE_STR_VALID(rec->iccid) || !PROFILE_STR_VALID(rec->imsi) ||
+	    !PROFILE_STR_VALID(rec->imei) || !PROFILE_STR_VALID(rec->plmn) ||
+	    !PROFILE_STR_VALID(rec->oper) || !PROFILE_STR_VALID(rec->vendor) ||
+	    !PROFILE_STR_VALID(rec->model) ||
+	    !PROFILE_STR_VALID(rec->revision))
+		return NULL;
+
+	return rec;
+}
+
+void profile_close(struct profile_db *db)
+{
+	if (!db)
+		return;
+
+	munmap(db->map, db->size);
+	free(db);
+}
@@ -0,0 +1,48 @@
+/**
+ * Modem profiles database header file
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#include <stdint.h>
+
+#define PROFILE_MAGIC		"MDMPROF"
+#define PROFILE_VERSION		1
+
+/* Database file header, followed by the records array */
+struct profile_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t rec_size;	/* sizeof(struct profile_rec) */
+	uint64_t count;		/* Number of records */
+};
+
+/**
+ * Modem identity and profile, all strings are NUL terminated and padded
+ * with NULs, so they are used in place without copying.
+ */
+struct profile_rec {
+	char iccid[24];		/* Up to 20 digits */
+	char imsi[16];		/* Up to 15 digits */
+	char imei[16];		/* 15 digits */
+	char plmn[8];		/* Home network MCC and MNC */
+	char oper[32];		/* Home network name */
+	char vendor[16];	/* Manufacturer (+CGMI) */
+	char model[16];		/* Model (+CGMM) */
+	char revision[32];	/* Firmware revision (+CGMR) */
+	int16_t rssi;		/* Initial signal level, dBm, 0 - random */
+	uint16_t reserved[3];
+};
+
+struct profile_db;
+
+struct profile_db *profile_open(const char *filename);
+unsigned long profile_count(const struct profile_db *db);
+const struct profile_rec *profile_get(const struct profile_db *db,
+				      unsigned long idx);
+void profile_close(struct profile_db *db);
+
+#endif	/* _PROFILE_H_ */
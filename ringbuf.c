@@ -0,0 +1,139 @@
+/**
+ * Bounded byte ring buffer
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/uio.h>
+
+#include "ringbuf.h"
+
+/**
+ * Queue as much data as fits into the buffer, returns number of queued bytes.
+ */
+size_t ringbuf_put(struct ringbuf *rb, const char *buf, size_t len)
+{
+	size_t off = rb->head & (rb->size - 1);
+	size_t l1, room = ringbuf_room(rb);
+
+	if (len > room)
+		len = room;
+
+	l1 = rb->size - off < len ? rb->size - off : len;
+	memcpy(rb->buf + off, buf, l1);
+	memcpy(rb->buf, buf + l1, len - l1);
+	rb->head += len;
+
+	return len;
+}
+
+/**
+ * Write out up to max bytes of the buffered data using at most a single
+ * writev() call, returns number of written bytes or negative error code.
+ * Non-blocking descriptor that is not ready for writing is not considered as
+ * an error.
+ */
+int ringbuf_write_fd(struct ringbuf *rb, int fd, size_t max)
+{
+	size_t off = rb->tail & (rb->size - 1);
+	size_t len = ringbuf_len(rb);
+	struct iovec iov[2];
+	ssize_t res;
+
+	if (len > max)
+		len = max;
+	if (!len)
+		return 0;
+
+	iov[0].iov_base = rb->buf + off;
+	iov[0].iov_len = rb->size - off < len ? rb->size - off : len;
+	iov[1].iov_base = rb->buf;
+	iov[1].iov_len = len - iov[0].iov_len;
+
+	res = writev(fd, iov, iov[1].iov_len ? 2 : 1);
+	if (res < 0)
+		return errno == EAGAIN || errno == EINTR ? 0 : -errno;
+
+	rb->tail += res;
+
+	return res;
+}
+
+/**
+ * Grow the buffer to fit at least size bytes, keeping queued data in order.
+ */
+int ringbuf_grow(struct ringbuf *rb, size_t size)
+{
+	size_t sz = rb->size, len = ringbuf_len(rb);
+	size_t off = rb->tail & (rb->size - 1);
+	size_t l1 = rb->size - off < len ? rb->size - off : len;
+	char *buf;
+
+	while (sz < size)
+		sz <<= 1;
+	if (sz == rb->size)
+		return 0;
+
+	buf = malloc(sz);
+	if (!buf)
+		return -ENOMEM;
+	memcpy(buf, rb->buf + off, l1);
+	memcpy(buf + l1, rb->buf, len - l1);
+	free(rb->buf);
+	rb->buf = buf;
+	rb->size = sz;
+	rb->tail = 0;
+	rb->head = len;
+
+	return 0;
+}
+
+/**
+ * Shrink a grown buffer back to size bytes once it is empty. The buffer is
+ * kept as is if the allocation fails.
+ */
+void ringbuf_shrink(struct ringbuf *rb, size_t size)
+{
+	size_t sz = 1;
+	char *buf;
+
+	while (sz < size)
+		sz <<= 1;
+	if (ringbuf_len(rb) || rb->size <= sz)
+		return;
+
+	buf = malloc(sz);
+	if (!buf)
+		return;
+	free(rb->buf);
+	rb->buf = buf;
+	rb->size = sz;
+	rb->head = rb->tail = 0;
+}
+
+int ringbuf_init(struct ringbuf *rb, size_t size)
+{
+	size_t sz = 1;
+
+	while (sz < size)	/* Round up to a power of two */
+		sz <<= 1;
+
+	rb->buf = malloc(sz);
+	if (!rb->buf)
+		return -ENOMEM;
+	rb->size = sz;
+	rb->head = rb->tail = 0;
+
+	return 0;
+}
+
+void ringbuf_fini(struct ringbuf *rb)
+{
+	free(rb->buf);
+	rb->buf = NULL;
+}
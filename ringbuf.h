@@ -0,0 +1,42 @@
+/**
+ * Bounded byte ring buffer header file
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#ifndef _RINGBUF_H_
+#define _RINGBUF_H_
+
+#include <stddef.h>
+
+struct ringbuf {
+	char *buf;
+	size_t size;		/* Always a power of two */
+	size_t head;		/* Free running write position */
+	size_t tail;		/* Free running read position */
+};
+
+static inline size_t ringbuf_len(const struct ringbuf *rb)
+{
+	return rb->head - rb->tail;
+}
+
+static inline size_t ringbuf_room(const struct ringbuf *rb)
+{
+	return rb->size - ringbuf_len(rb);
+}
+
+/* Drop the queued data */
+static inline void ringbuf_reset(struct ringbuf *rb)
+{
+	rb->tail = rb->head;
+}
+
+size_t ringbuf_put(struct ringbuf *rb, const char *buf, size_t len);
+int ringbuf_write_fd(struct ringbuf *rb, int fd, size_t max);
+int ringbuf_grow(struct ringbuf *rb, size_t size);
+void ringbuf_shrink(struct ringbuf *rb, size_t size);
+int ringbuf_init(struct ringbuf *rb, size_t size);
+void ringbuf_fini(struct ringbuf *rb);
+
+#endif	/* _RINGBUF_H_ */
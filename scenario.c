@@ -0,0 +1,406 @@
+/**
+ * Network scenario loader
+ *
+ * Scenario is a text file, which describes network dynamics timelines of
+ * modem groups. Each line is a directive, '#' starts a comment:
+ *
+ *   modem <ids>              Start a group, ids are a comma separated list
+ *                            of modem numbers and ranges (e.g. 0-99,120) or
+ *                            "*" for any modem. The first matching group
+ *                            is used for a modem.
+ *   period <time>            Repeat the group timeline with the period
+ *   spread <time>            Delay each modem timeline start by a random
+ *                            time up to the specified one
+ *   at <time> rssi <dBm>     Set signal level
+ *   at <time> ramp <dBm> <time>  Move signal level linearly
+ *   at <time> jitter <dB>    Add random noise to signal level (0 - off)
+ *   at <time> reg on|off     Register to or lose the network
+ *   at <time> plmn <plmn> ["<name>"]  Change network
+ *   at <time> sms <count> "<text>"    Receive a burst of messages
+ *
+ * Time is a number of seconds (ticks) optionally followed by the "s", "m"
+ * or "h" unit suffix. Group timelines are compiled into arrays of operations
+ * sorted by time, so the per tick evaluation costs a single comparison if
+ * nothing happens.
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+
+#include "scenario.h"
+
+#define SCN_LINE_MAX		0x200
+
+struct scn_group {
+	struct scn_range *ranges;
+	unsigned nranges;
+	struct scn_prog *prog;
+	unsigned cap;		/* Allocated operations while loading */
+};
+
+struct scenario {
+	struct scn_group *groups;
+	unsigned ngroups;
+};
+
+/**
+ * Split line into whitespace separated tokens in place, honor double quotes.
+ * The tok array should have room for SCN_TOKENS_MAX tokens.
+ */
+int scenario_tokenize(char *line, char **tok)
+{
+	char *p = line;
+	int n = 0;
+
+	while (1) {
+		p += strspn(p, " \t\r\n");
+		if (*p == '\0' || *p == '#')
+			break;
+		if (n == SCN_TOKENS_MAX)
+			return -E2BIG;
+		if (*p == '"') {
+			tok[n++] = ++p;
+			p = strchr(p, '"');
+			if (!p)
+				return -EINVAL;
+		} else {
+			tok[n++] = p;
+			p += strcspn(p, " \t\r\n");
+			if (*p == '\0')
+				break;
+		}
+		*p++ = '\0';
+	}
+
+	return n;
+}
+
+static int scn_parse_int(const char *str, int min, int max, int *val)
+{
+	char *end;
+	long v;
+
+	v = strtol(str, &end, 10);
+	if (end == str || *end != '\0' || v < min || v > max)
+		return -EINVAL;
+	*val = v;
+
+	return 0;
+}
+
+static int scn_parse_time(const char *str, uint32_t *ticks)
+{
+	unsigned long v;
+	char *end;
+
+	v = strtoul(str, &end, 10);
+	if (end == str || *str == '-')
+		return -EINVAL;
+	if (*end == 'm')
+		v *= 60;
+	else if (*end == 'h')
+		v *= 3600;
+	else if (*end != 's' && *end != '\0')
+		return -EINVAL;
+	if (*end != '\0' && end[1] != '\0')
+		return -EINVAL;
+	if (v > UINT32_MAX)
+		return -ERANGE;
+	*ticks = v;
+
+	return 0;
+}
+
+/**
+ * Parse a comma separated list of modem numbers and ranges (e.g. 0-99,120)
+ * or "*" for any modem. The string is modified, the ranges array is appended
+ * and should be freed by the caller even on error.
+ */
+int scenario_parse_ids(char *str, struct scn_range **ranges,
+		       unsigned *nranges)
+{
+	struct scn_range *r;
+	char *tok, *end;
+
+	if (strcmp(str, "*") == 0) {
+		r = realloc(*ranges, (*nranges + 1) * sizeof(*r));
+		if (!r)
+			return -ENOMEM;
+		*ranges = r;
+		r[*nranges].first = 0;
+		r[*nranges].last = UINT_MAX;
+		(*nranges)++;
+		return 0;
+	}
+
+	for (tok = strtok_r(str, ",", &end); tok;
+	     tok = strtok_r(NULL, ",", &end)) {
+		r = realloc(*ranges, (*nranges + 1) * sizeof(*r));
+		if (!r)
+			return -ENOMEM;
+		*ranges = r;
+		r = &r[*nranges];
+		switch (sscanf(tok, "%u-%u", &r->first, &r->last)) {
+		case 1:
+			r->last = r->first;
+			break;
+		case 2:
+			if (r->last >= r->first)
+				break;
+			/* Fallthrough */
+		default:
+			return -EINVAL;
+		}
+		(*nranges)++;
+	}
+
+	return *nranges ? 0 : -EINVAL;
+}
+
+static struct scn_op *scn_op_new(struct scn_group *grp)
+{
+	struct scn_prog *prog = grp->prog;
+
+	if (prog->nops == grp->cap) {
+		grp->cap = grp->cap ? grp->cap * 2 : 8;
+		prog = realloc(prog, sizeof(*prog) +
+				     grp->cap * sizeof(prog->ops[0]));
+		if (!prog)
+			return NULL;
+		grp->prog = prog;
+	}
+
+	memset(&prog->ops[prog->nops], 0x00, sizeof(prog->ops[0]));
+
+	return &prog->ops[prog->nops++];
+}
+
+/**
+ * Parse "<op> <args>..." operation, the op time is not touched. Strings are
+ * duplicated, so the op should be released with scenario_op_fini() even on
+ * error.
+ */
+int scenario_op_parse(struct scn_op *op, char **tok, int ntok)
+{
+	uint32_t dur;
+
+	if (ntok < 2)
+		return -EINVAL;
+
+	if (strcmp(tok[0], "rssi") == 0 && ntok == 2) {
+		op->type = SCN_OP_RSSI;
+		return scn_parse_int(tok[1], -113, -51, &op->arg);
+	} else if (strcmp(tok[0], "ramp") == 0 && ntok == 3) {
+		op->type = SCN_OP_RAMP;
+		if (scn_parse_time(tok[2], &dur) || dur == 0 || dur > INT32_MAX)
+			return -EINVAL;
+		op->arg2 = dur;
+		return scn_parse_int(tok[1], -113, -51, &op->arg);
+	} else if (strcmp(tok[0], "jitter") == 0 && ntok == 2) {
+		op->type = SCN_OP_JITTER;
+		return scn_parse_int(tok[1], 0, 30, &op->arg);
+	} else if (strcmp(tok[0], "reg") == 0 && ntok == 2) {
+		op->type = SCN_OP_REG;
+		if (strcmp(tok[1], "on") == 0)
+			op->arg = 1;
+		else if (strcmp(tok[1], "off") != 0)
+			return -EINVAL;
+		return 0;
+	} else if (strcmp(tok[0], "plmn") == 0 && (ntok == 2 || ntok == 3)) {
+		op->type = SCN_OP_PLMN;
+		if (strspn(tok[1], "0123456789") != strlen(tok[1]) ||
+		    strlen(tok[1]) < 5 || strlen(tok[1]) > 6)
+			return -EINVAL;
+		op->str = strdup(tok[1]);
+		op->str2 = strdup(ntok == 3 ? tok[2] : tok[1]);
+		return op->str && op->str2 ? 0 : -ENOMEM;
+	} else if (strcmp(tok[0], "sms") == 0 && ntok == 3) {
+		op->type = SCN_OP_SMS;
+		op->str = strdup(tok[2]);
+		if (!op->str)
+			return -ENOMEM;
+		return scn_parse_int(tok[1], 1, 10000, &op->arg);
+	}
+
+	return -EINVAL;
+}
+
+void scenario_op_fini(struct scn_op *op)
+{
+	free((void *)op->str);
+	free((void *)op->str2);
+	op->str = NULL;
+	op->str2 = NULL;
+}
+
+/* Parse "at <time> <op> <args>..." directive */
+static int scn_parse_op(struct scn_group *grp, char **tok, int ntok)
+{
+	struct scn_op *op;
+	uint32_t at;
+
+	if (ntok < 4 || scn_parse_time(tok[1], &at))
+		return -EINVAL;
+
+	op = scn_op_new(grp);
+	if (!op)
+		return -ENOMEM;
+	op->at = at;
+
+	return scenario_op_parse(op, tok + 2, ntok - 2);
+}
+
+/**
+ * Sort the group operations and check them against the period. Insertion
+ * sort is stable, so simultaneous operations keep the file order, and is
+ * fast enough for a mostly sorted timeline.
+ */
+static int scn_compile(struct scn_group *grp)
+{
+	struct scn_prog *prog = grp->prog;
+	struct scn_op op;
+	unsigned i, j;
+
+	for (i = 1; i < prog->nops; ++i) {
+		op = prog->ops[i];
+		for (j = i; j > 0 && prog->ops[j - 1].at > op.at; --j)
+			prog->ops[j] = prog->ops[j - 1];
+		prog->ops[j] = op;
+	}
+
+	if (prog->period && prog->nops &&
+	    prog->ops[prog->nops - 1].at >= prog->period)
+		return -ERANGE;
+
+	return 0;
+}
+
+static int scn_parse_line(struct scenario *scn, char *line)
+{
+	struct scn_group *grp;
+	char *tok[SCN_TOKENS_MAX];
+	int ntok;
+
+	ntok = scenario_tokenize(line, tok);
+	if (ntok <= 0)
+		return ntok;
+
+	if (strcmp(tok[0], "modem") == 0) {
+		if (ntok != 2)
+			return -EINVAL;
+		if (scn->ngroups && scn_compile(&scn->groups[scn->ngroups - 1]))
+			return -ERANGE;
+		grp = realloc(scn->groups, (scn->ngroups + 1) * sizeof(*grp));
+		if (!grp)
+			return -ENOMEM;
+		scn->groups = grp;
+		grp = &scn->groups[scn->ngroups++];
+		memset(grp, 0x00, sizeof(*grp));
+		grp->prog = calloc(1, sizeof(*grp->prog));
+		if (!grp->prog)
+			return -ENOMEM;
+		return scenario_parse_ids(tok[1], &grp->ranges, &grp->nranges);
+	}
+
+	if (!scn->ngroups)	/* Anything else requires a group */
+		return -EINVAL;
+	grp = &scn->groups[scn->ngroups - 1];
+
+	if (strcmp(tok[0], "period") == 0 && ntok == 2)
+		return scn_parse_time(tok[1], &grp->prog->period);
+	else if (strcmp(tok[0], "spread") == 0 && ntok == 2)
+		return scn_parse_time(tok[1], &grp->prog->spread);
+	else if (strcmp(tok[0], "at") == 0)
+		return scn_parse_op(grp, tok, ntok);
+
+	return -EINVAL;
+}
+
+struct scenario *scenario_load(const char *filename)
+{
+	struct scenario *scn;
+	char line[SCN_LINE_MAX];
+	unsigned lineno = 0;
+	int res = 0;
+	FILE *fp;
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		fprintf(stderr, "unable to open scenario %s: %s\n", filename,
+			strerror(errno));
+		return NULL;
+	}
+
+	scn = calloc(1, sizeof(*scn));
+	if (!scn) {
+		fclose(fp);
+		return NULL;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		res = scn_parse_line(scn, line);
+		if (res < 0)
+			break;
+	}
+	if (res >= 0 && scn->ngroups) {
+		lineno++;	/* Point after the last line on a period error */
+		res = scn_compile(&scn->groups[scn->ngroups - 1]);
+	}
+	fclose(fp);
+
+	if (res < 0) {
+		fprintf(stderr, "%s:%u: %s\n", filename, lineno,
+			res == -ERANGE ? "operation is out of the period" :
+			res == -ENOMEM ? "out of memory" : "invalid directive");
+		scenario_free(scn);
+		return NULL;
+	}
+
+	return scn;
+}
+
+/* Returns the modem timeline or NULL if the modem is not scripted */
+const struct scn_prog *scenario_prog(const struct scenario *scn,
+				     unsigned id)
+{
+	const struct scn_group *grp;
+	unsigned i, j;
+
+	if (!scn)
+		return NULL;
+
+	for (i = 0; i < scn->ngroups; ++i) {
+		grp = &scn->groups[i];
+		for (j = 0; j < grp->nranges; ++j)
+			if (id >= grp->ranges[j].first &&
+			    id <= grp->ranges[j].last)
+				return grp->prog;
+	}
+
+	return NULL;
+}
+
+void scenario_free(struct scenario *scn)
+{
+	struct scn_group *grp;
+	unsigned i, j;
+
+	if (!scn)
+		return;
+
+	for (i = 0; i < scn->ngroups; ++i) {
+		grp = &scn->groups[i];
+		for (j = 0; grp->prog && j < grp->prog->nops; ++j)
+			scenario_op_fini(&grp->prog->ops[j]);
+		free(grp->prog);
+		free(grp->ranges);
+	}
+	free(scn->groups);
+	free(scn);
+}
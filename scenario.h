@@ -0,0 +1,58 @@
+/**
+ * Network scenario loader header file
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#ifndef _SCENARIO_H_
+#define _SCENARIO_H_
+
+#include <stdint.h>
+
+#define SCN_TOKENS_MAX		8	/* Max directive tokens */
+
+enum scn_op_type {
+	SCN_OP_RSSI,		/* Set signal level, arg - dBm */
+	SCN_OP_RAMP,		/* Signal level ramp, arg - dBm, arg2 - ticks */
+	SCN_OP_JITTER,		/* Signal level noise, arg - amplitude, dB */
+	SCN_OP_REG,		/* Registration, arg - 1 if registered */
+	SCN_OP_PLMN,		/* Change network, str - PLMN, str2 - name */
+	SCN_OP_SMS,		/* SMS burst, arg - count, str - text */
+};
+
+struct scn_op {
+	uint32_t at;		/* Tick number since the timeline start */
+	uint32_t type;		/* See enum scn_op_type */
+	int32_t arg;
+	int32_t arg2;
+	const char *str;
+	const char *str2;
+};
+
+/* Compiled timeline of a modems group, which is shared by group members */
+struct scn_prog {
+	uint32_t period;	/* Timeline repeat period, ticks, 0 - run once */
+	uint32_t spread;	/* Per modem random start delay limit, ticks */
+	unsigned nops;
+	struct scn_op ops[];	/* Sorted by time */
+};
+
+struct scn_range {		/* Modem numbers range (inclusive) */
+	unsigned first;
+	unsigned last;
+};
+
+struct scenario;
+
+int scenario_tokenize(char *line, char **tok);
+int scenario_parse_ids(char *str, struct scn_range **ranges,
+		       unsigned *nranges);
+int scenario_op_parse(struct scn_op *op, char **tok, int ntok);
+void scenario_op_fini(struct scn_op *op);
+
+struct scenario *scenario_load(const char *filename);
+const struct scn_prog *scenario_prog(const struct scenario *scn,
+				     unsigned id);
+void scenario_free(struct scenario *scn);
+
+#endif	/* _SCENARIO_H_ */
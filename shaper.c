@@ -0,0 +1,172 @@
+/**
+ * Serial line output shaper
+ *
+ * Emulates a modem behind a slow serial line: output of a port is released
+ * after a fixed plus random latency and an additional processing delay of the
+ * executed commands, and then is paced by a token bucket at the line rate.
+ * The shaper only does accounting, the caller keeps the data and asks how
+ * much of it could be sent now and when to ask again, so the pacing is driven
+ * by the event loop timers.
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+
+#include "shaper.h"
+
+#define SHAPER_SEG(__sh, __i)	(&(__sh)->segs[(__i) % SHAPER_SEGS])
+
+/* Parse "<cmd>=<ms>" delay override, the string is split in place */
+int shaper_cfg_add_delay(struct shaper_cfg *cfg, char *str)
+{
+	struct shaper_delay *d;
+	char *p = strchr(str, '='), *end;
+	unsigned long ms;
+
+	if (!p || p == str)
+		return -EINVAL;
+	ms = strtoul(p + 1, &end, 10);
+	if (end == p + 1 || *end != '\0')
+		return -EINVAL;
+
+	d = realloc(cfg->delays, (cfg->ndelays + 1) * sizeof(*d));
+	if (!d)
+		return -ENOMEM;
+	cfg->delays = d;
+
+	*p = '\0';
+	d[cfg->ndelays].name = str;
+	d[cfg->ndelays].ms = ms;
+	cfg->ndelays++;
+
+	return 0;
+}
+
+/* Account the executed command delay to the next output */
+void shaper_cmd(struct shaper *sh, const char *name)
+{
+	unsigned i;
+
+	for (i = 0; i < sh->cfg->ndelays; ++i) {
+		if (strcasecmp(sh->cfg->delays[i].name, name) == 0) {
+			sh->delay += sh->cfg->delays[i].ms;
+			break;
+		}
+	}
+}
+
+static unsigned shaper_jitter(struct shaper *sh)
+{
+	if (!sh->cfg->jitter)
+		return 0;
+
+	sh->rnd ^= sh->rnd >> 12;
+	sh->rnd ^= sh->rnd << 25;
+	sh->rnd ^= sh->rnd >> 27;
+
+	return ((sh->rnd * 0x2545F4914F6CDD1DULL) >> 32) %
+	       (sh->cfg->jitter + 1);
+}
+
+/**
+ * Account newly queued output. Release moments never go backward to keep
+ * the output in order, too many distinct moments are merged into the last
+ * one.
+ */
+void shaper_enqueue(struct shaper *sh, size_t len, uint64_t now)
+{
+	uint64_t at = now + sh->cfg->latency + shaper_jitter(sh) + sh->delay;
+
+	sh->delay = 0;
+	if (!len)
+		return;
+
+	if (at < sh->last)
+		at = sh->last;
+	sh->last = at;
+
+	if (sh->head != sh->tail && (sh->head - sh->tail == SHAPER_SEGS ||
+	    SHAPER_SEG(sh, sh->head - 1)->at == at)) {
+		SHAPER_SEG(sh, sh->head - 1)->len += len;
+		SHAPER_SEG(sh, sh->head - 1)->at = at;
+		return;
+	}
+
+	SHAPER_SEG(sh, sh->head)->len = len;
+	SHAPER_SEG(sh, sh->head)->at = at;
+	sh->head++;
+}
+
+/**
+ * Returns number of bytes, which could be sent now, and the next moment,
+ * when the budget will grow (SHAPER_NEVER if nothing is queued).
+ */
+size_t shaper_budget(struct shaper *sh, uint64_t now, uint64_t *next)
+{
+	uint64_t cap = (uint64_t)SHAPER_BURST * 1000;
+	size_t avail = 0, bucket;
+	unsigned i;
+
+	/* Rate is bytes/s, so it is also 1/1000 of byte per ms */
+	if (now > sh->ts) {
+		if (cap < sh->cfg->rate)	/* At least 1 ms of output */
+			cap = sh->cfg->rate;
+		sh->tokens += (now - sh->ts) * sh->cfg->rate;
+		if (sh->tokens > cap)
+			sh->tokens = cap;
+		sh->ts = now;
+	}
+
+	*next = SHAPER_NEVER;
+	for (i = sh->tail; i != sh->head; ++i) {
+		if (SHAPER_SEG(sh, i)->at > now) {
+			*next = SHAPER_SEG(sh, i)->at;
+			break;
+		}
+		avail += SHAPER_SEG(sh, i)->len;
+	}
+
+	if (!sh->cfg->rate)
+		return avail;
+
+	bucket = sh->tokens / 1000;
+	if (avail > bucket) {
+		avail = bucket;
+		*next = now + 1;
+	}
+
+	return avail;
+}
+
+/* Account sent output */
+void shaper_consume(struct shaper *sh, size_t len)
+{
+	size_t l;
+
+	if (sh->cfg->rate)
+		sh->tokens -= len * 1000;
+
+	while (len && sh->tail != sh->head) {
+		l = SHAPER_SEG(sh, sh->tail)->len;
+		if (l > len) {
+			SHAPER_SEG(sh, sh->tail)->len -= len;
+			break;
+		}
+		len -= l;
+		sh->tail++;
+	}
+}
+
+void shaper_init(struct shaper *sh, const struct shaper_cfg *cfg,
+		 uint64_t seed, uint64_t now)
+{
+	memset(sh, 0x00, sizeof(*sh));
+	sh->cfg = cfg;
+	sh->rnd = seed | 1;
+	sh->ts = now;
+	sh->tokens = (uint64_t)SHAPER_BURST * 1000;
+}
@@ -0,0 +1,60 @@
+/**
+ * Serial line output shaper header file
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#ifndef _SHAPER_H_
+#define _SHAPER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHAPER_SEGS		16	/* Max distinct pending release moments */
+#define SHAPER_BURST		64	/* Token bucket depth, bytes */
+
+#define SHAPER_NEVER		UINT64_MAX
+
+struct shaper_delay {		/* Per command processing delay */
+	const char *name;	/* Command name, e.g. "+COPS" */
+	unsigned ms;
+};
+
+/* Shaping configuration, shared by ports */
+struct shaper_cfg {
+	unsigned rate;		/* Line rate, bytes/s, 0 - unlimited */
+	unsigned latency;	/* Fixed output latency, ms */
+	unsigned jitter;	/* Random latency addition limit, ms */
+	struct shaper_delay *delays;
+	unsigned ndelays;
+};
+
+struct shaper {
+	const struct shaper_cfg *cfg;
+	uint64_t rnd;		/* Jitter pseudo random generator state */
+	uint64_t ts;		/* Last token bucket refill time, ms */
+	uint64_t tokens;	/* Available budget, 1/1000 of byte */
+	unsigned delay;		/* Commands delay of the next output, ms */
+	uint64_t last;		/* Latest release moment, ms */
+	struct {		/* Queued output segments */
+		size_t len;
+		uint64_t at;		/* Release moment, ms */
+	} segs[SHAPER_SEGS];
+	unsigned head;		/* Free running segments indexes */
+	unsigned tail;
+};
+
+static inline int shaper_cfg_enabled(const struct shaper_cfg *cfg)
+{
+	return cfg->rate || cfg->latency || cfg->jitter || cfg->ndelays;
+}
+
+int shaper_cfg_add_delay(struct shaper_cfg *cfg, char *str);
+void shaper_cmd(struct shaper *sh, const char *name);
+void shaper_enqueue(struct shaper *sh, size_t len, uint64_t now);
+size_t shaper_budget(struct shaper *sh, uint64_t now, uint64_t *next);
+void shaper_consume(struct shaper *sh, size_t len);
+void shaper_init(struct shaper *sh, const struct shaper_cfg *cfg,
+		 uint64_t seed, uint64_t now);
+
+#endif	/* _SHAPER_H_ */
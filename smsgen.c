@@ -0,0 +1,323 @@
+/**
+ * SMS PDU generator
+ *
+ * Encodes an UTF-8 text into a sequence of SMS-DELIVER or SMS-SUBMIT PDUs
+ * (see 3GPP TS 23.040). The GSM 7 bit default alphabet is used whenever the
+ * text could be represented with it (see 3GPP TS 23.038), UCS2 otherwise.
+ * Long texts are automatically split into concatenated message parts.
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+
+#include "smsgen.h"
+
+#define ARRAY_SIZE(__a)		(sizeof(__a)/sizeof((__a)[0]))
+
+#define SMSGEN_UNITS_MAX	0x1000	/* Septets or UCS2 code units */
+#define GSM7_ESC		0x1b
+
+/* GSM 7 bit default alphabet, see TS 23.038 6.2.1 */
+static const uint16_t gsm7_basic[128] = {
+	0x0040, 0x00a3, 0x0024, 0x00a5, 0x00e8, 0x00e9, 0x00f9, 0x00ec,
+	0x00f2, 0x00c7, 0x000a, 0x00d8, 0x00f8, 0x000d, 0x00c5, 0x00e5,
+	0x0394, 0x005f, 0x03a6, 0x0393, 0x039b, 0x03a9, 0x03a0, 0x03a8,
+	0x03a3, 0x0398, 0x039e, 0xffff, 0x00c6, 0x00e6, 0x00df, 0x00c9,
+	0x0020, 0x0021, 0x0022, 0x0023, 0x00a4, 0x0025, 0x0026, 0x0027,
+	0x0028, 0x0029, 0x002a, 0x002b, 0x002c, 0x002d, 0x002e, 0x002f,
+	0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037,
+	0x0038, 0x0039, 0x003a, 0x003b, 0x003c, 0x003d, 0x003e, 0x003f,
+	0x00a1, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047,
+	0x0048, 0x0049, 0x004a, 0x004b, 0x004c, 0x004d, 0x004e, 0x004f,
+	0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057,
+	0x0058, 0x0059, 0x005a, 0x00c4, 0x00d6, 0x00d1, 0x00dc, 0x00a7,
+	0x00bf, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067,
+	0x0068, 0x0069, 0x006a, 0x006b, 0x006c, 0x006d, 0x006e, 0x006f,
+	0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077,
+	0x0078, 0x0079, 0x007a, 0x00e4, 0x00f6, 0x00f1, 0x00fc, 0x00e0,
+};
+
+/* GSM 7 bit default alphabet extension table, see TS 23.038 6.2.1.1 */
+static const struct {
+	uint8_t code;
+	uint16_t uc;
+} gsm7_ext[] = {
+	{0x0a, 0x000c}, {0x14, 0x005e}, {0x28, 0x007b}, {0x29, 0x007d},
+	{0x2f, 0x005c}, {0x3c, 0x005b}, {0x3d, 0x007e}, {0x3e, 0x005d},
+	{0x40, 0x007c}, {0x65, 0x20ac},
+};
+
+#define GSM7_REV_SIZE		0x400	/* Covers all but the euro sign */
+#define GSM7_REV_NONE		0xffff
+#define GSM7_REV_EXT		0x100
+
+static uint16_t gsm7_rev[GSM7_REV_SIZE];	/* Unicode -> GSM 7 bit */
+static char hex_tbl[256][2];			/* Octet -> hex digits */
+static pthread_once_t smsgen_once = PTHREAD_ONCE_INIT;
+
+static void smsgen_tables_init(void)
+{
+	static const char hexdig[] = "0123456789ABCDEF";
+	unsigned i;
+
+	for (i = 0; i < GSM7_REV_SIZE; ++i)
+		gsm7_rev[i] = GSM7_REV_NONE;
+	for (i = 0; i < ARRAY_SIZE(gsm7_basic); ++i)
+		if (gsm7_basic[i] < GSM7_REV_SIZE)
+			gsm7_rev[gsm7_basic[i]] = i;
+	for (i = 0; i < ARRAY_SIZE(gsm7_ext); ++i)
+		if (gsm7_ext[i].uc < GSM7_REV_SIZE)
+			gsm7_rev[gsm7_ext[i].uc] = GSM7_REV_EXT |
+						   gsm7_ext[i].code;
+
+	for (i = 0; i < 256; ++i) {
+		hex_tbl[i][0] = hexdig[i >> 4];
+		hex_tbl[i][1] = hexdig[i & 0xf];
+	}
+}
+
+/* Decode a next UTF-8 symbol, returns 0 on the string end */
+static uint32_t utf8_next(const unsigned char **pp)
+{
+	const unsigned char *p = *pp;
+	uint32_t c = *p;
+	int n;
+
+	if (!c)
+		return 0;
+	if (c < 0x80)
+		n = 0;
+	else if ((c & 0xe0) == 0xc0)
+		c &= 0x1f, n = 1;
+	else if ((c & 0xf0) == 0xe0)
+		c &= 0x0f, n = 2;
+	else if ((c & 0xf8) == 0xf0)
+		c &= 0x07, n = 3;
+	else
+		c = 0xfffd, n = 0;	/* Replacement character */
+
+	for (p++; n && (*p & 0xc0) == 0x80; --n, ++p)
+		c = (c << 6) | (*p & 0x3f);
+	if (n)
+		c = 0xfffd;
+	*pp = p;
+
+	return c;
+}
+
+/**
+ * Convert text to septets, returns number of septets, -ERANGE if the text
+ * could not be represented with the GSM alphabet, -E2BIG if text is too long.
+ */
+static int text_to_gsm7(const char *text, uint16_t *units)
+{
+	const unsigned char *p = (const unsigned char *)text;
+	uint32_t c;
+	uint16_t g;
+	int n = 0;
+
+	while ((c = utf8_next(&p)) != 0) {
+		if (c == 0x20ac)
+			g = GSM7_REV_EXT | 0x65;
+		else if (c < GSM7_REV_SIZE)
+			g = gsm7_rev[c];
+		else
+			return -ERANGE;
+		if (g == GSM7_REV_NONE)
+			return -ERANGE;
+		if (n + 2 > SMSGEN_UNITS_MAX)
+			return -E2BIG;
+		if (g & GSM7_REV_EXT)
+			units[n++] = GSM7_ESC;
+		units[n++] = g & 0x7f;
+	}
+
+	return n;
+}
+
+static int text_to_ucs2(const char *text, uint16_t *units)
+{
+	const unsigned char *p = (const unsigned char *)text;
+	uint32_t c;
+	int n = 0;
+
+	while ((c = utf8_next(&p)) != 0) {
+		if (n + 2 > SMSGEN_UNITS_MAX)
+			return -E2BIG;
+		if (c < 0x10000) {
+			units[n++] = c;
+		} else {	/* Surrogate pair */
+			c -= 0x10000;
+			units[n++] = 0xd800 | (c >> 10);
+			units[n++] = 0xdc00 | (c & 0x3ff);
+		}
+	}
+
+	return n;
+}
+
+static size_t put_addr(uint8_t *p, const char *addr, int smsc)
+{
+	uint8_t *s = p;
+	unsigned i, n;
+
+	if (*addr == '+')
+		addr++;
+	n = strlen(addr);
+
+	/* SMSC length is in octets, while TP-OA/TP-DA one is in digits */
+	*p++ = smsc ? 1 + (n + 1) / 2 : n;
+	*p++ = addr[-1] == '+' ? 0x91 : 0x81;
+	for (i = 0; i < n; i += 2)
+		*p++ = (addr[i] - '0') |
+		       (i + 1 < n ? addr[i + 1] - '0' : 0xf) << 4;
+
+	return p - s;
+}
+
+static uint8_t bcd_swapped(unsigned v)
+{
+	return (v % 10) << 4 | (v / 10 % 10);
+}
+
+static size_t put_scts(uint8_t *p, time_t scts, long gmtoff)
+{
+	time_t local = scts + gmtoff;
+	unsigned q = (gmtoff < 0 ? -gmtoff : gmtoff) / 60 / 15;
+	struct tm tm;
+
+	gmtime_r(&local, &tm);
+	p[0] = bcd_swapped(tm.tm_year % 100);
+	p[1] = bcd_swapped(tm.tm_mon + 1);
+	p[2] = bcd_swapped(tm.tm_mday);
+	p[3] = bcd_swapped(tm.tm_hour);
+	p[4] = bcd_swapped(tm.tm_min);
+	p[5] = bcd_swapped(tm.tm_sec);
+	p[6] = bcd_swapped(q) | (gmtoff < 0 ? 0x08 : 0);
+
+	return 7;
+}
+
+/* Pack septets starting from the septet aligned bit offset */
+static size_t gsm7_pack(uint8_t *ud, size_t bitoff, const uint16_t *s,
+			size_t n)
+{
+	size_t i, pos, sh;
+
+	for (i = 0; i < n; ++i, bitoff += 7) {
+		pos = bitoff / 8;
+		sh = bitoff % 8;
+		ud[pos] |= s[i] << sh;
+		if (sh > 1)
+			ud[pos + 1] |= s[i] >> (8 - sh);
+	}
+
+	return (bitoff + 7) / 8;
+}
+
+int smsgen_encode(const struct smsgen_msg *msg, smsgen_cb_t cb, void *priv)
+{
+	uint16_t units[SMSGEN_UNITS_MAX];
+	uint8_t pdu[12 + 176], *p, *ud;
+	char hex[sizeof(pdu) * 2 + 1];
+	unsigned nparts, part, len, maxlen, off, udhl, i;
+	int n, ucs2 = 0, res;
+
+	pthread_once(&smsgen_once, smsgen_tables_init);
+
+	n = text_to_gsm7(msg->text, units);
+	if (n == -ERANGE) {
+		ucs2 = 1;
+		n = text_to_ucs2(msg->text, units);
+	}
+	if (n < 0)
+		return n;
+
+	/* Units per part, single part could be longer without UDH */
+	maxlen = ucs2 ? 70 : 160;
+	if (n > maxlen)
+		maxlen = ucs2 ? 67 : 153;
+
+	/* Count parts first, they should not split ESC or surrogate pairs */
+	for (off = 0, nparts = 0; off < n || !nparts; off += len, nparts++) {
+		len = n - off < maxlen ? n - off : maxlen;
+		if (off + len < n &&
+		    (ucs2 ? (units[off + len - 1] & 0xfc00) == 0xd800 :
+			    units[off + len - 1] == GSM7_ESC))
+			len--;
+	}
+	if (nparts > SMSGEN_PARTS_MAX)
+		return -E2BIG;
+
+	for (off = 0, part = 1; part <= nparts; off += len, part++) {
+		len = n - off < maxlen ? n - off : maxlen;
+		if (off + len < n &&
+		    (ucs2 ? (units[off + len - 1] & 0xfc00) == 0xd800 :
+			    units[off + len - 1] == GSM7_ESC))
+			len--;
+
+		p = pdu;
+		if (msg->smsc)
+			p += put_addr(p, msg->smsc, 1);
+		else
+			*p++ = 0x00;	/* Use SMSC from the SIM */
+
+		if (msg->submit) {
+			/* TP-MTI = SUBMIT, TP-VPF = relative */
+			*p++ = 0x01 | 0x10 | (nparts > 1 ? 0x40 : 0);
+			*p++ = 0x00;			/* TP-MR */
+		} else {
+			/* TP-MTI = DELIVER, TP-MMS = no more messages */
+			*p++ = 0x00 | 0x04 | (nparts > 1 ? 0x40 : 0);
+		}
+		p += put_addr(p, msg->addr, 0);
+		*p++ = 0x00;				/* TP-PID */
+		*p++ = ucs2 ? 0x08 : 0x00;		/* TP-DCS */
+		if (msg->submit)
+			*p++ = 0xa7;			/* TP-VP = 24 hours */
+		else
+			p += put_scts(p, msg->scts, msg->gmtoff);
+
+		ud = p + 1;
+		udhl = 0;
+		if (nparts > 1) {	/* Concatenated SM, 8 bit reference */
+			ud[0] = 5;
+			ud[1] = 0x00;
+			ud[2] = 3;
+			ud[3] = msg->ref;
+			ud[4] = nparts;
+			ud[5] = part;
+			udhl = 6;
+		}
+
+		if (ucs2) {
+			for (i = 0; i < len; ++i) {
+				ud[udhl + i * 2] = units[off + i] >> 8;
+				ud[udhl + i * 2 + 1] = units[off + i];
+			}
+			*p = udhl + len * 2;		/* TP-UDL in octets */
+			p = ud + udhl + len * 2;
+		} else {
+			memset(ud + udhl, 0x00, (len * 7 + 7) / 8 + 1);
+			/* Septets begin after the header fill bits */
+			i = (udhl * 8 + 6) / 7;
+			*p = i + len;			/* TP-UDL in septets */
+			p = ud + gsm7_pack(ud, i * 7, &units[off], len);
+		}
+
+		for (i = 0; i < p - pdu; ++i)
+			memcpy(&hex[i * 2], hex_tbl[pdu[i]], 2);
+		hex[i * 2] = '\0';
+
+		res = cb(hex, i * 2, priv);
+		if (res)
+			return res;
+	}
+
+	return nparts;
+}
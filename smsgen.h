@@ -0,0 +1,33 @@
+/**
+ * SMS PDU generator header file
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#ifndef _SMSGEN_H_
+#define _SMSGEN_H_
+
+#include <time.h>
+
+#define SMSGEN_PARTS_MAX	255	/* Concatenation limit */
+
+struct smsgen_msg {
+	int submit;		/* SMS-SUBMIT if set, SMS-DELIVER otherwise */
+	const char *smsc;	/* SMSC address or NULL to omit it */
+	const char *addr;	/* Originating or destination address */
+	const char *text;	/* UTF-8 text */
+	time_t scts;		/* Service centre timestamp (DELIVER only) */
+	long gmtoff;		/* Timestamp time zone, seconds east of UTC */
+	unsigned char ref;	/* Concatenated message reference */
+};
+
+/**
+ * Callback is called for each generated PDU hex string, which is NUL
+ * terminated, but the length is passed as well to save the caller from
+ * measuring it. Non zero return value aborts the generation.
+ */
+typedef int (*smsgen_cb_t)(const char *pdu, size_t len, void *priv);
+
+int smsgen_encode(const struct smsgen_msg *msg, smsgen_cb_t cb, void *priv);
+
+#endif	/* _SMSGEN_H_ */
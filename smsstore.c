@@ -0,0 +1,89 @@
+/**
+ * SMS storage
+ *
+ * Messages are kept in a single preallocated arena of fixed size slots, so
+ * storing and deleting a message costs neither allocation nor slot search:
+ * free slots are linked into a list, which initially goes in the ascending
+ * slots order.
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "smsstore.h"
+
+/**
+ * Store a PDU hex string, returns the message index or negative error code.
+ */
+int smsstore_add(struct smsstore *ss, const char *pdu, size_t len,
+		 int state)
+{
+	struct sms_msg *msg;
+	unsigned idx;
+
+	if (len > SMS_PDU_HEX_MAX)
+		return -EINVAL;
+	if (ss->free == ss->cap)
+		return -ENOSPC;
+
+	idx = ss->free;
+	msg = &ss->msgs[idx];
+	ss->free = msg->next;
+
+	memcpy(&ss->pdus[(size_t)idx * SMS_PDU_SLOT], pdu, len);
+	ss->pdus[(size_t)idx * SMS_PDU_SLOT + len] = '\0';
+	msg->len = len;
+	msg->state = state;
+	msg->used = 1;
+	ss->nused++;
+
+	return idx;
+}
+
+int smsstore_del(struct smsstore *ss, unsigned idx)
+{
+	struct sms_msg *msg;
+
+	if (idx >= ss->cap || !ss->msgs[idx].used)
+		return -EINVAL;
+
+	msg = &ss->msgs[idx];
+	msg->used = 0;
+	msg->next = ss->free;
+	ss->free = idx;
+	ss->nused--;
+
+	return 0;
+}
+
+int smsstore_init(struct smsstore *ss, unsigned cap)
+{
+	unsigned i;
+
+	ss->msgs = calloc(cap, sizeof(*ss->msgs));
+	ss->pdus = malloc((size_t)cap * SMS_PDU_SLOT);
+	if (!ss->msgs || !ss->pdus) {
+		smsstore_fini(ss);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < cap; ++i)
+		ss->msgs[i].next = i + 1;
+	ss->cap = cap;
+	ss->nused = 0;
+	ss->free = 0;
+
+	return 0;
+}
+
+void smsstore_fini(struct smsstore *ss)
+{
+	free(ss->msgs);
+	free(ss->pdus);
+	ss->msgs = NULL;
+	ss->pdus = NULL;
+	ss->cap = 0;
+}
@@ -0,0 +1,47 @@
+/**
+ * SMS storage header file
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#ifndef _SMSSTORE_H_
+#define _SMSSTORE_H_
+
+/* SMSC address (up to 12 octets) + TPDU (up to 176 octets) as a hex string */
+#define SMS_PDU_HEX_MAX		((12 + 176) * 2)
+#define SMS_PDU_SLOT		0x180	/* Arena slot size */
+
+struct sms_msg {
+	unsigned used:1;
+	unsigned state:3;	/* 0 - REC UNREAD, 1 - REC READ, ... */
+	unsigned short len;	/* PDU hex string length */
+	unsigned next;		/* Free list linkage */
+};
+
+struct smsstore {
+	unsigned cap;		/* Number of slots */
+	unsigned nused;		/* Number of stored messages */
+	unsigned free;		/* Free list head, cap if no free slots */
+	struct sms_msg *msgs;
+	char *pdus;		/* PDU strings arena */
+};
+
+static inline const char *smsstore_pdu(const struct smsstore *ss,
+				       unsigned idx)
+{
+	return &ss->pdus[(size_t)idx * SMS_PDU_SLOT];
+}
+
+static inline const struct sms_msg *smsstore_get(const struct smsstore *ss,
+						 unsigned idx)
+{
+	return idx < ss->cap && ss->msgs[idx].used ? &ss->msgs[idx] : NULL;
+}
+
+int smsstore_add(struct smsstore *ss, const char *pdu, size_t len,
+		 int state);
+int smsstore_del(struct smsstore *ss, unsigned idx);
+int smsstore_init(struct smsstore *ss, unsigned cap);
+void smsstore_fini(struct smsstore *ss);
+
+#endif	/* _SMSSTORE_H_ */
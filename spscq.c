@@ -0,0 +1,63 @@
+/**
+ * Lock-free single producer single consumer queue of fixed size elements
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "spscq.h"
+
+/* Returns zero on success or -ENOSPC if the queue is full */
+int spscq_push(struct spscq *q, const void *elem)
+{
+	size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+	if (head - tail == q->size)
+		return -ENOSPC;
+
+	memcpy(q->buf + (head & (q->size - 1)) * q->esize, elem, q->esize);
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+
+	return 0;
+}
+
+/* Returns zero on success or -EAGAIN if the queue is empty */
+int spscq_pop(struct spscq *q, void *elem)
+{
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+	if (head == tail)
+		return -EAGAIN;
+
+	memcpy(elem, q->buf + (tail & (q->size - 1)) * q->esize, q->esize);
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+
+	return 0;
+}
+
+int spscq_init(struct spscq *q, size_t size, size_t esize)
+{
+	if (!size || size & (size - 1))
+		return -EINVAL;
+
+	q->buf = malloc(size * esize);
+	if (!q->buf)
+		return -ENOMEM;
+	q->size = size;
+	q->esize = esize;
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+
+	return 0;
+}
+
+void spscq_fini(struct spscq *q)
+{
+	free(q->buf);
+	q->buf = NULL;
+}
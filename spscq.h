@@ -0,0 +1,26 @@
+/**
+ * Lock-free single producer single consumer queue header file
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#ifndef _SPSCQ_H_
+#define _SPSCQ_H_
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+struct spscq {
+	atomic_size_t head;	/* Free running producer position */
+	atomic_size_t tail;	/* Free running consumer position */
+	size_t size;		/* Number of elements, always a power of two */
+	size_t esize;		/* Element size */
+	char *buf;
+};
+
+int spscq_push(struct spscq *q, const void *elem);
+int spscq_pop(struct spscq *q, void *elem);
+int spscq_init(struct spscq *q, size_t size, size_t esize);
+void spscq_fini(struct spscq *q);
+
+#endif	/* _SPSCQ_H_ */
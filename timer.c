@@ -0,0 +1,191 @@
+/**
+ * Hierarchical timer wheel
+ *
+ * Timers are kept in the intrusive lists of a multi level wheel with 1 ms
+ * resolution, so adding and removing a timer cost O(1) regardless of the
+ * number of pending timers. Level 0 slots hold timers that expire within the
+ * next TIMER_LVL_SIZE ms, each upper level slot covers TIMER_LVL_SIZE slots
+ * of the lower level and is cascaded (redistributed) into the lower levels
+ * when the time reaches it. Non-empty slots bitmaps allow to find the next
+ * moment, which requires processing, without the slots scanning.
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "timer.h"
+
+#define TIMER_LVL_MASK		(TIMER_LVL_SIZE - 1)
+#define TIMER_LVL_SHIFT(__l)	((__l) * TIMER_LVL_BITS)
+#define TIMER_RANGE		(1ULL << TIMER_LVL_SHIFT(TIMER_LVL_NUM))
+
+static void timer_link(struct timer **head, struct timer *t)
+{
+	t->next = *head;
+	if (t->next)
+		t->next->pprev = &t->next;
+	t->pprev = head;
+	*head = t;
+}
+
+static void timer_unlink(struct timer *t)
+{
+	*t->pprev = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+static void timer_enqueue(struct timer_wheel *tw, struct timer *t)
+{
+	uint64_t when = t->expires < tw->now ? tw->now : t->expires;
+	uint64_t delta = when - tw->now;
+	unsigned lvl;
+
+	for (lvl = 0; lvl < TIMER_LVL_NUM - 1; ++lvl)
+		if (delta < 1ULL << TIMER_LVL_SHIFT(lvl + 1))
+			break;
+	/* Far timers are parked at the wheel end and cascaded again */
+	if (delta >= TIMER_RANGE)
+		when = tw->now + TIMER_RANGE - 1;
+
+	t->lvl = lvl;
+	t->slot = (when >> TIMER_LVL_SHIFT(lvl)) & TIMER_LVL_MASK;
+	timer_link(&tw->slots[lvl][t->slot], t);
+	tw->occupied[lvl] |= 1ULL << t->slot;
+	tw->pending++;
+}
+
+/* Take the whole slot list out of the wheel */
+static void timer_slot_detach(struct timer_wheel *tw, unsigned lvl,
+			      unsigned slot, struct timer **head)
+{
+	*head = tw->slots[lvl][slot];
+	tw->slots[lvl][slot] = NULL;
+	tw->occupied[lvl] &= ~(1ULL << slot);
+	if (*head)
+		(*head)->pprev = head;
+}
+
+void timer_init(struct timer *t, timer_func_t func, void *priv)
+{
+	memset(t, 0x00, sizeof(*t));
+	t->func = func;
+	t->priv = priv;
+}
+
+/**
+ * (Re)arm the timer to fire at the absolute moment. An already expired moment
+ * is not an error, such timer fires at the next wheel run, but the requested
+ * expiration time is kept as is, so a periodic timer, which is rearmed
+ * relative to its previous expiration time, does not drift.
+ */
+void timer_add(struct timer_wheel *tw, struct timer *t, uint64_t expires)
+{
+	if (timer_pending(t))
+		timer_del(tw, t);
+	t->expires = expires;
+	timer_enqueue(tw, t);
+}
+
+void timer_del(struct timer_wheel *tw, struct timer *t)
+{
+	if (!timer_pending(t))
+		return;
+	timer_unlink(t);
+	if (!tw->slots[t->lvl][t->slot])
+		tw->occupied[t->lvl] &= ~(1ULL << t->slot);
+	tw->pending--;
+}
+
+/**
+ * Returns the nearest moment, when the wheel should be run, or TIMER_NEVER if
+ * there are no pending timers. For upper levels this is the slot cascading
+ * moment, so the caller could be woken up a bit earlier than a timer fires,
+ * but never later.
+ */
+uint64_t timer_wheel_next(const struct timer_wheel *tw)
+{
+	uint64_t bits, cur, t, next = TIMER_NEVER;
+	unsigned lvl, idx, shift;
+
+	for (lvl = 0; lvl < TIMER_LVL_NUM; ++lvl) {
+		if (!tw->occupied[lvl])
+			continue;
+		shift = TIMER_LVL_SHIFT(lvl);
+		/* First not yet processed slot of this level */
+		cur = (tw->now + (1ULL << shift) - 1) >> shift;
+		idx = cur & TIMER_LVL_MASK;
+		bits = tw->occupied[lvl];
+		if (idx)
+			bits = bits >> idx | bits << (TIMER_LVL_SIZE - idx);
+		t = (cur + __builtin_ctzll(bits)) << shift;
+		if (t < next)
+			next = t;
+	}
+
+	return next;
+}
+
+/* Redistribute the upper level slot timers, returns non-zero to go upper */
+static int timer_cascade(struct timer_wheel *tw, unsigned lvl)
+{
+	unsigned slot = (tw->now >> TIMER_LVL_SHIFT(lvl)) & TIMER_LVL_MASK;
+	struct timer *head, *t;
+
+	timer_slot_detach(tw, lvl, slot, &head);
+	while ((t = head)) {
+		timer_unlink(t);
+		tw->pending--;
+		timer_enqueue(tw, t);
+	}
+
+	return slot == 0;
+}
+
+/**
+ * Fire all timers expired up to the specified moment (inclusive). Timer
+ * handlers are free to add and delete any timers including the fired one.
+ */
+void timer_wheel_run(struct timer_wheel *tw, uint64_t now)
+{
+	struct timer *head, *t;
+	unsigned lvl, idx;
+
+	while (tw->now <= now) {
+		if (!tw->pending) {
+			tw->now = now + 1;
+			break;
+		}
+
+		idx = tw->now & TIMER_LVL_MASK;
+		if (idx == 0) {
+			for (lvl = 1; lvl < TIMER_LVL_NUM; ++lvl)
+				if (!timer_cascade(tw, lvl))
+					break;
+		} else if (!(tw->occupied[0] >> idx)) {
+			/* Nothing till the end of the level, skip it at once */
+			tw->now = (tw->now | TIMER_LVL_MASK) + 1;
+			if (tw->now > now + 1)
+				tw->now = now + 1;
+			continue;
+		}
+
+		timer_slot_detach(tw, 0, idx, &head);
+		tw->now++;
+		while ((t = head)) {
+			timer_unlink(t);
+			tw->pending--;
+			t->func(t, t->priv);
+		}
+	}
+}
+
+void timer_wheel_init(struct timer_wheel *tw, uint64_t now)
+{
+	memset(tw, 0x00, sizeof(*tw));
+	tw->now = now;
+}
@@ -0,0 +1,51 @@
+/**
+ * Hierarchical timer wheel header file
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#include <stdint.h>
+
+#define TIMER_LVL_BITS		6
+#define TIMER_LVL_SIZE		(1 << TIMER_LVL_BITS)
+#define TIMER_LVL_NUM		4	/* Covers 2^24 ms (~4.6 hours) */
+
+#define TIMER_NEVER		UINT64_MAX
+
+struct timer;
+
+typedef void (*timer_func_t)(struct timer *t, void *priv);
+
+struct timer {
+	struct timer *next;
+	struct timer **pprev;	/* NULL if the timer is not pending */
+	uint64_t expires;	/* Absolute expiration time, ms */
+	timer_func_t func;
+	void *priv;
+	uint8_t lvl;		/* Wheel level and slot, which holds the timer */
+	uint8_t slot;
+};
+
+struct timer_wheel {
+	uint64_t now;		/* Next tick to be processed, ms */
+	unsigned pending;	/* Number of pending timers */
+	uint64_t occupied[TIMER_LVL_NUM];	/* Non-empty slots bitmaps */
+	struct timer *slots[TIMER_LVL_NUM][TIMER_LVL_SIZE];
+};
+
+static inline int timer_pending(const struct timer *t)
+{
+	return t->pprev != NULL;
+}
+
+void timer_init(struct timer *t, timer_func_t func, void *priv);
+void timer_add(struct timer_wheel *tw, struct timer *t, uint64_t expires);
+void timer_del(struct timer_wheel *tw, struct timer *t);
+uint64_t timer_wheel_next(const struct timer_wheel *tw);
+void timer_wheel_run(struct timer_wheel *tw, uint64_t now);
+void timer_wheel_init(struct timer_wheel *tw, uint64_t now);
+
+#endif	/* _TIMER_H_ */
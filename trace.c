@@ -0,0 +1,286 @@
+/**
+ * Binary exchange trace
+ *
+ * Each event loop thread appends timestamped records into its own lock-free
+ * single producer single consumer ring buffer. A separate writer thread
+ * drains all the rings into the trace file, so a slow storage could only
+ * cause records dropping, but never stalls the emulation. The only exception
+ * is the session recording, which should be lossless, so it waits for the
+ * writer instead of records dropping.
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define TRACE_RING_SIZE		0x100000	/* Per thread ring size */
+
+struct trace_ring {
+	struct trace_ring *next;	/* Rings list linkage */
+	atomic_size_t head;		/* Producer position */
+	atomic_size_t tail;		/* Consumer position */
+	atomic_ulong dropped;		/* Records dropped due to overflow */
+	char buf[TRACE_RING_SIZE];
+};
+
+atomic_int trace_level;
+
+static struct {
+	FILE *fp;
+	pthread_t writer;
+	atomic_int stop;
+	_Atomic(struct trace_ring *) rings;	/* Registered rings list */
+} trace;
+
+static __thread struct trace_ring *trace_tls_ring;
+
+static uint64_t trace_now_ns(clockid_t clk)
+{
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Allocate a ring for the current thread and publish it for the writer */
+static struct trace_ring *trace_ring_get(void)
+{
+	struct trace_ring *ring = trace_tls_ring;
+
+	if (ring)
+		return ring;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	ring->next = atomic_load(&trace.rings);
+	while (!atomic_compare_exchange_weak(&trace.rings, &ring->next, ring));
+	trace_tls_ring = ring;
+
+	return ring;
+}
+
+static void trace_chunk(struct trace_ring *ring, unsigned port,
+			enum trace_dir dir, const char *buf, size_t len,
+			size_t caplen, uint64_t ts, int lossless)
+{
+	const struct timespec wait = {.tv_sec = 0, .tv_nsec = 100000};
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	size_t off = head & (TRACE_RING_SIZE - 1);
+	size_t sz = TRACE_REC_SIZE(caplen), pad = 0;
+	struct trace_rec *rec;
+
+	/* Record is never wrapped, fill the ring tail with a padding */
+	if (TRACE_RING_SIZE - off < sz)
+		pad = TRACE_RING_SIZE - off;
+	while (TRACE_RING_SIZE - (head - tail) < pad + sz) {
+		if (!lossless || atomic_load(&trace.stop)) {
+			atomic_fetch_add_explicit(&ring->dropped, 1,
+						  memory_order_relaxed);
+			return;
+		}
+		nanosleep(&wait, NULL);
+		tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	}
+
+	if (pad) {
+		/* Too short tail is skipped by the consumer implicitly */
+		if (pad >= sizeof(*rec)) {
+			rec = (struct trace_rec *)&ring->buf[off];
+			rec->dir = TRACE_PAD;
+		}
+		head += pad;
+		off = 0;
+	}
+
+	rec = (struct trace_rec *)&ring->buf[off];
+	rec->ts = ts;
+	rec->port = port;
+	rec->len = len;
+	rec->caplen = caplen;
+	rec->dir = dir;
+	rec->flags = 0;
+	rec->reserved = 0;
+	if (caplen)
+		memcpy(rec + 1, buf, caplen);
+
+	atomic_store_explicit(&ring->head, head + sz, memory_order_release);
+}
+
+void trace_data(unsigned port, enum trace_dir dir, const char *buf,
+		size_t len)
+{
+	int level = atomic_load_explicit(&trace_level, memory_order_relaxed);
+	struct trace_ring *ring;
+	uint64_t ts;
+	size_t l;
+
+	if (level == TRACE_OFF)
+		return;
+
+	ring = trace_ring_get();
+	if (!ring)
+		return;
+
+	ts = trace_now_ns(CLOCK_MONOTONIC);
+	if (level == TRACE_HDR) {
+		trace_chunk(ring, port, dir, buf, len, 0, ts, 0);
+		return;
+	}
+
+	do {
+		l = len < TRACE_CHUNK_MAX ? len : TRACE_CHUNK_MAX;
+		trace_chunk(ring, port, dir, buf, l, l, ts,
+			    level == TRACE_REC);
+		buf += l;
+		len -= l;
+	} while (len);
+}
+
+/* Write out all the ring records, returns number of written records */
+static unsigned trace_ring_drain(struct trace_ring *ring)
+{
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	const struct trace_rec *rec;
+	unsigned n = 0;
+	size_t off;
+
+	while (tail != head) {
+		off = tail & (TRACE_RING_SIZE - 1);
+		rec = (const struct trace_rec *)&ring->buf[off];
+		if (TRACE_RING_SIZE - off < sizeof(*rec) ||
+		    rec->dir == TRACE_PAD) {
+			tail += TRACE_RING_SIZE - off;
+			continue;
+		}
+		fwrite(rec, TRACE_REC_SIZE(rec->caplen), 1, trace.fp);
+		tail += TRACE_REC_SIZE(rec->caplen);
+		n++;
+	}
+
+	atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+	return n;
+}
+
+static void *trace_writer(void *arg)
+{
+	const struct timespec idle = {.tv_sec = 0, .tv_nsec = 10000000};
+	struct trace_ring *ring;
+	unsigned n;
+	int stop;
+
+	do {
+		stop = atomic_load(&trace.stop);
+		n = 0;
+		for (ring = atomic_load(&trace.rings); ring; ring = ring->next)
+			n += trace_ring_drain(ring);
+		if (n)
+			fflush(trace.fp);
+		else if (!stop)
+			nanosleep(&idle, NULL);
+	} while (!stop);
+
+	return NULL;
+}
+
+/**
+ * Change the level at runtime. A session recording is useless without the
+ * session start, so the "rec" level could be left, but not entered.
+ */
+int trace_set_level(enum trace_level level)
+{
+	if (!trace.fp)		/* Nowhere to trace */
+		return -ENOENT;
+	if (level == TRACE_REC && atomic_load(&trace_level) != TRACE_REC)
+		return -EINVAL;
+	atomic_store(&trace_level, level);
+
+	return 0;
+}
+
+int trace_parse_level(const char *str)
+{
+	if (strcmp(str, "off") == 0)
+		return TRACE_OFF;
+	else if (strcmp(str, "hdr") == 0)
+		return TRACE_HDR;
+	else if (strcmp(str, "full") == 0)
+		return TRACE_FULL;
+	else if (strcmp(str, "rec") == 0)
+		return TRACE_REC;
+
+	return -EINVAL;
+}
+
+int trace_init(const char *filename, enum trace_level level)
+{
+	struct trace_file_hdr hdr;
+	int res;
+
+	trace.fp = fopen(filename, "wb");
+	if (!trace.fp) {
+		fprintf(stderr, "unable to open trace file %s: %s\n", filename,
+			strerror(errno));
+		return -errno;
+	}
+
+	memset(&hdr, 0x00, sizeof(hdr));
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = TRACE_VERSION;
+	hdr.realtime_off = trace_now_ns(CLOCK_REALTIME) -
+			   trace_now_ns(CLOCK_MONOTONIC);
+	fwrite(&hdr, sizeof(hdr), 1, trace.fp);
+
+	res = pthread_create(&trace.writer, NULL, trace_writer, NULL);
+	if (res) {
+		fprintf(stderr, "unable to start trace writer: %s\n",
+			strerror(res));
+		fclose(trace.fp);
+		trace.fp = NULL;
+		return -res;
+	}
+
+	atomic_store(&trace_level, level);
+
+	return 0;
+}
+
+void trace_fini(void)
+{
+	struct trace_ring *ring, *next;
+	unsigned long dropped = 0;
+
+	if (!trace.fp)
+		return;
+
+	atomic_store(&trace_level, TRACE_OFF);
+	atomic_store(&trace.stop, 1);
+	pthread_join(trace.writer, NULL);
+
+	for (ring = atomic_load(&trace.rings); ring; ring = next) {
+		next = ring->next;
+		dropped += atomic_load(&ring->dropped);
+		free(ring);
+	}
+	atomic_store(&trace.rings, NULL);
+	trace_tls_ring = NULL;
+
+	if (dropped)
+		fprintf(stderr, "trace: %lu record(s) dropped\n", dropped);
+
+	fclose(trace.fp);
+	trace.fp = NULL;
+}
@@ -0,0 +1,84 @@
+/**
+ * Binary exchange trace header file
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define TRACE_MAGIC		"MDMTRACE"
+#define TRACE_VERSION		1
+
+#define TRACE_CHUNK_MAX		0x4000	/* Longer payloads are split */
+
+enum trace_level {
+	TRACE_OFF,		/* Tracing disabled */
+	TRACE_HDR,		/* Record headers only */
+	TRACE_FULL,		/* Record headers and payload */
+	TRACE_REC,		/* Lossless full trace with emulation events */
+};
+
+enum trace_dir {
+	TRACE_RX,
+	TRACE_TX,
+	TRACE_PAD,		/* Ring buffer wrap padding, never stored */
+	TRACE_TICK,		/* Modem tick event */
+	TRACE_SMS,		/* Injected SMS event, payload is the text */
+	TRACE_TEST_SMS,		/* Test SMS event */
+	TRACE_CTL,		/* Control operation, payload is the op text */
+	TRACE_CONNECT,		/* Client connected to the listening port */
+	TRACE_DISCONNECT,	/* Client gone or the port waits for one */
+};
+
+/* Trace file header */
+struct trace_file_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	int64_t realtime_off;	/* CLOCK_REALTIME - CLOCK_MONOTONIC, ns */
+};
+
+/**
+ * Trace record, followed by caplen bytes of payload and padding up to the
+ * 8 bytes boundary. Same layout is used in memory and in the file.
+ */
+struct trace_rec {
+	uint64_t ts;		/* CLOCK_MONOTONIC, ns */
+	uint32_t port;		/* Modem (port) number */
+	uint32_t len;		/* Original payload length */
+	uint16_t caplen;	/* Captured payload length */
+	uint8_t dir;		/* See enum trace_dir */
+	uint8_t flags;
+	uint32_t reserved;
+};
+
+#define TRACE_REC_SIZE(__caplen)	\
+	((sizeof(struct trace_rec) + (__caplen) + 7) & ~(size_t)7)
+
+extern atomic_int trace_level;
+
+static inline int trace_enabled(void)
+{
+	return atomic_load_explicit(&trace_level, memory_order_relaxed) !=
+	       TRACE_OFF;
+}
+
+/* Emulation events are needed only to replay a recorded session */
+static inline int trace_recording(void)
+{
+	return atomic_load_explicit(&trace_level, memory_order_relaxed) ==
+	       TRACE_REC;
+}
+
+void trace_data(unsigned port, enum trace_dir dir, const char *buf,
+		size_t len);
+int trace_set_level(enum trace_level level);
+int trace_parse_level(const char *str);
+int trace_init(const char *filename, enum trace_level level);
+void trace_fini(void);
+
+#endif	/* _TRACE_H_ */
@@ -0,0 +1,151 @@
+/**
+ * Emulator (virtual) clock
+ *
+ * All the emulated activity (modem ticks, timers, SMS timestamps) is timed
+ * by this clock, which either follows the system clocks or runs with a
+ * constant speed factor relative to them. In the "as fast as possible" mode
+ * the clock does not run by itself at all, but the event loop moves it
+ * straight to the nearest timer moment once all the threads are idle, so a
+ * long scenario takes as much time as its processing requires.
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <errno.h>
+
+#include "vclock.h"
+
+static struct {
+	enum vclock_mode mode;
+	double speed;		/* Virtual time units per real time unit */
+	uint64_t mono0;		/* Real monotonic clock at start, ms */
+	uint64_t epoch;		/* Virtual wall clock time at start, ms */
+	atomic_ullong now;	/* ASAP mode current time, ms */
+} vclock;
+
+static uint64_t vclock_mono_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+enum vclock_mode vclock_get_mode(void)
+{
+	return vclock.mode;
+}
+
+/* Current emulator monotonic time, ms */
+uint64_t vclock_now_ms(void)
+{
+	switch (vclock.mode) {
+	case VCLOCK_SCALED:
+		return vclock.mono0 +
+		       (uint64_t)((vclock_mono_ms() - vclock.mono0) *
+				  vclock.speed);
+	case VCLOCK_ASAP:
+		return atomic_load_explicit(&vclock.now, memory_order_acquire);
+	default:
+		return vclock_mono_ms();
+	}
+}
+
+/* Current emulator wall clock time, e.g. for SMS timestamps */
+time_t vclock_time(void)
+{
+	if (vclock.mode == VCLOCK_REAL)
+		return time(NULL);
+
+	return (vclock.epoch + vclock_now_ms() - vclock.mono0) / 1000;
+}
+
+/**
+ * Convert the emulator time moment into the real time event loop wait
+ * timeout. In the ASAP mode the loop waits for I/O or a clock advance only.
+ */
+int vclock_timeout(uint64_t next)
+{
+	uint64_t now = vclock_now_ms();
+	double timeout;
+
+	if (next == VCLOCK_NEVER)
+		return -1;
+	if (next <= now)
+		return 0;
+
+	switch (vclock.mode) {
+	case VCLOCK_ASAP:
+		return -1;
+	case VCLOCK_SCALED:
+		timeout = (next - now) / vclock.speed + 0.999;
+		break;
+	default:
+		timeout = next - now;
+		break;
+	}
+
+	return timeout > INT_MAX ? INT_MAX : (int)timeout;
+}
+
+/* Move the ASAP mode clock forward, it never goes backward */
+void vclock_advance(uint64_t to)
+{
+	uint64_t now = atomic_load(&vclock.now);
+
+	while (now < to && !atomic_compare_exchange_weak(&vclock.now, &now,
+							 to));
+}
+
+/**
+ * Parse the clock speed factor, where "max" means as fast as possible and
+ * is converted into zero speed.
+ */
+int vclock_parse_speed(const char *str, double *speed)
+{
+	char *end;
+
+	if (strcmp(str, "max") == 0) {
+		*speed = 0;
+		return 0;
+	}
+
+	*speed = strtod(str, &end);
+	if (*end != '\0' || !(*speed > 0))
+		return -EINVAL;
+
+	return 0;
+}
+
+/**
+ * Start the clock with the specified speed factor (1 - real time, 0 - as
+ * fast as possible) and the wall clock start time in ms since the Epoch
+ * (0 - current time).
+ */
+void vclock_init(double speed, uint64_t epoch)
+{
+	struct timespec ts;
+
+	/* NB: choose the mode before the epoch defaulting */
+	if (speed == 0)
+		vclock.mode = VCLOCK_ASAP;
+	else if (speed != 1 || epoch)
+		vclock.mode = VCLOCK_SCALED;
+	else
+		vclock.mode = VCLOCK_REAL;
+
+	if (!epoch) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		epoch = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	}
+
+	vclock.mono0 = vclock_mono_ms();
+	vclock.epoch = epoch;
+	vclock.speed = speed;
+	atomic_init(&vclock.now, vclock.mono0);
+}
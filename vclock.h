@@ -0,0 +1,29 @@
+/**
+ * Emulator (virtual) clock header file
+ *
+ * Copyright (c) 2022-2023, Sergey Ryazanov <ryazanov.s.a@gmail.com>
+ */
+
+#ifndef _VCLOCK_H_
+#define _VCLOCK_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#define VCLOCK_NEVER		UINT64_MAX
+
+enum vclock_mode {
+	VCLOCK_REAL,		/* Follow the system clocks */
+	VCLOCK_SCALED,		/* Run faster (or slower) than the real time */
+	VCLOCK_ASAP,		/* Jump to the next event as soon as idle */
+};
+
+enum vclock_mode vclock_get_mode(void);
+uint64_t vclock_now_ms(void);
+time_t vclock_time(void);
+int vclock_timeout(uint64_t next);
+void vclock_advance(uint64_t to);
+int vclock_parse_speed(const char *str, double *speed);
+void vclock_init(double speed, uint64_t epoch);
+
+#endif	/* _VCLOCK_H_ */